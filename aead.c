@@ -0,0 +1,280 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "aead.h"
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d)                                                                        \
+    do {                                                                                           \
+        a += b, d ^= a, d = ROTL(d, 16);                                                           \
+        c += d, b ^= c, b = ROTL(b, 12);                                                           \
+        a += b, d ^= a, d = ROTL(d, 8);                                                            \
+        c += d, b ^= c, b = ROTL(b, 7);                                                            \
+    } while (0)
+
+#define LIMB_MASK 0x3ffffff //poly1305 keeps its accumulator in five 26 bit limbs
+
+static uint32_t load32(const uint8_t *in) { //little endian
+    return (uint32_t) in[0] | ((uint32_t) in[1] << 8) | ((uint32_t) in[2] << 16)
+           | ((uint32_t) in[3] << 24);
+}
+
+static void store32(uint8_t *out, uint32_t value) {
+    for (int i = 0; i < 4; i += 1) {
+        out[i] = value >> (8 * i);
+    }
+    return;
+}
+
+static void store64(uint8_t *out, uint64_t value) {
+    for (int i = 0; i < 8; i += 1) {
+        out[i] = value >> (8 * i);
+    }
+    return;
+}
+
+static void chacha_block(const uint32_t input[16], uint8_t out[64]) {
+    uint32_t x[16];
+    memcpy(x, input, sizeof(x));
+
+    for (int i = 0; i < 10; i += 1) { //20 rounds, a column and a diagonal round per pass
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i += 1) {
+        store32(&out[4 * i], x[i] + input[i]);
+    }
+    return;
+}
+
+static void chacha_init(uint32_t input[16], const uint8_t key[AEAD_KEY],
+    const uint8_t nonce[AEAD_NONCE], uint32_t counter) {
+    input[0] = 0x61707865; //"expand 32-byte k"
+    input[1] = 0x3320646e;
+    input[2] = 0x79622d32;
+    input[3] = 0x6b206574;
+    for (int i = 0; i < 8; i += 1) {
+        input[4 + i] = load32(&key[4 * i]);
+    }
+    input[12] = counter;
+    for (int i = 0; i < 3; i += 1) {
+        input[13 + i] = load32(&nonce[4 * i]);
+    }
+    return;
+}
+
+static void chacha_xor(uint32_t input[16], uint8_t *data, size_t len) { //advances the counter
+    uint8_t stream[64];
+
+    while (len > 0) {
+        size_t n = (len < 64) ? len : 64;
+        chacha_block(input, stream);
+        input[12] += 1;
+        for (size_t i = 0; i < n; i += 1) {
+            data[i] ^= stream[i];
+        }
+        data += n;
+        len -= n;
+    }
+    return;
+}
+
+typedef struct {
+    uint32_t r[5], h[5], pad[4];
+    uint8_t buffer[16]; //partial block waiting for more input
+    size_t leftover;
+} poly1305_t;
+
+static void poly_init(poly1305_t *st, const uint8_t key[32]) {
+    st->r[0] = load32(&key[0]) & 0x3ffffff; //clamp r as the spec requires
+    st->r[1] = (load32(&key[3]) >> 2) & 0x3ffff03;
+    st->r[2] = (load32(&key[6]) >> 4) & 0x3ffc0ff;
+    st->r[3] = (load32(&key[9]) >> 6) & 0x3f03fff;
+    st->r[4] = (load32(&key[12]) >> 8) & 0x00fffff;
+    for (int i = 0; i < 5; i += 1) {
+        st->h[i] = 0;
+    }
+    for (int i = 0; i < 4; i += 1) {
+        st->pad[i] = load32(&key[16 + 4 * i]);
+    }
+    st->leftover = 0;
+    return;
+}
+
+static void poly_blocks(poly1305_t *st, const uint8_t *m, size_t len, uint32_t hibit) {
+    uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+
+    for (; len >= 16; m += 16, len -= 16) { //h = (h + m) * r mod 2^130 - 5
+        h0 += load32(&m[0]) & LIMB_MASK;
+        h1 += (load32(&m[3]) >> 2) & LIMB_MASK;
+        h2 += (load32(&m[6]) >> 4) & LIMB_MASK;
+        h3 += (load32(&m[9]) >> 6) & LIMB_MASK;
+        h4 += (load32(&m[12]) >> 8) | hibit;
+
+        uint64_t d0 = (uint64_t) h0 * r0 + (uint64_t) h1 * s4 + (uint64_t) h2 * s3
+                      + (uint64_t) h3 * s2 + (uint64_t) h4 * s1;
+        uint64_t d1 = (uint64_t) h0 * r1 + (uint64_t) h1 * r0 + (uint64_t) h2 * s4
+                      + (uint64_t) h3 * s3 + (uint64_t) h4 * s2;
+        uint64_t d2 = (uint64_t) h0 * r2 + (uint64_t) h1 * r1 + (uint64_t) h2 * r0
+                      + (uint64_t) h3 * s4 + (uint64_t) h4 * s3;
+        uint64_t d3 = (uint64_t) h0 * r3 + (uint64_t) h1 * r2 + (uint64_t) h2 * r1
+                      + (uint64_t) h3 * r0 + (uint64_t) h4 * s4;
+        uint64_t d4 = (uint64_t) h0 * r4 + (uint64_t) h1 * r3 + (uint64_t) h2 * r2
+                      + (uint64_t) h3 * r1 + (uint64_t) h4 * r0;
+
+        uint32_t c = d0 >> 26;
+        h0 = d0 & LIMB_MASK;
+        d1 += c, c = d1 >> 26, h1 = d1 & LIMB_MASK;
+        d2 += c, c = d2 >> 26, h2 = d2 & LIMB_MASK;
+        d3 += c, c = d3 >> 26, h3 = d3 & LIMB_MASK;
+        d4 += c, c = d4 >> 26, h4 = d4 & LIMB_MASK;
+        h0 += c * 5, c = h0 >> 26, h0 &= LIMB_MASK;
+        h1 += c;
+    }
+
+    st->h[0] = h0, st->h[1] = h1, st->h[2] = h2, st->h[3] = h3, st->h[4] = h4;
+    return;
+}
+
+static void poly_update(poly1305_t *st, const uint8_t *m, size_t len) {
+    if (st->leftover > 0) { //finish the partial block first
+        size_t n = 16 - st->leftover;
+        n = (len < n) ? len : n;
+        memcpy(&st->buffer[st->leftover], m, n);
+        st->leftover += n;
+        m += n;
+        len -= n;
+        if (st->leftover < 16) {
+            return;
+        }
+        poly_blocks(st, st->buffer, 16, 1 << 24);
+        st->leftover = 0;
+    }
+
+    size_t whole = len & ~(size_t) 15;
+    poly_blocks(st, m, whole, 1 << 24);
+    memcpy(st->buffer, &m[whole], len - whole);
+    st->leftover = len - whole;
+    return;
+}
+
+static void poly_pad16(poly1305_t *st) { //AEAD pads aad and ciphertext to whole blocks
+    static const uint8_t zeros[16] = { 0 };
+    if (st->leftover > 0) {
+        poly_update(st, zeros, 16 - st->leftover);
+    }
+    return;
+}
+
+static void poly_finish(poly1305_t *st, uint8_t tag[AEAD_TAG]) {
+    if (st->leftover > 0) { //last block gets its 1 bit right after the data instead of at 2^128
+        st->buffer[st->leftover] = 1;
+        memset(&st->buffer[st->leftover + 1], 0, 15 - st->leftover);
+        poly_blocks(st, st->buffer, 16, 0);
+    }
+
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint32_t c = h1 >> 26;
+    h1 &= LIMB_MASK;
+    h2 += c, c = h2 >> 26, h2 &= LIMB_MASK;
+    h3 += c, c = h3 >> 26, h3 &= LIMB_MASK;
+    h4 += c, c = h4 >> 26, h4 &= LIMB_MASK;
+    h0 += c * 5, c = h0 >> 26, h0 &= LIMB_MASK;
+    h1 += c;
+
+    //g = h - p, kept only when h >= p, chosen without a branch
+    uint32_t g0 = h0 + 5;
+    c = g0 >> 26, g0 &= LIMB_MASK;
+    uint32_t g1 = h1 + c;
+    c = g1 >> 26, g1 &= LIMB_MASK;
+    uint32_t g2 = h2 + c;
+    c = g2 >> 26, g2 &= LIMB_MASK;
+    uint32_t g3 = h3 + c;
+    c = g3 >> 26, g3 &= LIMB_MASK;
+    uint32_t g4 = h4 + c - (1UL << 26);
+
+    uint32_t mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    //pack into 32 bit words and add the pad, mod 2^128
+    h0 = h0 | (h1 << 26);
+    h1 = (h1 >> 6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 << 8);
+
+    uint64_t f = (uint64_t) h0 + st->pad[0];
+    store32(&tag[0], f);
+    f = (uint64_t) h1 + st->pad[1] + (f >> 32);
+    store32(&tag[4], f);
+    f = (uint64_t) h2 + st->pad[2] + (f >> 32);
+    store32(&tag[8], f);
+    f = (uint64_t) h3 + st->pad[3] + (f >> 32);
+    store32(&tag[12], f);
+    return;
+}
+
+static void aead_tag(uint32_t input[16], const uint8_t *aad, size_t aadlen, const uint8_t *data,
+    size_t len, uint8_t tag[AEAD_TAG]) { //input holds counter 0, its block is the poly1305 key
+    uint8_t block[64];
+    uint8_t lengths[16];
+    poly1305_t st;
+
+    chacha_block(input, block);
+    poly_init(&st, block);
+    poly_update(&st, aad, aadlen);
+    poly_pad16(&st);
+    poly_update(&st, data, len);
+    poly_pad16(&st);
+    store64(&lengths[0], aadlen);
+    store64(&lengths[8], len);
+    poly_update(&st, lengths, 16);
+    poly_finish(&st, tag);
+    return;
+}
+
+void aead_encrypt(const uint8_t key[AEAD_KEY], const uint8_t nonce[AEAD_NONCE], const uint8_t *aad,
+    size_t aadlen, uint8_t *data, size_t len, uint8_t tag[AEAD_TAG]) {
+    uint32_t input[16];
+
+    chacha_init(input, key, nonce, 1); //counter 0 is reserved for the poly1305 key
+    chacha_xor(input, data, len);
+    input[12] = 0;
+    aead_tag(input, aad, aadlen, data, len, tag);
+    return;
+}
+
+bool aead_decrypt(const uint8_t key[AEAD_KEY], const uint8_t nonce[AEAD_NONCE], const uint8_t *aad,
+    size_t aadlen, uint8_t *data, size_t len, const uint8_t tag[AEAD_TAG]) {
+    uint32_t input[16];
+    uint8_t expect[AEAD_TAG];
+
+    chacha_init(input, key, nonce, 0);
+    aead_tag(input, aad, aadlen, data, len, expect);
+
+    uint8_t diff = 0; //compare every byte so the time does not depend on where they differ
+    for (int i = 0; i < AEAD_TAG; i += 1) {
+        diff |= expect[i] ^ tag[i];
+    }
+    if (diff != 0) {
+        return false;
+    }
+
+    input[12] = 1;
+    chacha_xor(input, data, len);
+    return true;
+}
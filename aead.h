@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define AEAD_KEY 32 //ChaCha20 key bytes
+#define AEAD_NONCE 12 //ChaCha20 nonce bytes
+#define AEAD_TAG 16 //Poly1305 tag bytes
+
+//ChaCha20-Poly1305 as in RFC 8439, data is encrypted in place and the tag covers aad and data
+void aead_encrypt(const uint8_t key[AEAD_KEY], const uint8_t nonce[AEAD_NONCE], const uint8_t *aad,
+    size_t aadlen, uint8_t *data, size_t len, uint8_t tag[AEAD_TAG]);
+
+//checks the tag first and only decrypts data when it matches
+bool aead_decrypt(const uint8_t key[AEAD_KEY], const uint8_t nonce[AEAD_NONCE], const uint8_t *aad,
+    size_t aadlen, uint8_t *data, size_t len, const uint8_t tag[AEAD_TAG]);
@@ -0,0 +1,251 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <gmp.h>
+
+#include "arena.h"
+#include "stats.h"
+
+#define ARENA_MIN_BLOCK 32 //smallest class, header included
+#define ARENA_LARGE ARENA_CLASSES //class of blocks that came from malloc
+
+typedef struct { //ahead of every block, keeps the data 16 byte aligned
+    uint64_t cls;
+    uint64_t size; //bytes of the class, or of the malloc block
+} arena_header_t;
+
+typedef struct arena_free {
+    struct arena_free *next;
+} arena_free_t;
+
+typedef struct arena {
+    arena_free_t *free[ARENA_CLASSES]; //freed blocks of each class
+    uint8_t *bump, *end; //unused rest of the current chunk
+    int64_t live; //bytes held by this thread's gmp values, frees from other threads may undercount
+    int64_t peak; //largest live so far
+    int64_t block_base; //live when the current block started
+    int64_t block_peak; //largest growth over one block
+    uint64_t allocs, refills, large, chunk_bytes; //not yet added to the stats counters
+    struct arena *next; //orphan list
+} arena_t;
+
+static bool installed = false;
+static _Atomic size_t chunk_size = ARENA_CHUNK;
+
+static _Thread_local arena_t *local = NULL;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static arena_t *orphans = NULL; //arenas of threads that exited, with their chunks and free lists
+static arena_t stray; //home for blocks freed by a thread whose arena already went, under the lock
+
+static void arena_flush_into(arena_t *arena) { //moves the counts of arena to the stats
+    stats_add(STAT_ARENA_ALLOCS, arena->allocs);
+    stats_add(STAT_ARENA_REFILLS, arena->refills);
+    stats_add(STAT_ARENA_LARGE, arena->large);
+    stats_add(STAT_ARENA_CHUNK_BYTES, arena->chunk_bytes);
+    stats_max(STAT_ARENA_PEAK, arena->peak > 0 ? arena->peak : 0);
+    stats_max(STAT_ARENA_BLOCK_PEAK, arena->block_peak);
+    arena->allocs = arena->refills = arena->large = arena->chunk_bytes = 0;
+    return;
+}
+
+static void arena_exit(void *arg) { //runs when a thread that allocated exits
+    arena_t *arena = arg;
+
+    arena_flush_into(arena);
+    arena->live = arena->peak = arena->block_base = arena->block_peak = 0;
+    local = NULL;
+    pthread_mutex_lock(&orphan_lock);
+    arena->next = orphans;
+    orphans = arena;
+    pthread_mutex_unlock(&orphan_lock);
+    return;
+}
+
+static void arena_key_init(void) {
+    pthread_key_create(&arena_key, arena_exit);
+    return;
+}
+
+static arena_t *arena_local(void) { //the calling thread's arena, adopted or made on first use
+    if (local != NULL) {
+        return local;
+    }
+
+    pthread_once(&arena_once, arena_key_init);
+    pthread_mutex_lock(&orphan_lock);
+    arena_t *arena = orphans;
+    if (arena != NULL) {
+        orphans = arena->next;
+    }
+    pthread_mutex_unlock(&orphan_lock);
+
+    if (arena == NULL) {
+        arena = calloc(1, sizeof(arena_t));
+        if (arena == NULL) {
+            fprintf(stderr, "Error: out of memory.\n");
+            abort();
+        }
+    }
+    arena->next = NULL;
+    local = arena;
+    pthread_setspecific(arena_key, arena);
+    return arena;
+}
+
+static unsigned class_of(size_t need) { //smallest class holding need bytes
+    if (need <= ARENA_MIN_BLOCK) {
+        return 0;
+    }
+    return 64 - __builtin_clzll(need - 1) - 5; //ARENA_MIN_BLOCK is 2^5
+}
+
+static void *out_of_memory(size_t size) {
+    fprintf(stderr, "Error: could not allocate %zu bytes.\n", size);
+    abort();
+}
+
+static void *arena_alloc(size_t size) {
+    arena_t *arena = arena_local();
+    size_t need = size + sizeof(arena_header_t);
+    unsigned cls = class_of(need);
+    arena_header_t *h;
+
+    if (cls >= ARENA_CLASSES) { //too large to keep, the malloc block is freed again
+        h = malloc(need);
+        if (h == NULL) {
+            out_of_memory(size);
+        }
+        h->cls = ARENA_LARGE;
+        h->size = need;
+        arena->large += 1;
+    } else if (arena->free[cls] != NULL) { //reuse, the common case once a block has run
+        h = (arena_header_t *) arena->free[cls];
+        arena->free[cls] = arena->free[cls]->next;
+        h->cls = cls; //the link overwrote the header
+        h->size = (size_t) ARENA_MIN_BLOCK << cls;
+    } else {
+        size_t bytes = (size_t) ARENA_MIN_BLOCK << cls;
+        if ((size_t) (arena->end - arena->bump) < bytes) { //rest of the chunk is dropped
+            size_t chunk = atomic_load_explicit(&chunk_size, memory_order_relaxed);
+            chunk = (chunk > bytes) ? chunk : bytes;
+            arena->bump = malloc(chunk);
+            if (arena->bump == NULL) {
+                out_of_memory(chunk);
+            }
+            arena->end = arena->bump + chunk;
+            arena->refills += 1;
+            arena->chunk_bytes += chunk;
+        }
+        h = (arena_header_t *) arena->bump;
+        arena->bump += bytes;
+        h->cls = cls;
+        h->size = bytes;
+    }
+
+    arena->allocs += 1;
+    arena->live += h->size;
+    if (arena->live > arena->peak) {
+        arena->peak = arena->live;
+    }
+    if (arena->live - arena->block_base > arena->block_peak) {
+        arena->block_peak = arena->live - arena->block_base;
+    }
+    return h + 1;
+}
+
+static void arena_release(arena_t *arena, arena_header_t *h) { //h goes on a free list of arena
+    arena->live -= h->size;
+    if (h->cls == ARENA_LARGE) {
+        free(h);
+        return;
+    }
+    uint64_t cls = h->cls; //the link goes over the header
+    arena_free_t *f = (arena_free_t *) h;
+    f->next = arena->free[cls];
+    arena->free[cls] = f;
+    return;
+}
+
+static void arena_free(void *ptr, size_t size) {
+    (void) size; //the header knows, and gmp strings may be freed with a different size
+    if (ptr == NULL) {
+        return;
+    }
+
+    arena_header_t *h = (arena_header_t *) ptr - 1;
+    if (local != NULL) {
+        arena_release(local, h);
+        return;
+    }
+    pthread_mutex_lock(&orphan_lock); //thread exit after the arena was handed back
+    arena_release(&stray, h);
+    pthread_mutex_unlock(&orphan_lock);
+    return;
+}
+
+static void *arena_realloc(void *ptr, size_t old, size_t size) {
+    if (ptr == NULL) {
+        return arena_alloc(size);
+    }
+
+    arena_header_t *h = (arena_header_t *) ptr - 1;
+    if (h->cls != ARENA_LARGE && size + sizeof(arena_header_t) <= h->size) { //still fits
+        return ptr;
+    }
+
+    void *p = arena_alloc(size);
+    memcpy(p, ptr, (old < size) ? old : size);
+    arena_free(ptr, old);
+    return p;
+}
+
+//"arena" installs the arenas, "system" keeps malloc, has to run before gmp allocates anything
+bool arena_select(const char *arg) {
+    if (strcmp(arg, "arena") == 0) {
+        mp_set_memory_functions(arena_alloc, arena_realloc, arena_free);
+        installed = true;
+    } else if (strcmp(arg, "system") != 0) {
+        return false;
+    }
+    return true;
+}
+
+bool arena_installed(void) {
+    return installed;
+}
+
+//chunks hold ARENA_CHUNK_PRODUCTS double width products, so small moduli use less memory per
+//thread and large ones refill less often
+void arena_size_for(uint64_t bits) {
+    size_t chunk = ARENA_CHUNK_PRODUCTS * ((2 * bits + 7) / 8 + sizeof(arena_header_t));
+    chunk = (chunk < ARENA_CHUNK) ? ARENA_CHUNK : chunk;
+    chunk = (chunk > ARENA_MAX_CHUNK) ? ARENA_MAX_CHUNK : chunk;
+    atomic_store_explicit(&chunk_size, chunk, memory_order_relaxed);
+    return;
+}
+
+//a block of work is done, its temporaries are back on the free lists for the next block, so
+//this closes the per block peak and hands the counts to the stats
+void arena_block(void) {
+    if (!installed || local == NULL) {
+        return;
+    }
+    local->block_base = local->live;
+    if (STATS_ON) {
+        arena_flush_into(local);
+    }
+    return;
+}
+
+void arena_flush(void) { //counts of the calling thread, threads that exited are already in
+    if (installed && local != NULL) {
+        arena_flush_into(local);
+    }
+    return;
+}
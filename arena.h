@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define ARENA_CLASSES 16 //block sizes 32 bytes to 1 MiB, larger requests go straight to malloc
+#define ARENA_CHUNK (1 << 16) //bytes a thread takes from malloc when a class runs dry
+#define ARENA_CHUNK_PRODUCTS 64 //chunks sized for this many double width products of the modulus
+#define ARENA_MAX_CHUNK (1 << 20)
+
+//gmp allocations served from per thread slab arenas, each thread carves power of two blocks
+//from its own chunks and keeps freed blocks on per size free lists, so no lock is taken and
+//malloc is only called when a thread grows, blocks freed on another thread join that thread's
+//lists and chunks are never returned, arenas of finished threads are handed to new ones
+
+bool arena_select(const char *arg);
+
+bool arena_installed(void);
+
+void arena_size_for(uint64_t bits);
+
+void arena_block(void);
+
+void arena_flush(void);
@@ -0,0 +1,512 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <gmp.h>
+
+#include "randstate.h"
+#include "numtheory.h"
+#include "rsa.h"
+#include "rsactx.h"
+
+#define OPTIONS "hb:m:p:s:f:j:c:r:"
+
+#define MAX_SIZES 16 //modulus sizes accepted by -b
+#define MAX_RESULTS 256 //results kept for the report and comparison
+#define MIN_OPS 3 //every case runs at least this many times
+#define MAX_OPS 100000 //and at most this many
+#define INV_BATCH 8 //values per mod_inverse_batch call
+
+typedef struct {
+    char name[64]; //case name
+    uint64_t bits; //modulus size
+    uint64_t ops; //timed operations
+    double ns_per_op; //mean
+    double p50, p90, p99; //latency percentiles in ns
+    double mb_per_sec; //throughput for cases that move bytes, 0 otherwise
+} result_t;
+
+typedef struct {
+    uint64_t bits;
+    mpz_t p, q, n, e, d; //full key for this size
+    mpz_t small_e; //65537
+    mpz_t base; //random value below n
+    mpz_t base3; //random value below the three prime modulus
+    mpz_t a, b; //random operands for gcd
+    mpz_t totient; //(p - 1)(q - 1) for mod_inverse
+    mpz_t inv[INV_BATCH]; //random values below n for mod_inverse_batch, inverted in place
+    mpz_t composite; //odd composite for is_prime rejection
+    mpz_t out;
+    rsa_priv_t key;
+    rsa_priv_t key3; //three prime key of the same size
+    rsa_ctx_t rctx; //same key held in a context
+    uint8_t *payload; //input for the file cases
+    size_t payload_len;
+    FILE *plain, *cipher, *scratch; //temporary files for the file cases
+} bench_ctx_t;
+
+typedef void (*bench_fn)(bench_ctx_t *ctx);
+
+static result_t results[MAX_RESULTS];
+static size_t nresults = 0;
+static double min_ms = 200; //time spent on each case
+static FILE *table; //human readable results, stderr when the JSON goes to stdout
+static uint64_t iters = PRIME_ITERS_AUTO; //Miller-Rabin rounds, the keygen default
+
+void program_usage(void) { //prints help message
+    fprintf(stderr, "SYNOPSIS\n");
+    fprintf(stderr, "   Benchmarks the numtheory and rsa primitives.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "USAGE\n");
+    fprintf(stderr, "   ./bench [-h] [-b bits,...] [-m ms] [-p bytes] [-s seed] [-f filter]\n");
+    fprintf(stderr, "           [-j jsonfile] [-c baseline] [-r percent]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "   -h              Display program help and usage.\n");
+    fprintf(stderr, "   -b bits,...     Modulus sizes (default: 512,1024,2048,4096, up to 8192).\n");
+    fprintf(stderr, "   -m ms           Minimum time per case in milliseconds (default: 200).\n");
+    fprintf(stderr, "   -p bytes        Payload size for the file cases (default: 65536).\n");
+    fprintf(stderr, "   -s seed         Random seed (default: 1).\n");
+    fprintf(stderr, "   -f filter       Only run cases whose name contains filter.\n");
+    fprintf(stderr, "   -j jsonfile     Write results as JSON (- for stdout, table to stderr).\n");
+    fprintf(stderr, "   -c baseline     Compare against a JSON file written by -j.\n");
+    fprintf(stderr, "   -r percent      Slowdown reported as a regression (default: 10).\n");
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double *samples, uint64_t count, double pct) { //samples are sorted
+    uint64_t index = (uint64_t) (pct / 100.0 * (count - 1) + 0.5);
+    return samples[index];
+}
+
+//runs fn until min_ms has passed, then records the mean and the latency percentiles
+static void run_case(const char *name, bench_ctx_t *ctx, bench_fn fn, size_t bytes_per_op) {
+    uint64_t cap = 1024;
+    uint64_t ops = 0;
+    double *samples = malloc(cap * sizeof(double));
+    double total = 0;
+
+    fn(ctx); //warm up caches and the pow_mod context
+
+    while (ops < MAX_OPS && (ops < MIN_OPS || total < min_ms * 1e6)) {
+        double start = now_ns();
+        fn(ctx);
+        double elapsed = now_ns() - start;
+
+        if (ops == cap) {
+            cap *= 2;
+            samples = realloc(samples, cap * sizeof(double));
+        }
+        samples[ops] = elapsed;
+        total += elapsed;
+        ops += 1;
+    }
+
+    qsort(samples, ops, sizeof(double), cmp_double);
+
+    if (nresults < MAX_RESULTS) {
+        result_t *r = &results[nresults];
+        snprintf(r->name, sizeof(r->name), "%s", name);
+        r->bits = ctx->bits;
+        r->ops = ops;
+        r->ns_per_op = total / ops;
+        r->p50 = percentile(samples, ops, 50);
+        r->p90 = percentile(samples, ops, 90);
+        r->p99 = percentile(samples, ops, 99);
+        r->mb_per_sec = bytes_per_op ? (bytes_per_op / 1e6) / (r->ns_per_op / 1e9) : 0;
+        nresults += 1;
+
+        fprintf(table, "%-22s %6" PRIu64 " %10.1f %14.0f %14.0f %14.0f %14.0f", r->name, r->bits,
+            1e9 / r->ns_per_op, r->ns_per_op, r->p50, r->p90, r->p99);
+        if (bytes_per_op) {
+            fprintf(table, " %9.3f", r->mb_per_sec);
+        }
+        fprintf(table, "\n");
+        fflush(table);
+    }
+
+    free(samples);
+    return;
+}
+
+static void bench_pow_small_e(bench_ctx_t *ctx) {
+    pow_mod(ctx->out, ctx->base, ctx->small_e, ctx->n);
+    return;
+}
+
+static void bench_encrypt_small_e(bench_ctx_t *ctx) {
+    rsa_encrypt(ctx->out, ctx->base, ctx->small_e, ctx->n); //word sized exponent fast path
+    return;
+}
+
+static void bench_pow_full_d(bench_ctx_t *ctx) {
+    pow_mod(ctx->out, ctx->base, ctx->d, ctx->n);
+    return;
+}
+
+static void bench_pow_sec_full_d(bench_ctx_t *ctx) {
+    pow_mod_sec(ctx->out, ctx->base, ctx->d, ctx->n);
+    return;
+}
+
+static void bench_decrypt_crt(bench_ctx_t *ctx) { //blinded and constant time, the default
+    rsa_decrypt_crt(ctx->out, ctx->base, &ctx->key);
+    return;
+}
+
+static void bench_decrypt_crt_fast(bench_ctx_t *ctx) { //variable time, what public keys use
+    ctx->key.fast = true;
+    rsa_decrypt_crt(ctx->out, ctx->base, &ctx->key);
+    ctx->key.fast = false;
+    return;
+}
+
+static void bench_decrypt_crt3(bench_ctx_t *ctx) { //per prime threads from RSA_SPLIT_BITS
+    rsa_decrypt_crt(ctx->out, ctx->base3, &ctx->key3);
+    return;
+}
+
+static void bench_decrypt_crt3_fast(bench_ctx_t *ctx) {
+    ctx->key3.fast = true;
+    rsa_decrypt_crt(ctx->out, ctx->base3, &ctx->key3);
+    ctx->key3.fast = false;
+    return;
+}
+
+static void bench_ctx_decrypt(bench_ctx_t *ctx) {
+    rsa_ctx_decrypt(&ctx->rctx, ctx->out, ctx->base);
+    return;
+}
+
+static void bench_ctx_decrypt_fast(bench_ctx_t *ctx) {
+    ctx->rctx.priv.fast = true;
+    rsa_ctx_decrypt(&ctx->rctx, ctx->out, ctx->base);
+    ctx->rctx.priv.fast = false;
+    return;
+}
+
+static void bench_gcd(bench_ctx_t *ctx) {
+    gcd(ctx->out, ctx->a, ctx->b);
+    return;
+}
+
+static void bench_mod_inverse(bench_ctx_t *ctx) {
+    mod_inverse(ctx->out, ctx->e, ctx->totient);
+    return;
+}
+
+static void bench_mod_inverse_batch(bench_ctx_t *ctx) {
+    mpz_ptr vals[INV_BATCH];
+    for (size_t j = 0; j < INV_BATCH; j += 1) {
+        vals[j] = ctx->inv[j];
+    }
+    mod_inverse_batch(vals, vals, INV_BATCH, ctx->n);
+    return;
+}
+
+static void bench_is_prime(bench_ctx_t *ctx) {
+    is_prime(ctx->p, iters);
+    return;
+}
+
+static void bench_is_composite(bench_ctx_t *ctx) {
+    is_prime(ctx->composite, iters);
+    return;
+}
+
+static void bench_make_prime(bench_ctx_t *ctx) {
+    make_prime(ctx->out, ctx->bits / 2, iters);
+    return;
+}
+
+static void bench_encrypt_file(bench_ctx_t *ctx) {
+    rewind(ctx->plain);
+    rewind(ctx->scratch);
+    rsa_encrypt_file(ctx->plain, ctx->scratch, ctx->n, ctx->e);
+    fflush(ctx->scratch);
+    return;
+}
+
+static void bench_decrypt_file(bench_ctx_t *ctx) {
+    rewind(ctx->cipher);
+    rewind(ctx->scratch);
+    rsa_decrypt_file_crt(ctx->cipher, ctx->scratch, &ctx->key);
+    fflush(ctx->scratch);
+    return;
+}
+
+static void bench_decrypt_file_fast(bench_ctx_t *ctx) { //variable time, may use the vector kernels
+    ctx->key.fast = true;
+    bench_decrypt_file(ctx);
+    ctx->key.fast = false;
+    return;
+}
+
+static bool selected(const char *filter, const char *name) {
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static void bench_size(uint64_t bits, size_t payload_len, const char *filter) {
+    bench_ctx_t ctx = { .bits = bits, .payload_len = payload_len };
+    mpz_inits(ctx.p, ctx.q, ctx.n, ctx.e, ctx.d, ctx.small_e, ctx.base, ctx.base3, ctx.a, ctx.b,
+        ctx.totient, ctx.composite, ctx.out, NULL);
+    rsa_priv_init(&ctx.key);
+    rsa_priv_init(&ctx.key3);
+
+    rsa_make_pub_r(ctx.p, ctx.q, ctx.n, ctx.e, bits, iters, RSA_DEFAULT_E, 2, state); //as keygen makes
+    rsa_make_priv(ctx.d, ctx.e, ctx.p, ctx.q);
+    rsa_make_crt(&ctx.key, ctx.n, ctx.d, ctx.p, ctx.q);
+    rsa_ctx_init(&ctx.rctx, 1);
+    rsa_ctx_set_priv(&ctx.rctx, &ctx.key);
+
+    mpz_set_ui(ctx.small_e, 65537);
+    mpz_urandomm(ctx.base, state, ctx.n);
+    mpz_urandomb(ctx.a, state, bits);
+    mpz_urandomb(ctx.b, state, bits);
+    for (size_t j = 0; j < INV_BATCH; j += 1) {
+        mpz_init(ctx.inv[j]);
+        mpz_urandomm(ctx.inv[j], state, ctx.n);
+    }
+
+    mpz_sub_ui(ctx.totient, ctx.p, 1);
+    mpz_sub_ui(ctx.out, ctx.q, 1);
+    mpz_mul(ctx.totient, ctx.totient, ctx.out);
+
+    mpz_mul(ctx.composite, ctx.p, ctx.p); //odd, and Miller-Rabin has to do real work to reject it
+    mpz_tdiv_q_2exp(ctx.composite, ctx.composite, mpz_sizeinbase(ctx.p, 2));
+    mpz_setbit(ctx.composite, 0);
+    while (mpz_probab_prime_p(ctx.composite, 25) != 0) {
+        mpz_add_ui(ctx.composite, ctx.composite, 2);
+    }
+
+    if (selected(filter, "pow_mod_small_e")) {
+        run_case("pow_mod_small_e", &ctx, bench_pow_small_e, 0);
+    }
+    if (selected(filter, "rsa_encrypt_small_e")) {
+        run_case("rsa_encrypt_small_e", &ctx, bench_encrypt_small_e, 0);
+    }
+    if (selected(filter, "pow_mod_full_d")) {
+        run_case("pow_mod_full_d", &ctx, bench_pow_full_d, 0);
+    }
+    if (selected(filter, "pow_mod_sec_full_d")) {
+        run_case("pow_mod_sec_full_d", &ctx, bench_pow_sec_full_d, 0);
+    }
+    if (selected(filter, "rsa_decrypt_crt")) {
+        run_case("rsa_decrypt_crt", &ctx, bench_decrypt_crt, 0);
+    }
+    if (selected(filter, "rsa_decrypt_crt_fast")) {
+        run_case("rsa_decrypt_crt_fast", &ctx, bench_decrypt_crt_fast, 0);
+    }
+    if (selected(filter, "rsa_decrypt_crt3")) {
+        mpz_t primes[3], n3, e3, d3;
+        mpz_ptr pp[3] = { primes[0], primes[1], primes[2] };
+        mpz_inits(primes[0], primes[1], primes[2], n3, e3, d3, NULL);
+        rsa_make_pub_multi(pp, 3, n3, e3, bits, iters, RSA_DEFAULT_E, 3, state);
+        rsa_make_priv_multi(d3, e3, pp, 3);
+        rsa_make_crt_multi(&ctx.key3, n3, d3, pp, 3);
+        mpz_urandomm(ctx.base3, state, n3); //the two prime cases keep their own base
+        mpz_clears(primes[0], primes[1], primes[2], n3, e3, d3, NULL);
+
+        run_case("rsa_decrypt_crt3", &ctx, bench_decrypt_crt3, 0);
+        if (selected(filter, "rsa_decrypt_crt3_fast")) {
+            run_case("rsa_decrypt_crt3_fast", &ctx, bench_decrypt_crt3_fast, 0);
+        }
+    }
+    if (selected(filter, "rsa_ctx_decrypt")) {
+        run_case("rsa_ctx_decrypt", &ctx, bench_ctx_decrypt, 0);
+    }
+    if (selected(filter, "rsa_ctx_decrypt_fast")) {
+        run_case("rsa_ctx_decrypt_fast", &ctx, bench_ctx_decrypt_fast, 0);
+    }
+    if (selected(filter, "gcd")) {
+        run_case("gcd", &ctx, bench_gcd, 0);
+    }
+    if (selected(filter, "mod_inverse")) {
+        run_case("mod_inverse", &ctx, bench_mod_inverse, 0);
+    }
+    if (selected(filter, "mod_inverse_batch")) {
+        run_case("mod_inverse_batch", &ctx, bench_mod_inverse_batch, 0);
+    }
+    if (selected(filter, "is_prime_prime")) {
+        run_case("is_prime_prime", &ctx, bench_is_prime, 0);
+    }
+    if (selected(filter, "is_prime_composite")) {
+        run_case("is_prime_composite", &ctx, bench_is_composite, 0);
+    }
+    if (selected(filter, "make_prime")) {
+        run_case("make_prime", &ctx, bench_make_prime, 0);
+    }
+
+    if (selected(filter, "encrypt_file") || selected(filter, "decrypt_file")) {
+        ctx.payload = malloc(payload_len);
+        for (size_t i = 0; i < payload_len; i += 1) {
+            ctx.payload[i] = gmp_urandomb_ui(state, 8);
+        }
+        ctx.plain = tmpfile();
+        ctx.cipher = tmpfile();
+        ctx.scratch = tmpfile();
+        fwrite(ctx.payload, sizeof(uint8_t), payload_len, ctx.plain);
+        fflush(ctx.plain);
+        rewind(ctx.plain);
+        rsa_encrypt_file(ctx.plain, ctx.cipher, ctx.n, ctx.e); //ciphertext for the decrypt case
+        fflush(ctx.cipher);
+
+        if (selected(filter, "encrypt_file")) {
+            run_case("encrypt_file", &ctx, bench_encrypt_file, payload_len);
+        }
+        if (selected(filter, "decrypt_file")) {
+            run_case("decrypt_file", &ctx, bench_decrypt_file, payload_len);
+        }
+        if (selected(filter, "decrypt_file_fast")) {
+            run_case("decrypt_file_fast", &ctx, bench_decrypt_file_fast, payload_len);
+        }
+
+        fclose(ctx.plain);
+        fclose(ctx.cipher);
+        fclose(ctx.scratch);
+        free(ctx.payload);
+    }
+
+    for (size_t j = 0; j < INV_BATCH; j += 1) {
+        mpz_clear(ctx.inv[j]);
+    }
+    rsa_ctx_clear(&ctx.rctx);
+    rsa_priv_clear(&ctx.key);
+    rsa_priv_clear(&ctx.key3);
+    mpz_clears(ctx.p, ctx.q, ctx.n, ctx.e, ctx.d, ctx.small_e, ctx.base, ctx.base3, ctx.a, ctx.b,
+        ctx.totient, ctx.composite, ctx.out, NULL);
+    return;
+}
+
+static void write_json(FILE *out) { //one result per line so -c can read it back with sscanf
+    fprintf(out, "{\n  \"results\": [\n");
+    for (size_t i = 0; i < nresults; i += 1) {
+        result_t *r = &results[i];
+        fprintf(out,
+            "    {\"name\": \"%s\", \"bits\": %" PRIu64 ", \"ops\": %" PRIu64 ", "
+            "\"ops_per_sec\": %.3f, \"ns_per_op\": %.1f, \"p50_ns\": %.1f, \"p90_ns\": %.1f, "
+            "\"p99_ns\": %.1f, \"mb_per_sec\": %.3f}%s\n",
+            r->name, r->bits, r->ops, 1e9 / r->ns_per_op, r->ns_per_op, r->p50, r->p90, r->p99,
+            r->mb_per_sec, (i + 1 < nresults) ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    return;
+}
+
+//prints the change in ns/op against the baseline, returns the number of regressions
+static int compare(FILE *baseline, double threshold) {
+    char line[1024];
+    int regressions = 0;
+
+    fprintf(table, "\n%-22s %6s %14s %14s %9s\n", "compare", "bits", "base ns/op", "ns/op",
+        "change");
+    while (fgets(line, sizeof(line), baseline) != NULL) {
+        char name[64];
+        uint64_t bits, ops;
+        double ops_per_sec, ns_per_op;
+        if (sscanf(line,
+                " {\"name\": \"%63[^\"]\", \"bits\": %" SCNu64 ", \"ops\": %" SCNu64 ", "
+                "\"ops_per_sec\": %lf, \"ns_per_op\": %lf",
+                name, &bits, &ops, &ops_per_sec, &ns_per_op)
+            != 5) {
+            continue;
+        }
+
+        for (size_t i = 0; i < nresults; i += 1) {
+            if (results[i].bits != bits || strcmp(results[i].name, name) != 0) {
+                continue;
+            }
+            double change = (results[i].ns_per_op - ns_per_op) / ns_per_op * 100.0;
+            bool slower = change > threshold;
+            fprintf(table, "%-22s %6" PRIu64 " %14.0f %14.0f %+8.1f%%%s\n", name, bits, ns_per_op,
+                results[i].ns_per_op, change, slower ? "  REGRESSION" : "");
+            regressions += slower;
+        }
+    }
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    int opt = 0;
+    uint64_t sizes[MAX_SIZES] = { 512, 1024, 2048, 4096 };
+    size_t nsizes = 4;
+    size_t payload_len = 65536;
+    uint64_t seed = 1;
+    double threshold = 10;
+    char *filter = NULL;
+    char *json = NULL;
+    char *baseline = NULL;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': program_usage(); exit(0);
+        case 'b':
+            nsizes = 0;
+            for (char *tok = strtok(optarg, ","); tok != NULL && nsizes < MAX_SIZES;
+                 tok = strtok(NULL, ",")) {
+                sizes[nsizes] = strtoull(tok, NULL, 10);
+                nsizes += 1;
+            }
+            break;
+        case 'm': min_ms = strtod(optarg, NULL); break;
+        case 'p': payload_len = strtoull(optarg, NULL, 10); break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        case 'f': filter = optarg; break;
+        case 'j': json = optarg; break;
+        case 'c': baseline = optarg; break;
+        case 'r': threshold = strtod(optarg, NULL); break;
+        default: program_usage(); exit(1);
+        }
+    }
+
+    FILE *base = NULL;
+    if (baseline != NULL && (base = fopen(baseline, "r")) == NULL) {
+        perror("Error");
+        return 1;
+    }
+
+    randstate_init(seed);
+
+    table = (json != NULL && strcmp(json, "-") == 0) ? stderr : stdout;
+    fprintf(table, "%-22s %6s %10s %14s %14s %14s %14s %9s\n", "case", "bits", "ops/sec", "ns/op",
+        "p50 ns", "p90 ns", "p99 ns", "MB/s");
+    for (size_t i = 0; i < nsizes; i += 1) {
+        bench_size(sizes[i], payload_len, filter);
+    }
+
+    if (json != NULL) {
+        FILE *out = (strcmp(json, "-") == 0) ? stdout : fopen(json, "w");
+        if (out == NULL) {
+            perror("Error");
+        } else {
+            write_json(out);
+            if (out != stdout) {
+                fclose(out);
+            }
+        }
+    }
+
+    int regressions = 0;
+    if (base != NULL) {
+        regressions = compare(base, threshold);
+        fclose(base);
+    }
+
+    randstate_clear();
+    return regressions > 0 ? 2 : 0;
+}
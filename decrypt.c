@@ -5,29 +5,57 @@
 #include <gmp.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <sys/types.h>
 
 #include "randstate.h"
 #include "rsa.h"
 #include "numtheory.h"
+#include "rsactx.h"
+#include "stats.h"
+#include "arena.h"
+#include "keyfile.h"
+#include "ringio.h"
 
-#define OPTIONS "hvi:o:n:"
+#define OPTIONS "hvmfr:x:q:w:i:o:n:t:"
+
+static const struct option long_options[] = { //long only options
+    { "stats", optional_argument, NULL, 'S' },
+    { "alloc", required_argument, NULL, 'A' },
+    { NULL, 0, NULL, 0 },
+};
 
 void program_usage(void) { //prints help message
     fprintf(stderr, "SYNOPSIS\n");
     fprintf(stderr, "   Decrypts data using RSA decryption.\n");
     fprintf(stderr, "   Encrypted data is encrypted by the encrypt program.\n");
+    fprintf(stderr, "   Exits with 1 when the input is malformed, truncated, fails authentication or\n");
+    fprintf(stderr, "   cannot be read, or the output cannot be written, hybrid output written to a\n");
+    fprintf(stderr, "   regular file is then truncated.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "USAGE\n");
-    fprintf(stderr, "   ./decrypt [-hv] [-i infile] [-o outfile] -n privkey\n");
+    fprintf(stderr, "   ./decrypt [-hvmf] [--stats[=json]] [--alloc=arena] [-t threads] [-q depth [-w bytes]] [-r start:len [-x index]]\n");
+    fprintf(stderr, "             [-i infile] [-o outfile] -n privkey\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "OPTIONS\n");
     fprintf(stderr, "   -h              Display program help and usage.\n");
     fprintf(stderr, "   -v              Display verbose program output.\n");
+    fprintf(stderr, "   --stats[=json]  Print hot path counters and timers to stderr at exit.\n");
+    fprintf(stderr, "   --alloc=arena   Serve GMP allocations from per thread arenas (default: system).\n");
+    fprintf(stderr, "   -m              Memory map a regular input file, buffer output writes.\n");
+    fprintf(stderr, "   -f              Fast variable time private key operations, their timing\n");
+    fprintf(stderr, "                   leaks the private key, only for hosts nobody else shares.\n");
+    fprintf(stderr, "   -t threads      Worker threads for the block pipeline (default: 1).\n");
+    fprintf(stderr, "   -q depth        Read ahead and write behind with depth buffers per file in\n");
+    fprintf(stderr, "                   flight, through io_uring or else an I/O thread (default: off).\n");
+    fprintf(stderr, "   -w bytes        Size of each -q buffer (default: %d).\n", RINGIO_SIZE);
+    fprintf(stderr, "   -r start:len    Decrypt only plaintext bytes start to start + len - 1,\n");
+    fprintf(stderr, "                   reading just the blocks that hold them.\n");
+    fprintf(stderr, "   -x index        Block index written by encrypt -x, needed by -r on hex input.\n");
     fprintf(stderr, "   -i infile       Input file of data to decrypt (default: stdin).\n");
     fprintf(stderr, "   -o outfile      Output file for decrypted data (default: stdout).\n");
-    fprintf(stderr, "   -n pvfile       Private key file (default: rsa.priv).\n");
+    fprintf(stderr, "   -n pvfile       Private key file, text or compiled (default: rsa.priv).\n");
 }
 
 int bitcounter(mpz_t x) { //For verbose printing. Print the number of bits.
@@ -49,21 +77,62 @@ int main(int argc, char **argv) {
 
     int opt = 0;
     bool test_v = false; //checks for verbose printing
+    rsa_opts_t opts = { .threads = 1 }; //file options, one pipeline worker by default
     bool openprivfile = false;
+    bool fast = false; //private key blinded and constant time unless -f
+    bool openindex = false;
+    bool range = false; //only decrypt plaintext bytes [range_start, range_start + range_len)
+    uint64_t range_start = 0, range_len = 0;
     FILE *infile = stdin;
     FILE *outfile = stdout;
     FILE *pvfile; //private file
 
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'h': program_usage(); exit(0);
         case 'v': test_v = true; break; 
+        case 'm': opts.mmap = true; break; //mapped input, large buffered output
+        case 'f': fast = true; break; //variable time private key operations
+        case 't': opts.threads = strtoull(optarg, NULL, 10); break; //worker threads
+        case 'q': opts.io_depth = strtoull(optarg, NULL, 10); break; //buffers in flight per file
+        case 'w': opts.io_size = strtoull(optarg, NULL, 10); break; //bytes per buffer
+        case 'r': { //plaintext range as start:len
+            char *end = NULL;
+            range_start = strtoull(optarg, &end, 10);
+            if (*end != ':') {
+                program_usage();
+                exit(1);
+            }
+            range_len = strtoull(end + 1, &end, 10);
+            if (*end != '\0') {
+                program_usage();
+                exit(1);
+            }
+            range = true;
+            break;
+        }
+        case 'x':
+            opts.index = fopen(optarg, "r");
+            openindex = true;
+            break;
         case 'i': infile = fopen(optarg, "r"); break; 
         case 'o': outfile = fopen(optarg, "w"); break;
         case 'n':
             pvfile = fopen(optarg, "r"); 
             openprivfile = true; //does not open default file
             break;
+        case 'S':
+            if (!stats_parse(optarg)) { //only text and json reports exist
+                program_usage();
+                exit(1);
+            }
+            break;
+        case 'A':
+            if (!arena_select(optarg)) { //arena or system, installed before gmp allocates
+                program_usage();
+                exit(1);
+            }
+            break;
         default: program_usage(); exit(1);
         }
     }
@@ -73,30 +142,92 @@ int main(int argc, char **argv) {
         pvfile = fopen("rsa.priv", "r"); //default open rsa.priv
     }
 
-    if (!pvfile) { //not able to open, show error message
+    if (!pvfile || (openindex && !opts.index)) { //not able to open, show error message
         perror("Error");
         fclose(infile); //close files
         fclose(outfile);
         return 1;
     }
 
-    mpz_t n, e;
-    mpz_inits(n, e, NULL);
+    if (opts.mmap && opts.io_depth > 0) { //both replace stdio, only one can own the files
+        fprintf(stderr, "Error: -m and -q cannot be used together.\n");
+        if (opts.index) {
+            fclose(opts.index);
+        }
+        fclose(pvfile);
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
 
-    rsa_read_priv(n, e, pvfile); //read in from the private file
+    if (opts.io_size > 0 && opts.io_depth == 0) { //the buffers only exist with -q
+        fprintf(stderr, "Error: -w needs -q.\n");
+        if (opts.index) {
+            fclose(opts.index);
+        }
+        fclose(pvfile);
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
+
+    rsa_ctx_t ctx; //holds the key and its montgomery data for the whole run
+    rsa_ctx_init(&ctx, 0);
+
+    rsa_priv_t key;
+    rsa_priv_init(&key);
+
+    if (keyfile_detect(pvfile)) { //compiled key, loads straight into the context
+        if (!keyfile_read_priv(&ctx, pvfile)) {
+            fprintf(stderr, "Error: invalid compiled key.\n");
+            rsa_ctx_clear(&ctx);
+            rsa_priv_clear(&key);
+            fclose(pvfile);
+            fclose(infile);
+            fclose(outfile);
+            return 1;
+        }
+    } else {
+        rsa_read_priv_crt(&key, pvfile); //read in from the private file, with CRT values if present
+        rsa_ctx_set_priv(&ctx, &key);
+    }
+    ctx.priv.fast = fast; //workers decrypt with ctx.priv too
 
     if (test_v) { //use bitcounter to count bits and print the verbose options
-        gmp_printf("n (%d bits) = %Zd\n", bitcounter(n), n); //public mod
-        gmp_printf("e (%d bits) = %Zd\n", bitcounter(e), e); //private key
+        gmp_printf("n (%d bits) = %Zd\n", bitcounter(ctx.priv.n), ctx.priv.n); //public mod
+        gmp_printf("e (%d bits) = %Zd\n", bitcounter(ctx.priv.d), ctx.priv.d); //private key
+        if (ctx.priv.crt) {
+            gmp_printf("p (%d bits) = %Zd\n", bitcounter(ctx.priv.p), ctx.priv.p); //first prime
+            gmp_printf("q (%d bits) = %Zd\n", bitcounter(ctx.priv.q), ctx.priv.q); //second prime
+            for (uint64_t k = 0; k < ctx.priv.extra; k += 1) { //multi-prime keys
+                gmp_printf("r%" PRIu64 " (%d bits) = %Zd\n", k + 1, bitcounter(ctx.priv.r[k]),
+                    ctx.priv.r[k]);
+            }
+        }
     }
 
-    rsa_decrypt_file(infile, outfile, n, e); //decrypt the file by writing to outfile
+    int exit_code = 0;
+    if (range) { //seeks to the blocks holding the range
+        exit_code = rsa_ctx_decrypt_range(&ctx, infile, outfile, range_start, range_len, &opts) ? 0 : 1;
+    } else {
+        exit_code = rsa_ctx_decrypt_file(&ctx, infile, outfile, &opts) ? 0 : 1; //writes to outfile
+    }
 
     //clear and close all the files
-    mpz_clears(n, e, NULL);
+    rsa_ctx_clear(&ctx);
+    rsa_priv_clear(&key);
     fclose(pvfile);
     fclose(infile);
-    fclose(outfile);
+    if (fclose(outfile) != 0) { //the last buffered bytes can still fail to write
+        perror("Error");
+        exit_code = 1;
+    }
+    if (opts.index) {
+        fclose(opts.index);
+    }
+
+    arena_flush(); //counts of the main thread, workers added theirs as they exited
+    stats_report(stderr); //no output unless --stats was given
 
-    return 0;
+    return exit_code;
 }
@@ -5,6 +5,7 @@
 #include <gmp.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <sys/types.h>
 #include <limits.h>
@@ -12,23 +13,47 @@
 #include "randstate.h"
 #include "rsa.h"
 #include "numtheory.h"
+#include "rsactx.h"
+#include "stats.h"
+#include "arena.h"
+#include "keyfile.h"
+#include "ringio.h"
 
-#define OPTIONS "hvi:o:n:"
+#define OPTIONS "hvbmsx:q:w:i:o:n:t:"
+
+static const struct option long_options[] = { //long only options
+    { "stats", optional_argument, NULL, 'S' },
+    { "alloc", required_argument, NULL, 'A' },
+    { NULL, 0, NULL, 0 },
+};
 
 void program_usage(void) { //prints help message
     fprintf(stderr, "SYNOPSIS\n");
     fprintf(stderr, "   Encrypts data using RSA encryption.\n");
     fprintf(stderr, "   Encrypted data is decrypted by the decrypt program.\n");
+    fprintf(stderr, "   Exits with 1 when the input cannot be read or the output cannot be written.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "USAGE\n");
-    fprintf(stderr, "   ./encrypt [-hv] [-i infile] [-o outfile] -n pubkey\n");
+    fprintf(stderr, "   ./encrypt [-hvbms] [--stats[=json]] [--alloc=arena] [-t threads] [-q depth [-w bytes]] [-x index]\n");
+    fprintf(stderr, "             [-i infile] [-o outfile] -n pubkey\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "OPTIONS\n");
     fprintf(stderr, "   -h              Display program help and usage.\n");
     fprintf(stderr, "   -v              Display verbose program output.\n");
+    fprintf(stderr, "   --stats[=json]  Print hot path counters and timers to stderr at exit.\n");
+    fprintf(stderr, "   --alloc=arena   Serve GMP allocations from per thread arenas (default: system).\n");
+    fprintf(stderr, "   -b              Write a binary container instead of hex lines.\n");
+    fprintf(stderr, "   -m              Memory map a regular input file, buffer output writes.\n");
+    fprintf(stderr, "   -s              Wrap a random session key with RSA, stream the data with\n");
+    fprintf(stderr, "                   ChaCha20-Poly1305 (hybrid mode, decrypt detects it).\n");
+    fprintf(stderr, "   -t threads      Worker threads for the block pipeline (default: 1).\n");
+    fprintf(stderr, "   -q depth        Read ahead and write behind with depth buffers per file in\n");
+    fprintf(stderr, "                   flight, through io_uring or else an I/O thread (default: off).\n");
+    fprintf(stderr, "   -w bytes        Size of each -q buffer (default: %d).\n", RINGIO_SIZE);
+    fprintf(stderr, "   -x index        Also write a block index, decrypt -r uses it on hex output.\n");
     fprintf(stderr, "   -i infile       Input file of data to encrypt (default: stdin).\n");
     fprintf(stderr, "   -o outfile      Output file for encrypted data (default: stdout).\n");
-    fprintf(stderr, "   -n pbfile       Public key file (default: rsa.pub).\n");
+    fprintf(stderr, "   -n pbfile       Public key file, text or compiled (default: rsa.pub).\n");
 }
 
 int bitcounter(mpz_t x) { //For verbose printing. Print the number of bits.
@@ -49,21 +74,45 @@ int main(int argc, char **argv) {
 
     int opt = 0;
     bool test_v = false;
+    rsa_opts_t opts = { .threads = 1 }; //file options, one pipeline worker by default
     bool openpubfile = false;
+    bool openindex = false;
     FILE *infile = stdin;
     FILE *outfile = stdout;
     FILE *pbfile; //public file
 
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'h': program_usage(); exit(0);
         case 'v': test_v = true; break; 
+        case 'b': opts.binary = true; break; //fixed width binary blocks
+        case 'm': opts.mmap = true; break; //mapped input, large buffered output
+        case 's': opts.hybrid = true; break; //session key plus symmetric cipher
+        case 't': opts.threads = strtoull(optarg, NULL, 10); break; //worker threads
+        case 'q': opts.io_depth = strtoull(optarg, NULL, 10); break; //buffers in flight per file
+        case 'w': opts.io_size = strtoull(optarg, NULL, 10); break; //bytes per buffer
+        case 'x': //offsets of each block for range decryption
+            opts.index = fopen(optarg, "w");
+            openindex = true;
+            break;
         case 'i': infile = fopen(optarg, "r"); break;
         case 'o': outfile = fopen(optarg, "w"); break;
         case 'n':
             pbfile = fopen(optarg, "r"); 
             openpubfile = true; 
             break;
+        case 'S':
+            if (!stats_parse(optarg)) { //only text and json reports exist
+                program_usage();
+                exit(1);
+            }
+            break;
+        case 'A':
+            if (!arena_select(optarg)) { //arena or system, installed before gmp allocates
+                program_usage();
+                exit(1);
+            }
+            break;
         default: program_usage(); exit(1);
         }
     }
@@ -73,19 +122,69 @@ int main(int argc, char **argv) {
     }
 
     //print error message and quits the program
-    if (!pbfile) {
+    if (!pbfile || (openindex && !opts.index)) {
         perror("Error");
         fclose(infile);
         fclose(outfile);
         return 1;
     }
 
+    if (opts.hybrid && opts.index) { //records are not blocks, there is nothing to index
+        fprintf(stderr, "Error: hybrid streams have no block index.\n");
+        fclose(opts.index);
+        fclose(pbfile);
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
+
+    if (opts.mmap && opts.io_depth > 0) { //both replace stdio, only one can own the files
+        fprintf(stderr, "Error: -m and -q cannot be used together.\n");
+        if (opts.index) {
+            fclose(opts.index);
+        }
+        fclose(pbfile);
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
+
+    if (opts.io_size > 0 && opts.io_depth == 0) { //the buffers only exist with -q
+        fprintf(stderr, "Error: -w needs -q.\n");
+        if (opts.index) {
+            fclose(opts.index);
+        }
+        fclose(pbfile);
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
+
     mpz_t str, m, n, e, s; //create vars with mpz
     mpz_inits(str, m, n, e, s, NULL);
 
     char username[_POSIX_LOGIN_NAME_MAX]; //holds the username of the user
 
-    rsa_read_pub(n, e, s, username, pbfile); //reads file and stores variable to mpz values
+    rsa_ctx_t ctx; //holds the key and its montgomery data for the whole run
+    rsa_ctx_init(&ctx, 0);
+
+    bool verified = false; //compiled keys record that s was already checked
+    if (keyfile_detect(pbfile)) { //binary limbs and montgomery values, nothing to parse
+        if (!keyfile_read_pub(&ctx, pbfile, s, username, sizeof(username), &verified)) {
+            fprintf(stderr, "Error: invalid compiled key.\n");
+            rsa_ctx_clear(&ctx);
+            mpz_clears(str, m, n, e, s, NULL);
+            fclose(pbfile);
+            fclose(infile);
+            fclose(outfile);
+            exit(1);
+        }
+        mpz_set(n, ctx.n);
+        mpz_set(e, ctx.e);
+    } else {
+        rsa_read_pub(n, e, s, username, pbfile); //reads file and stores variable to mpz values
+        rsa_ctx_set_pub(&ctx, n, e);
+    }
 
     if (test_v) { //prints verbose options and use bitcounter to print the bits
         printf("user = %s\n", username); //username
@@ -96,8 +195,20 @@ int main(int argc, char **argv) {
 
     mpz_set_str(str, username, 62); //set username to mpz values
 
-    if (rsa_verify(str, s, e, n) == false) { 
+    if (!verified && rsa_ctx_verify(&ctx, str, s) == false) { 
         fprintf(stderr, "Error: invalid key.\n"); //if not valid print message and close files
+        rsa_ctx_clear(&ctx);
+        mpz_clears(str, m, n, e, s, NULL);
+        fclose(pbfile);
+        fclose(infile);
+        fclose(outfile);
+        exit(1);
+    }
+
+    if (opts.hybrid && !randstate_init_entropy()) { //the session key must not be guessable
+        fprintf(stderr, "Error: no entropy for the session key.\n");
+        randstate_clear();
+        rsa_ctx_clear(&ctx);
         mpz_clears(str, m, n, e, s, NULL);
         fclose(pbfile);
         fclose(infile);
@@ -105,13 +216,29 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    rsa_encrypt_file(infile, outfile, n, e); //encrypt the files if key is valid
+    //encrypt the files if key is valid
+    int exit_code = rsa_ctx_encrypt_file(&ctx, infile, outfile, &opts) ? 0 : 1;
+
+    if (opts.hybrid) {
+        randstate_clear();
+    }
 
     //clear and close files
+    rsa_ctx_clear(&ctx);
     mpz_clears(str, m, n, e, s, NULL);
     fclose(pbfile);
     fclose(infile);
-    fclose(outfile);
+    if (fclose(outfile) != 0) { //the last buffered bytes can still fail to write
+        perror("Error");
+        exit_code = 1;
+    }
+    if (opts.index && fclose(opts.index) != 0) {
+        perror("Error");
+        exit_code = 1;
+    }
+
+    arena_flush(); //counts of the main thread, workers added theirs as they exited
+    stats_report(stderr); //no output unless --stats was given
 
-    return 0;
+    return exit_code;
 }
@@ -0,0 +1,88 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && GMP_NUMB_BITS == 64 && GMP_NAIL_BITS == 0
+#define FIXED_X86 1
+#else
+#define FIXED_X86 0
+#endif
+
+#include "fixed.h"
+
+#define FIXED_STR_(x) #x
+#define FIXED_STR(x) FIXED_STR_(x)
+
+#if FIXED_X86
+
+//t[0 .. L) += u * n[0 .. L), returns the carry out, one straight run of mulx with the low
+//halves on the overflow flag chain and the high halves on the carry flag chain, which is what
+//gmp's addmul_1 loop does minus the loop and the call, u goes in rdx for mulx
+#define FIXED_ROW(L)                                                                               \
+    static inline mp_limb_t row_##L(mp_limb_t *t, const mp_limb_t *n, mp_limb_t u) {               \
+        mp_limb_t c;                                                                               \
+        __asm__ volatile("xor %%r8d, %%r8d\n\t" /*zero, clears both flags*/                        \
+                         "xor %%r9d, %%r9d\n\t" /*high half of the previous limb*/                 \
+                         ".set j, 0\n\t"                                                           \
+                         ".rept " FIXED_STR(L) "\n\t"                                              \
+                         "mulx 8*j(%[n]), %%rax, %%r10\n\t"                                        \
+                         "mov 8*j(%[t]), %%r11\n\t"                                                \
+                         "adox %%rax, %%r11\n\t"                                                   \
+                         "adcx %%r9, %%r11\n\t"                                                    \
+                         "mov %%r11, 8*j(%[t])\n\t"                                                \
+                         "mov %%r10, %%r9\n\t"                                                     \
+                         ".set j, j + 1\n\t"                                                       \
+                         ".endr\n\t"                                                               \
+                         "adox %%r8, %%r9\n\t" /*the last high half takes both carries*/           \
+                         "adcx %%r8, %%r9\n\t"                                                     \
+                         "mov %%r9, %[c]\n\t"                                                      \
+                         : [c] "=r"(c), "+d"(u)                                                    \
+                         : [t] "r"(t), [n] "r"(n)                                                  \
+                         : "rax", "r8", "r9", "r10", "r11", "cc", "memory");                       \
+        return c;                                                                                  \
+    }
+
+//the product stays on the stack, gmp's mul and sqr are already straight line code at these
+//sizes, the reduction is L unrolled rows with each row's carry parked in the limb it cleared
+#define FIXED_KERNEL(L)                                                                            \
+    FIXED_ROW(L)                                                                                   \
+    static void mul_##L(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp,                   \
+        const mp_limb_t *np, mp_limb_t ninv) {                                                     \
+        mp_limb_t prod[2 * L];                                                                     \
+        if (ap == bp) {                                                                            \
+            mpn_sqr(prod, ap, L);                                                                  \
+        } else {                                                                                   \
+            mpn_mul_n(prod, ap, bp, L);                                                            \
+        }                                                                                          \
+        for (int i = 0; i < L; i += 1) {                                                           \
+            prod[i] = row_##L(prod + i, np, prod[i] * ninv);                                       \
+        }                                                                                          \
+        mp_limb_t hi = mpn_add_n(rp, prod + L, prod, L);                                           \
+        if (hi != 0 || mpn_cmp(rp, np, L) >= 0) { /*below 2n, one subtract at most*/              \
+            mpn_sub_n(rp, rp, np, L);                                                              \
+        }                                                                                          \
+        return;                                                                                    \
+    }
+
+FIXED_SIZES(FIXED_KERNEL)
+
+#define FIXED_CASE(L)                                                                              \
+    case L: return mul_##L;
+
+#endif
+
+fixed_mul_fn fixed_mul_for(mp_size_t size) { //NULL when the generic path has to run
+#if FIXED_X86
+    if (!__builtin_cpu_supports("bmi2") || !__builtin_cpu_supports("adx")) { //mulx, adcx and adox
+        return NULL;
+    }
+    switch (size) {
+        FIXED_SIZES(FIXED_CASE)
+    default: return NULL;
+    }
+#else
+    (void) size;
+    return NULL;
+#endif
+}
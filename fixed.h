@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+//limb counts with a kernel, 1024 to 4096 bit moduli and the 1025 to 4097 bit ones keygen makes
+//(its primes have one bit more than asked for), other sizes take the generic path
+#define FIXED_SIZES(X) X(16) X(17) X(24) X(25) X(32) X(33) X(48) X(49) X(64) X(65)
+
+//rp = ap * bp * R^-1 mod np for one limb count fixed at compile time, squares when ap == bp,
+//values are below np and rp may be ap or bp
+typedef void (*fixed_mul_fn)(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp,
+    const mp_limb_t *np, mp_limb_t ninv);
+
+fixed_mul_fn fixed_mul_for(mp_size_t size);
@@ -0,0 +1,831 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <gmp.h>
+
+#include "randstate.h"
+#include "numtheory.h"
+#include "rsa.h"
+#include "rsactx.h"
+#include "arena.h"
+#include "stats.h"
+#include "aead.h"
+
+#define OPTIONS "hvan:s:b:f:"
+
+#define MAX_REPORTS 8 //failures printed per check before it only counts them
+#define BATCH 8 //values per pow_mod_batch call, one full set of vector lanes
+
+typedef struct {
+    const char *name; //check name, matched by -f
+    uint64_t runs; //inputs tried
+    uint64_t failures; //inputs where the result differed from gmp
+} check_t;
+
+static bool verbose = false;
+static uint64_t max_bits = 1024; //largest operand for the numtheory checks
+static gmp_randstate_t st; //drives the inputs, is_prime draws its bases from the global state
+
+//odd composites that fool weaker tests: Carmichael numbers, base 2 strong pseudoprimes and
+//strong Lucas pseudoprimes with the Selfridge parameters
+static const char *tricky[] = {
+    "561", "1105", "1729", "2465", "2821", "6601", "8911", "41041", "62745", "63973",
+    "2047", "3277", "4033", "4681", "8321", "15841", "29341", "42799", "49141", "52633",
+    "5459", "5777", "10877", "16109", "18971", "22499", "24569", "25199", "40309", "58519",
+    "3825123056546413051", "318665857834031151167461", "3317044064679887385961981",
+    "1502401849747176241", "2152302898747", "3474749660383", "341550071728321",
+};
+
+void program_usage(void) { //prints help message
+    fprintf(stderr, "SYNOPSIS\n");
+    fprintf(stderr, "   Checks the numtheory primitives against GMP on random and adversarial\n");
+    fprintf(stderr, "   inputs, checks ChaCha20-Poly1305 against RFC 8439, and round trips\n");
+    fprintf(stderr, "   random files through encrypt and decrypt.\n");
+    fprintf(stderr, "   Exits with 1 when any result differs.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "USAGE\n");
+    fprintf(stderr, "   ./fuzz [-hva] [-n runs] [-s seed] [-b bits] [-f filter]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "   -h              Display program help and usage.\n");
+    fprintf(stderr, "   -v              Display verbose program output.\n");
+    fprintf(stderr, "   -a              Run with the GMP arena allocator installed, which also\n");
+    fprintf(stderr, "                   counts the allocations of context decryption.\n");
+    fprintf(stderr, "   -n runs         Random inputs per check (default: 500).\n");
+    fprintf(stderr, "   -s seed         Random seed (default: 1).\n");
+    fprintf(stderr, "   -b bits         Largest operand for the numtheory checks (default: 1024).\n");
+    fprintf(stderr, "   -f filter       Only run checks whose name contains filter: gcd,\n");
+    fprintf(stderr, "                   mod_inverse, pow_mod, is_prime, aead or roundtrip.\n");
+}
+
+static bool selected(const char *filter, const char *name) {
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+//random operand of up to max_bits, biased towards the values that break arithmetic code:
+//0, 1, powers of two and their neighbours, and long runs of ones and zeros
+static void pick(mpz_t x, uint64_t bits) {
+    uint64_t size = 1 + gmp_urandomm_ui(st, bits);
+
+    switch (gmp_urandomm_ui(st, 8)) {
+    case 0: mpz_set_ui(x, gmp_urandomm_ui(st, 3)); break; //0, 1 or 2
+    case 1: //2^size - 1, 2^size or 2^size + 1
+        mpz_set_ui(x, 0);
+        mpz_setbit(x, size);
+        mpz_add_ui(x, x, gmp_urandomm_ui(st, 3));
+        mpz_sub_ui(x, x, 1);
+        break;
+    case 2:
+    case 3: mpz_rrandomb(x, st, size); break; //long runs of equal bits
+    default: mpz_urandomb(x, st, size); break;
+    }
+    return;
+}
+
+static void fail(check_t *check, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void fail(check_t *check, const char *fmt, ...) { //prints the first few failures of a check
+    check->failures += 1;
+    if (check->failures > MAX_REPORTS) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "FAIL %s: ", check->name);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    return;
+}
+
+static void check_gcd(check_t *check, uint64_t runs) {
+    mpz_t a, b, got, want;
+    mpz_inits(a, b, got, want, NULL);
+
+    for (uint64_t i = 0; i < runs; i += 1) {
+        pick(a, max_bits);
+        pick(b, max_bits);
+        if (i % 4 == 0) { //shared factor, so the answer is not almost always 1
+            pick(want, max_bits / 2);
+            mpz_mul(a, a, want);
+            mpz_mul(b, b, want);
+        }
+
+        gcd(got, a, b);
+        mpz_gcd(want, a, b);
+        check->runs += 1;
+        if (mpz_cmp(got, want) != 0) {
+            fail(check, "gcd(%s, %s)", mpz_get_str(NULL, 16, a), mpz_get_str(NULL, 16, b));
+        }
+    }
+
+    mpz_clears(a, b, got, want, NULL);
+    return;
+}
+
+//mod_inverse_batch against mod_inverse, mostly under a prime so every value has an inverse
+static void compare_inverse_batch(check_t *check, uint64_t runs) {
+    mpz_t vals[BATCH], outs[BATCH], n, want;
+    mpz_ptr a[BATCH], out[BATCH];
+    mpz_inits(n, want, NULL);
+    for (size_t j = 0; j < BATCH; j += 1) {
+        mpz_inits(vals[j], outs[j], NULL);
+        a[j] = vals[j];
+        out[j] = outs[j];
+    }
+
+    for (uint64_t i = 0; i < runs; i += BATCH) {
+        do {
+            pick(n, max_bits);
+            if (i % (4 * BATCH) != 0) { //every fourth modulus stays composite
+                mpz_nextprime(n, n);
+            }
+        } while (mpz_cmp_ui(n, 1) <= 0);
+        size_t count = 1 + gmp_urandomm_ui(st, BATCH);
+        for (size_t j = 0; j < count; j += 1) {
+            pick(vals[j], max_bits);
+        }
+
+        mod_inverse_batch(out, a, count, n);
+        for (size_t j = 0; j < count; j += 1) {
+            mod_inverse(want, vals[j], n);
+            check->runs += 1;
+            if (mpz_cmp(outs[j], want) != 0) {
+                fail(check, "mod_inverse_batch(%s, %s)", mpz_get_str(NULL, 16, vals[j]),
+                    mpz_get_str(NULL, 16, n));
+            }
+        }
+    }
+
+    for (size_t j = 0; j < BATCH; j += 1) {
+        mpz_clears(vals[j], outs[j], NULL);
+    }
+    mpz_clears(n, want, NULL);
+    return;
+}
+
+//mod_inverse and mod_inverse_batch against mpz_invert
+static void check_mod_inverse(check_t *check, uint64_t runs) {
+    mpz_t a, n, got, want;
+    mpz_inits(a, n, got, want, NULL);
+
+    for (uint64_t i = 0; i < runs; i += 1) {
+        pick(a, max_bits);
+        do { //gmp and mod_inverse both need n > 1
+            pick(n, max_bits);
+        } while (mpz_cmp_ui(n, 1) <= 0);
+
+        mod_inverse(got, a, n);
+        if (mpz_invert(want, a, n) == 0) { //mod_inverse reports no inverse as 0
+            mpz_set_ui(want, 0);
+        }
+        check->runs += 1;
+        if (mpz_cmp(got, want) != 0) {
+            fail(check, "mod_inverse(%s, %s)", mpz_get_str(NULL, 16, a), mpz_get_str(NULL, 16, n));
+        }
+    }
+    compare_inverse_batch(check, runs);
+
+    mpz_clears(a, n, got, want, NULL);
+    return;
+}
+
+//pow_mod, pow_mod_ui, pow_mod_sec and pow_mod_batch against mpz_powm, odd and even moduli
+static void check_pow_mod(check_t *check, uint64_t runs) {
+    mpz_t base[BATCH], got[BATCH], e, n, want;
+    mpz_ptr bp[BATCH], gp[BATCH];
+    mpz_inits(e, n, want, NULL);
+    for (size_t j = 0; j < BATCH; j += 1) {
+        mpz_inits(base[j], got[j], NULL);
+        bp[j] = base[j];
+        gp[j] = got[j];
+    }
+
+    uint64_t fixed[] = { 16, 17, 24, 25, 32, 33, 48, 49, 64, 65 }; //limb counts in fixed.h
+
+    for (uint64_t i = 0; i < runs; i += 1) {
+        do {
+            pick(n, max_bits);
+        } while (mpz_cmp_ui(n, 1) <= 0);
+        if (i % 8 == 1) { //a size with an unrolled kernel, whatever max_bits is
+            uint64_t limbs = fixed[gmp_urandomm_ui(st, sizeof(fixed) / sizeof(fixed[0]))];
+            mpz_rrandomb(n, st, 64 * limbs - gmp_urandomm_ui(st, 64));
+        }
+        if (i % 4 != 0) { //mostly odd moduli, the montgomery and vector paths
+            mpz_setbit(n, 0);
+        }
+        pick(e, (i % 2 == 0) ? 64 : max_bits);
+        for (size_t j = 0; j < BATCH; j += 1) {
+            pick(base[j], max_bits + 8); //some bases are above n
+        }
+
+        const char *fn = NULL;
+        mpz_powm(want, base[0], e, n);
+
+        pow_mod(got[0], base[0], e, n);
+        fn = (mpz_cmp(got[0], want) != 0) ? "pow_mod" : fn;
+        if (mpz_fits_ulong_p(e)) {
+            pow_mod_ui(got[0], base[0], mpz_get_ui(e), n);
+            fn = (mpz_cmp(got[0], want) != 0) ? "pow_mod_ui" : fn;
+        }
+        pow_mod_sec(got[0], base[0], e, n);
+        fn = (mpz_cmp(got[0], want) != 0) ? "pow_mod_sec" : fn;
+        check->runs += 1;
+        if (fn != NULL) {
+            fail(check, "%s(%s, %s, %s)", fn, mpz_get_str(NULL, 16, base[0]),
+                mpz_get_str(NULL, 16, e), mpz_get_str(NULL, 16, n));
+        }
+
+        size_t count = 1 + gmp_urandomm_ui(st, BATCH); //short batches take the scalar path
+        pow_mod_batch(gp, bp, count, e, n);
+        for (size_t j = 0; j < count; j += 1) {
+            mpz_powm(want, base[j], e, n);
+            if (mpz_cmp(got[j], want) != 0) {
+                fail(check, "pow_mod_batch lane %zu of %zu (%s, %s, %s)", j, count,
+                    mpz_get_str(NULL, 16, base[j]), mpz_get_str(NULL, 16, e),
+                    mpz_get_str(NULL, 16, n));
+                break;
+            }
+        }
+    }
+
+    for (size_t j = 0; j < BATCH; j += 1) {
+        mpz_clears(base[j], got[j], NULL);
+    }
+    mpz_clears(e, n, want, NULL);
+    return;
+}
+
+static void compare_prime(check_t *check, mpz_t n) {
+    bool got = is_prime(n, PRIME_ITERS_AUTO);
+    bool want = mpz_probab_prime_p(n, 50) != 0;
+
+    check->runs += 1;
+    if (got != want) {
+        fail(check, "is_prime(%s) = %d", mpz_get_str(NULL, 10, n), got);
+    }
+    return;
+}
+
+static void check_is_prime(check_t *check, uint64_t runs) {
+    mpz_t n, p, q;
+    mpz_inits(n, p, q, NULL);
+
+    for (unsigned long i = 0; i < 4096; i += 1) { //every small n, the trial division edges
+        mpz_set_ui(n, i);
+        compare_prime(check, n);
+    }
+    for (size_t i = 0; i < sizeof(tricky) / sizeof(tricky[0]); i += 1) {
+        mpz_set_str(n, tricky[i], 10);
+        compare_prime(check, n);
+    }
+
+    for (uint64_t i = 0; i < runs; i += 1) {
+        pick(n, max_bits);
+        compare_prime(check, n);
+
+        mpz_nextprime(p, n); //primes, squares of primes and products of two primes
+        compare_prime(check, p);
+        mpz_mul(n, p, p);
+        compare_prime(check, n);
+        pick(q, max_bits / 2);
+        mpz_nextprime(q, q);
+        mpz_mul(n, p, q);
+        compare_prime(check, n);
+
+        mpz_set_ui(n, 6 * (1 + gmp_urandomm_ui(st, 1000000))); //Chernick form (6k+1)(12k+1)(18k+1),
+        mpz_add_ui(p, n, 1); //a Carmichael number when all three factors are prime
+        mpz_mul_ui(q, n, 2);
+        mpz_add_ui(q, q, 1);
+        mpz_mul(p, p, q);
+        mpz_mul_ui(q, n, 3);
+        mpz_add_ui(q, q, 1);
+        mpz_mul(n, p, q);
+        compare_prime(check, n);
+    }
+
+    mpz_clears(n, p, q, NULL);
+    return;
+}
+
+static void unhex(uint8_t *out, const char *hex) { //test vectors are written as in the RFC
+    for (size_t i = 0; hex[2 * i] != '\0'; i += 1) {
+        sscanf(hex + 2 * i, "%2hhx", &out[i]);
+    }
+    return;
+}
+
+static void pick_bytes(uint8_t *out, size_t len) {
+    for (size_t i = 0; i < len; i += 1) {
+        out[i] = gmp_urandomm_ui(st, 256);
+    }
+    return;
+}
+
+//RFC 8439 section 2.8.2 known answer, then random records that must round trip and must be
+//rejected once a bit of the data, the aad or the tag flips
+static void check_aead(check_t *check, uint64_t runs) {
+    static const char *plain = "Ladies and Gentlemen of the class of '99: If I could offer you "
+                               "only one tip for the future, sunscreen would be it.";
+    static const char *cipher = "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+                                "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+                                "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+                                "3ff4def08e4b7a9de576d26586cec64b6116";
+    uint8_t key[AEAD_KEY], nonce[AEAD_NONCE], aad[12], tag[AEAD_TAG], want_tag[AEAD_TAG];
+    uint8_t data[256], want[256];
+    size_t len = strlen(plain);
+
+    for (size_t i = 0; i < AEAD_KEY; i += 1) {
+        key[i] = 0x80 + i;
+    }
+    unhex(nonce, "070000004041424344454647");
+    unhex(aad, "50515253c0c1c2c3c4c5c6c7");
+    unhex(want, cipher);
+    unhex(want_tag, "1ae10b594f09e26a7e902ecbd0600691");
+
+    memcpy(data, plain, len);
+    aead_encrypt(key, nonce, aad, sizeof(aad), data, len, tag);
+    check->runs += 1;
+    if (memcmp(data, want, len) != 0 || memcmp(tag, want_tag, AEAD_TAG) != 0) {
+        fail(check, "RFC 8439 2.8.2 encryption");
+    }
+    check->runs += 1;
+    if (!aead_decrypt(key, nonce, aad, sizeof(aad), data, len, want_tag)
+        || memcmp(data, plain, len) != 0) {
+        fail(check, "RFC 8439 2.8.2 decryption");
+    }
+
+    for (uint64_t i = 0; i < runs; i += 1) {
+        len = gmp_urandomm_ui(st, sizeof(data) + 1); //empty and partial 64 byte blocks too
+        pick_bytes(key, AEAD_KEY);
+        pick_bytes(nonce, AEAD_NONCE);
+        pick_bytes(aad, sizeof(aad));
+        pick_bytes(want, len);
+        memcpy(data, want, len);
+        aead_encrypt(key, nonce, aad, sizeof(aad), data, len, tag);
+
+        //flip one bit of the tag, the aad or the data, then undo it and decrypt for real
+        size_t spot = gmp_urandomm_ui(st, AEAD_TAG + sizeof(aad) + len);
+        uint8_t *flip;
+        if (spot < AEAD_TAG) {
+            flip = &tag[spot];
+        } else if (spot < AEAD_TAG + sizeof(aad)) {
+            flip = &aad[spot - AEAD_TAG];
+        } else {
+            flip = &data[spot - AEAD_TAG - sizeof(aad)];
+        }
+        uint8_t bit = 1 << gmp_urandomm_ui(st, 8);
+        *flip ^= bit;
+        check->runs += 1;
+        if (aead_decrypt(key, nonce, aad, sizeof(aad), data, len, tag)) {
+            fail(check, "%zu bytes accepted with a flipped bit at %zu", len, spot);
+        }
+        *flip ^= bit;
+        if (!aead_decrypt(key, nonce, aad, sizeof(aad), data, len, tag)
+            || memcmp(data, want, len) != 0) {
+            fail(check, "%zu bytes did not round trip", len);
+        }
+    }
+    return;
+}
+
+static uint8_t *slurp(FILE *file, size_t *len) { //whole file from the start
+    fflush(file);
+    fseeko(file, 0, SEEK_END);
+    *len = ftello(file);
+    rewind(file);
+
+    uint8_t *data = malloc(*len + 1);
+    *len = fread(data, sizeof(uint8_t), *len, file);
+    rewind(file);
+    return data;
+}
+
+static FILE *file_of(const uint8_t *data, size_t len) {
+    FILE *file = tmpfile();
+    fwrite(data, sizeof(uint8_t), len, file);
+    fflush(file);
+    rewind(file);
+    return file;
+}
+
+//payload lengths around the block size, where the framing has its edges
+static size_t pick_len(size_t piece) {
+    size_t edges[] = { 0, 1, piece - 1, piece, piece + 1, 2 * piece, 2 * piece + 1, 9 * piece };
+
+    if (gmp_urandomm_ui(st, 2) == 0) {
+        return edges[gmp_urandomm_ui(st, sizeof(edges) / sizeof(edges[0]))];
+    }
+    return gmp_urandomm_ui(st, 20 * piece);
+}
+
+static void pick_payload(uint8_t *data, size_t len) {
+    unsigned kind = gmp_urandomm_ui(st, 4);
+
+    for (size_t i = 0; i < len; i += 1) {
+        uint8_t byte = gmp_urandomb_ui(st, 8);
+        switch (kind) {
+        case 0: data[i] = 0; break; //every block decrypts to the 0xFF prefix alone
+        case 1: data[i] = (i % 64 < 8) ? 0 : byte; break; //runs of leading zero bytes
+        case 2: data[i] = 0xFF; break;
+        default: data[i] = byte; break;
+        }
+    }
+    return;
+}
+
+//the garner combine of a multi-prime key has to give x back, otherwise decryption quietly falls
+//back to d and the round trips still match
+static void check_combine_multi(check_t *check, rsa_priv_t *key, uint64_t bits) {
+    mpz_t x, h, t, r, res[RSA_MAX_PRIMES];
+    mpz_ptr mr[RSA_MAX_PRIMES];
+    mpz_ptr moduli[RSA_MAX_PRIMES] = { key->p, key->q, key->r[0], key->r[1] };
+    mpz_inits(x, h, t, r, NULL);
+    for (uint64_t k = 0; k < key->extra + 2; k += 1) {
+        mpz_init(res[k]);
+        mr[k] = res[k];
+    }
+
+    for (int i = 0; i < 8; i += 1) {
+        mpz_urandomm(x, st, key->n);
+        for (uint64_t k = 0; k < key->extra + 2; k += 1) {
+            mpz_mod(res[k], x, moduli[k]);
+        }
+        check->runs += 1;
+        rsa_crt_combine_multi(r, mr, key, h, t);
+        if (mpz_cmp(r, x) != 0) {
+            fail(check, "%" PRIu64 " bit key, %" PRIu64 " primes: combine failed", bits, key->extra + 2);
+        }
+    }
+
+    for (uint64_t k = 0; k < key->extra + 2; k += 1) {
+        mpz_clear(res[k]);
+    }
+    mpz_clears(x, h, t, r, NULL);
+    return;
+}
+
+//a wrong CRT exponent stands in for a fault in one half, every private key path has to notice
+//through r^e and fall back to d, a wrong result there would give away a factor of n
+static void check_faults(check_t *check, rsa_priv_t *key, rsa_ctx_t *ctx, mpz_t e, uint64_t bits) {
+    mpz_ptr halves[RSA_MAX_PRIMES] = { key->dp, key->dq, key->dr[0], key->dr[1] };
+    mpz_ptr ctx_halves[RSA_MAX_PRIMES] = { ctx->priv.dp, ctx->priv.dq, ctx->priv.dr[0], ctx->priv.dr[1] };
+    mpz_t want[BATCH], got[BATCH], c[BATCH];
+    mpz_ptr gp[BATCH], cp[BATCH];
+    for (int j = 0; j < BATCH; j += 1) {
+        mpz_inits(want[j], got[j], c[j], NULL);
+        gp[j] = got[j];
+        cp[j] = c[j];
+    }
+
+    for (uint64_t k = 0; k < key->extra + 2; k += 1) {
+        mpz_add_ui(halves[k], halves[k], 2);
+        mpz_add_ui(ctx_halves[k], ctx_halves[k], 2);
+
+        for (int fast = 0; fast < 2; fast += 1) {
+            key->fast = ctx->priv.fast = fast;
+            for (int j = 0; j < BATCH; j += 1) {
+                mpz_urandomm(want[j], st, key->n);
+                pow_mod(c[j], want[j], e, key->n);
+            }
+
+            for (int path = 0; path < 4; path += 1) {
+                switch (path) {
+                case 0: rsa_decrypt_crt(got[0], c[0], key); break;
+                case 1: rsa_ctx_decrypt(ctx, got[0], c[0]); break;
+                case 2: rsa_decrypt_crt_batch(gp, cp, BATCH, key); break;
+                default: rsa_ctx_decrypt_batch(ctx, gp, cp, BATCH); break;
+                }
+                for (int j = 0; j < ((path < 2) ? 1 : BATCH); j += 1) {
+                    check->runs += 1;
+                    if (mpz_cmp(got[j], want[j]) != 0) {
+                        fail(check, "%" PRIu64 " bit %" PRIu64 " prime key, prime %" PRIu64 " faulted, fast %d path %d:"
+                            " wrong result", bits, key->extra + 2, k, fast, path);
+                    }
+                }
+            }
+        }
+
+        mpz_sub_ui(halves[k], halves[k], 2);
+        mpz_sub_ui(ctx_halves[k], ctx_halves[k], 2);
+    }
+
+    for (int j = 0; j < BATCH; j += 1) {
+        mpz_clears(want[j], got[j], c[j], NULL);
+    }
+    return;
+}
+
+static uint64_t gmp_allocs(void) { //allocations so far, the arenas hand their counts over on a flush
+    arena_flush();
+    return atomic_load(&stats_counters[STAT_ARENA_ALLOCS]);
+}
+
+//once a first call has sized the context, decrypting through it allocates nothing, except when
+//the blinding pair is redrawn, the arenas do the counting so this needs -a and the stats probes
+static void check_allocs(check_t *check, rsa_ctx_t *ctx, uint64_t bits) {
+    if (!arena_installed()) {
+        return;
+    }
+    bool was_enabled = stats_enabled;
+    bool was_fast = ctx->priv.fast;
+    mpz_t vals[BATCH];
+    mpz_ptr v[BATCH];
+    for (size_t j = 0; j < BATCH; j += 1) {
+        mpz_init(vals[j]);
+        v[j] = vals[j];
+    }
+    stats_enabled = true;
+
+    for (int fast = 0; fast < 2; fast += 1) {
+        ctx->priv.fast = fast;
+        for (size_t j = 0; j < BATCH; j += 1) {
+            mpz_urandomm(vals[j], st, ctx->n);
+        }
+        rsa_ctx_decrypt(ctx, v[0], v[0]);
+        rsa_ctx_decrypt_batch(ctx, v, v, BATCH);
+
+        for (int i = 0; i < 2 * RSA_BLIND_UPDATES; i += 1) {
+            size_t calls = (i % 8 == 0) ? BATCH : 1; //every eighth call is a batch
+            bool redraw = !fast && ctx->blind.uses + calls > RSA_BLIND_UPDATES;
+            uint64_t before = gmp_allocs();
+            if (calls == BATCH) {
+                rsa_ctx_decrypt_batch(ctx, v, v, BATCH);
+            } else {
+                rsa_ctx_decrypt(ctx, v[i % BATCH], v[i % BATCH]);
+            }
+            uint64_t got = gmp_allocs() - before;
+
+            check->runs += 1;
+            if (got != 0 && !redraw) {
+                fail(check, "%" PRIu64 " bit %" PRIu64 " prime key, fast %d: call %d made %" PRIu64
+                    " gmp allocations", bits, ctx->priv.extra + 2, fast, i, got);
+            }
+        }
+    }
+
+    stats_enabled = was_enabled;
+    ctx->priv.fast = was_fast;
+    for (size_t j = 0; j < BATCH; j += 1) {
+        mpz_clear(vals[j]);
+    }
+    return;
+}
+
+static int quiet_stderr(void) { //the errors the tools print are the expected outcome in some checks
+    int saved = dup(STDERR_FILENO);
+    int quiet = open("/dev/null", O_WRONLY);
+    fflush(stderr);
+    dup2(quiet, STDERR_FILENO);
+    close(quiet);
+    return saved;
+}
+
+static void restore_stderr(int saved) {
+    fflush(stderr);
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+    return;
+}
+
+//a hybrid stream with one bit flipped past its header, or cut short, has to fail and leave no
+//plaintext behind
+static void check_tamper(check_t *check, FILE *cipher, rsa_priv_t *key, const rsa_opts_t *opts,
+    uint64_t bits) {
+    size_t header = 24, len = 0, got_len = 0; //the container header is not authenticated
+    uint8_t *data = slurp(cipher, &len);
+    size_t pos = header + gmp_urandomm_ui(st, len - header);
+    bool cut = gmp_urandomm_ui(st, 2);
+
+    if (cut) {
+        len = pos;
+    } else {
+        data[pos] ^= 1 << gmp_urandomm_ui(st, 8);
+    }
+    FILE *bad = file_of(data, len);
+    FILE *out = tmpfile();
+    int saved = quiet_stderr();
+    bool ok = rsa_decrypt_file_ex(bad, out, key, opts);
+    restore_stderr(saved);
+    free(slurp(out, &got_len));
+
+    check->runs += 1;
+    if (ok || got_len != 0) {
+        fail(check, "%" PRIu64 " bit key, hybrid %s at %zu: ok %d, %zu bytes left", bits,
+            cut ? "cut" : "flipped", pos, ok, got_len);
+    }
+    free(data);
+    fclose(bad);
+    fclose(out);
+    return;
+}
+
+//a read error partway in looks like EOF to the readers and a full disk takes the output, both
+//have to come back as failures, a directory fails every read and /dev/full every write
+static void check_io_errors(check_t *check, FILE *plain, rsa_priv_t *key, mpz_t e,
+    const rsa_opts_t *opts, uint64_t bits) {
+    FILE *dir = fopen("/", "r");
+    FILE *full = fopen("/dev/full", "w");
+    if (dir == NULL || full == NULL) { //nothing to run against
+        if (dir != NULL) {
+            fclose(dir);
+        }
+        if (full != NULL) {
+            fclose(full);
+        }
+        return;
+    }
+
+    FILE *out = tmpfile();
+    int saved = quiet_stderr();
+    rewind(plain);
+    bool sent = rsa_encrypt_file_ex(plain, full, key->n, e, opts);
+    bool got = rsa_decrypt_file_ex(dir, out, key, opts);
+    restore_stderr(saved);
+
+    check->runs += 1;
+    if (sent || got) {
+        fail(check, "%" PRIu64 " bit key, binary %d mmap %d hybrid %d io %" PRIu64 ": encrypt to a full "
+            "disk ok %d, decrypt from a failing read ok %d", bits, opts->binary, opts->mmap,
+            opts->hybrid, opts->io_depth, sent, got);
+    }
+    fclose(dir);
+    fclose(full);
+    fclose(out);
+    return;
+}
+
+//one key: random files through every encrypt and decrypt option, and range decryption
+static void check_roundtrip_key(check_t *check, uint64_t runs, uint64_t bits, uint64_t factors) {
+    mpz_t p, q, n, e, d, extra[RSA_MAX_PRIMES - 2];
+    mpz_inits(p, q, n, e, d, extra[0], extra[1], NULL);
+    mpz_ptr primes[RSA_MAX_PRIMES] = { p, q, extra[0], extra[1] };
+    rsa_priv_t key;
+    rsa_priv_init(&key);
+    rsa_ctx_t ctx;
+    rsa_ctx_init(&ctx, 1);
+
+    rsa_make_pub_multi(primes, factors, n, e, bits, PRIME_ITERS_AUTO, 0, 1, st);
+    rsa_make_priv_multi(d, e, primes, factors);
+    rsa_make_crt_multi(&key, n, d, primes, factors);
+    if (factors > 2) {
+        check_combine_multi(check, &key, bits);
+    }
+    rsa_ctx_set_priv(&ctx, &key);
+    mpz_set(ctx.e, e);
+    ctx.has_pub = true;
+    check_faults(check, &key, &ctx, e, bits);
+    check_allocs(check, &ctx, bits);
+
+    size_t k = (mpz_sizeinbase(n, 2) - 1) / 8;
+    size_t piece = k - 1; //plaintext bytes per block
+    uint8_t *data = malloc(20 * piece + 1);
+
+    for (uint64_t i = 0; i < runs; i += 1) {
+        size_t len = pick_len(piece);
+        pick_payload(data, len);
+
+        rsa_opts_t opts = { .threads = 1 };
+        opts.binary = gmp_urandomm_ui(st, 2);
+        opts.mmap = gmp_urandomm_ui(st, 2);
+        opts.hybrid = gmp_urandomm_ui(st, 4) == 0;
+        opts.threads = (gmp_urandomm_ui(st, 2) == 0) ? 1 : 3;
+        if (gmp_urandomm_ui(st, 2) == 0) { //small buffers so blocks and hex lines straddle them
+            opts.io_depth = 1 + gmp_urandomm_ui(st, 4);
+            opts.io_size = 1 + gmp_urandomm_ui(st, 3 * piece);
+            opts.io_thread = gmp_urandomm_ui(st, 2);
+        }
+        key.fast = gmp_urandomm_ui(st, 2);
+        ctx.priv.fast = key.fast;
+        bool use_ctx = gmp_urandomm_ui(st, 2);
+        opts.ctx = (use_ctx && opts.threads == 1) ? &ctx : NULL;
+
+        FILE *plain = file_of(data, len);
+        FILE *cipher = tmpfile();
+        FILE *out = tmpfile();
+        opts.index = opts.hybrid ? NULL : tmpfile();
+
+        bool sent = rsa_encrypt_file_ex(plain, cipher, n, e, &opts);
+        fflush(cipher);
+        rewind(cipher);
+        bool ok = rsa_decrypt_file_ex(cipher, out, opts.ctx ? &ctx.priv : &key, &opts);
+
+        size_t got_len = 0;
+        uint8_t *got = slurp(out, &got_len);
+        check->runs += 1;
+        if (!sent || !ok || got_len != len || memcmp(got, data, len) != 0) {
+            fail(check, "%" PRIu64 " bit %" PRIu64 " prime key, %zu bytes, binary %d mmap %d hybrid %d threads %" PRIu64
+                " fast %d ctx %d io %" PRIu64 "x%zu thread %d: got %zu bytes", bits, factors, len, opts.binary,
+                opts.mmap, opts.hybrid, opts.threads, key.fast, opts.ctx != NULL, opts.io_depth,
+                opts.io_size, opts.io_thread, got_len);
+        }
+        free(got);
+
+        if (!opts.hybrid) { //a random slice, it may start or end past the data
+            uint64_t start = gmp_urandomm_ui(st, len + piece + 1);
+            uint64_t span = gmp_urandomm_ui(st, 3 * piece + 1);
+            size_t want = (start < len) ? ((span < len - start) ? span : len - start) : 0;
+
+            rewind(cipher);
+            fclose(out);
+            out = tmpfile();
+            ok = rsa_decrypt_range(cipher, out, &key, start, span, &opts);
+            got = slurp(out, &got_len);
+            check->runs += 1;
+            if (!ok || got_len != want || memcmp(got, data + start, want) != 0) {
+                fail(check, "%" PRIu64 " bit key, %zu bytes, binary %d: range %" PRIu64 ":%" PRIu64
+                    " got %zu of %zu bytes", bits, len, opts.binary, start, span, got_len, want);
+            }
+            free(got);
+            fclose(opts.index);
+        } else {
+            check_tamper(check, cipher, opts.ctx ? &ctx.priv : &key, &opts, bits);
+        }
+        if (gmp_urandomm_ui(st, 8) == 0) {
+            check_io_errors(check, plain, opts.ctx ? &ctx.priv : &key, e, &opts, bits);
+        }
+
+        fclose(plain);
+        fclose(cipher);
+        fclose(out);
+    }
+
+    free(data);
+    rsa_ctx_clear(&ctx);
+    rsa_priv_clear(&key);
+    mpz_clears(p, q, n, e, d, extra[0], extra[1], NULL);
+    return;
+}
+
+static void check_roundtrip(check_t *check, uint64_t runs) {
+    uint64_t sizes[] = { 256, 521, 1024, 1024, 2048 }; //521 leaves a partial byte at the top of n
+    uint64_t factors[] = { 2, 2, 2, 3, 4 }; //2048 bits also runs the per prime threads
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i += 1) {
+        check_roundtrip_key(check, (runs + 9) / 10, sizes[i], factors[i]);
+    }
+    return;
+}
+
+int main(int argc, char **argv) {
+    int opt = 0;
+    uint64_t runs = 500;
+    uint64_t seed = 1;
+    char *filter = NULL;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': program_usage(); exit(0);
+        case 'v': verbose = true; break;
+        case 'a': arena_select("arena"); break;
+        case 'n': runs = strtoull(optarg, NULL, 10); break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        case 'b': max_bits = strtoull(optarg, NULL, 10); break;
+        case 'f': filter = optarg; break;
+        default: program_usage(); exit(1);
+        }
+    }
+    max_bits = (max_bits >= 16) ? max_bits : 16;
+
+    randstate_init(seed);
+    gmp_randinit_mt(st);
+    gmp_randseed_ui(st, seed);
+
+    check_t checks[] = {
+        { .name = "gcd" },
+        { .name = "mod_inverse" },
+        { .name = "pow_mod" },
+        { .name = "is_prime" },
+        { .name = "aead" },
+        { .name = "roundtrip" },
+    };
+    void (*fns[])(check_t *, uint64_t) = { check_gcd, check_mod_inverse, check_pow_mod,
+        check_is_prime, check_aead, check_roundtrip };
+
+    uint64_t failures = 0;
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i += 1) {
+        if (!selected(filter, checks[i].name)) {
+            continue;
+        }
+        fns[i](&checks[i], runs);
+        failures += checks[i].failures;
+        if (verbose || checks[i].failures > 0) {
+            printf("%-12s %8" PRIu64 " inputs %8" PRIu64 " failures\n", checks[i].name,
+                checks[i].runs, checks[i].failures);
+        }
+    }
+    if (verbose) {
+        printf("seed %" PRIu64 "\n", seed);
+    }
+
+    gmp_randclear(st);
+    randstate_clear();
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,359 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+
+#include "rsa.h"
+#include "rsactx.h"
+#include "montgomery.h"
+#include "mapio.h"
+#include "keyfile.h"
+
+#define KEY_VERSION 1
+#define KEY_HEADER 32 //magic, version, kind, limb size, flags, byte order, fields, length, checksum
+#define KEY_ORDER 0x01020304 //stored in host order, keys from another byte order are rejected
+#define KEY_PUBLIC 1
+#define KEY_PRIVATE 2
+#define KEY_VERIFIED 1 //flag, the signature was checked when the key was compiled
+#define KEY_FIELD 8 //id and count ahead of every field, data is padded to this too
+
+enum {
+    FIELD_N,
+    FIELD_E,
+    FIELD_S,
+    FIELD_USER, //username bytes instead of limbs
+    FIELD_D,
+    FIELD_P,
+    FIELD_Q,
+    FIELD_DP,
+    FIELD_DQ,
+    FIELD_QINV,
+    FIELD_N_NINV, //montgomery values, one limb ninv and R^2 mod the modulus
+    FIELD_N_RR,
+    FIELD_P_NINV,
+    FIELD_P_RR,
+    FIELD_Q_NINV,
+    FIELD_Q_RR,
+    FIELD_R1, //extra primes of a multi-prime key as r, d mod (r - 1) and the garner coefficient
+    FIELD_DR1,
+    FIELD_TR1,
+    FIELD_R2,
+    FIELD_DR2,
+    FIELD_TR2,
+    FIELDS
+};
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    uint32_t fields;
+} key_buffer_t;
+
+typedef struct {
+    const uint8_t *data[FIELDS]; //NULL when the field is absent
+    uint32_t count[FIELDS]; //limbs, or bytes for the username
+} key_fields_t;
+
+static uint64_t checksum(const uint8_t *data, size_t len) { //FNV-1a, catches truncation and bit rot
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (size_t i = 0; i < len; i += 1) {
+        hash = (hash ^ data[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+static void put_field(key_buffer_t *buf, uint32_t id, const void *data, uint32_t count, size_t bytes) {
+    size_t padded = (bytes + KEY_FIELD - 1) / KEY_FIELD * KEY_FIELD;
+
+    if (buf->len + KEY_FIELD + padded > buf->cap) {
+        buf->cap = 2 * (buf->len + KEY_FIELD + padded);
+        buf->data = realloc(buf->data, buf->cap);
+    }
+    memcpy(&buf->data[buf->len], &id, 4);
+    memcpy(&buf->data[buf->len + 4], &count, 4);
+    memset(&buf->data[buf->len + KEY_FIELD], 0, padded);
+    if (bytes > 0) {
+        memcpy(&buf->data[buf->len + KEY_FIELD], data, bytes);
+    }
+    buf->len += KEY_FIELD + padded;
+    buf->fields += 1;
+    return;
+}
+
+static void put_mpz(key_buffer_t *buf, uint32_t id, mpz_t x) { //limbs as gmp holds them
+    put_field(buf, id, mpz_limbs_read(x), mpz_size(x), mpz_size(x) * sizeof(mp_limb_t));
+    return;
+}
+
+static void put_mont(key_buffer_t *buf, uint32_t id, mpz_t modulus) { //id is the ninv field, rr follows
+    mont_t mont;
+    mont_init(&mont, modulus);
+    put_field(buf, id, &mont.ninv, 1, sizeof(mp_limb_t));
+    put_field(buf, id + 1, mont.rr, mont.size, mont.size * sizeof(mp_limb_t));
+    mont_clear(&mont);
+    return;
+}
+
+static bool write_key(FILE *file, key_buffer_t *buf, uint8_t kind, uint8_t flags) {
+    uint8_t header[KEY_HEADER] = { 0 };
+    uint32_t order = KEY_ORDER;
+    uint64_t len = buf->len;
+    uint64_t sum = checksum(buf->data, buf->len);
+
+    memcpy(header, KEYFILE_MAGIC, 4);
+    header[4] = KEY_VERSION;
+    header[5] = kind;
+    header[6] = sizeof(mp_limb_t);
+    header[7] = flags;
+    memcpy(&header[8], &order, 4);
+    memcpy(&header[12], &buf->fields, 4);
+    memcpy(&header[16], &len, 8);
+    memcpy(&header[24], &sum, 8);
+
+    bool ok = fwrite(header, sizeof(uint8_t), KEY_HEADER, file) == KEY_HEADER
+              && fwrite(buf->data, sizeof(uint8_t), buf->len, file) == buf->len;
+    free(buf->data);
+    return ok;
+}
+
+bool keyfile_detect(FILE *file) { //leaves the file position where it was
+    char magic[4];
+    off_t start = ftello(file);
+
+    bool found = fread(magic, sizeof(char), 4, file) == 4 && memcmp(magic, KEYFILE_MAGIC, 4) == 0;
+    fseeko(file, start, SEEK_SET);
+    return found;
+}
+
+bool keyfile_write_pub(FILE *file, mpz_t n, mpz_t e, mpz_t s, char username[]) {
+    key_buffer_t buf = { 0 };
+    mpz_t m;
+    mpz_init(m);
+
+    mpz_set_str(m, username, 62); //the same check encrypt runs, done once here
+    uint8_t flags = rsa_verify(m, s, e, n) ? KEY_VERIFIED : 0;
+
+    put_mpz(&buf, FIELD_N, n);
+    put_mpz(&buf, FIELD_E, e);
+    put_mpz(&buf, FIELD_S, s);
+    put_field(&buf, FIELD_USER, username, strlen(username), strlen(username));
+    put_mont(&buf, FIELD_N_NINV, n);
+
+    mpz_clear(m);
+    return write_key(file, &buf, KEY_PUBLIC, flags);
+}
+
+bool keyfile_write_priv(FILE *file, rsa_priv_t *key) {
+    key_buffer_t buf = { 0 };
+
+    put_mpz(&buf, FIELD_N, key->n);
+    put_mpz(&buf, FIELD_D, key->d);
+    put_mont(&buf, FIELD_N_NINV, key->n);
+    if (key->crt) {
+        put_mpz(&buf, FIELD_P, key->p);
+        put_mpz(&buf, FIELD_Q, key->q);
+        put_mpz(&buf, FIELD_DP, key->dp);
+        put_mpz(&buf, FIELD_DQ, key->dq);
+        put_mpz(&buf, FIELD_QINV, key->qinv);
+        put_mont(&buf, FIELD_P_NINV, key->p);
+        put_mont(&buf, FIELD_Q_NINV, key->q);
+        for (uint64_t i = 0; i < key->extra; i += 1) {
+            put_mpz(&buf, FIELD_R1 + 3 * i, key->r[i]);
+            put_mpz(&buf, FIELD_DR1 + 3 * i, key->dr[i]);
+            put_mpz(&buf, FIELD_TR1 + 3 * i, key->tr[i]);
+        }
+    }
+    return write_key(file, &buf, KEY_PRIVATE, 0);
+}
+
+//maps the key, or reads it into memory when it cannot be mapped
+static const uint8_t *load_key(FILE *file, map_input_t *in, uint8_t **copy, size_t *len) {
+    *copy = NULL;
+    if (mapio_open(in, file)) {
+        *len = in->len;
+        return in->data;
+    }
+
+    size_t cap = 4096;
+    *len = 0;
+    *copy = malloc(cap);
+    for (size_t got; (got = fread(*copy + *len, sizeof(uint8_t), cap - *len, file)) > 0;) {
+        *len += got;
+        if (*len == cap) {
+            cap *= 2;
+            *copy = realloc(*copy, cap);
+        }
+    }
+    return *copy;
+}
+
+static bool parse_key(const uint8_t *data, size_t len, uint8_t kind, key_fields_t *fields,
+    uint8_t *flags) {
+    uint32_t order, count;
+    uint64_t payload, sum;
+
+    if (len < KEY_HEADER || memcmp(data, KEYFILE_MAGIC, 4) != 0 || data[4] != KEY_VERSION
+        || data[5] != kind || data[6] != sizeof(mp_limb_t)) {
+        return false;
+    }
+    memcpy(&order, &data[8], 4);
+    memcpy(&count, &data[12], 4);
+    memcpy(&payload, &data[16], 8);
+    memcpy(&sum, &data[24], 8);
+    if (order != KEY_ORDER || payload > len - KEY_HEADER
+        || checksum(&data[KEY_HEADER], payload) != sum) {
+        return false;
+    }
+    *flags = data[7];
+
+    memset(fields, 0, sizeof(key_fields_t));
+    size_t pos = KEY_HEADER;
+    for (uint32_t i = 0; i < count; i += 1) {
+        uint32_t id, n;
+        if (KEY_HEADER + payload - pos < KEY_FIELD) {
+            return false;
+        }
+        memcpy(&id, &data[pos], 4);
+        memcpy(&n, &data[pos + 4], 4);
+        size_t bytes = (id == FIELD_USER) ? n : (size_t) n * sizeof(mp_limb_t);
+        size_t padded = (bytes + KEY_FIELD - 1) / KEY_FIELD * KEY_FIELD;
+        if (id >= FIELDS || KEY_HEADER + payload - pos - KEY_FIELD < padded) {
+            return false;
+        }
+        fields->data[id] = &data[pos + KEY_FIELD];
+        fields->count[id] = n;
+        pos += KEY_FIELD + padded;
+    }
+    return true;
+}
+
+static bool has_mont(key_fields_t *fields, int modulus, int ninv) { //rr has to match the modulus
+    return fields->data[modulus] != NULL && fields->count[modulus] > 0 && fields->data[ninv] != NULL
+           && fields->count[ninv] == 1 && fields->data[ninv + 1] != NULL
+           && fields->count[ninv + 1] == fields->count[modulus];
+}
+
+static void get_mpz(mpz_t x, key_fields_t *fields, int id) {
+    uint32_t count = fields->count[id];
+
+    if (fields->data[id] == NULL || count == 0) {
+        mpz_set_ui(x, 0);
+        return;
+    }
+    memcpy(mpz_limbs_write(x, count), fields->data[id], count * sizeof(mp_limb_t));
+    mpz_limbs_finish(x, count);
+    return;
+}
+
+static void get_mont(mont_t *mont, mpz_t modulus, key_fields_t *fields, int ninv) {
+    mp_limb_t value;
+
+    memcpy(&value, fields->data[ninv], sizeof(mp_limb_t));
+    //fields start on limb boundaries, the mapping and the copy are both aligned
+    mont_init_pre(mont, modulus, value, (const mp_limb_t *) fields->data[ninv + 1]);
+    return;
+}
+
+static void set_modulus(rsa_ctx_t *ctx, key_fields_t *fields) { //what rsa_ctx_set_pub derives from n
+    get_mpz(ctx->n, fields, FIELD_N);
+    get_mont(&ctx->mont_n, ctx->n, fields, FIELD_N_NINV);
+
+    for (int i = 0; i < RSA_CTX_SCRATCH; i += 1) { //products of two residues never need more
+        mpz_realloc2(ctx->scratch[i], 2 * mpz_sizeinbase(ctx->n, 2) + GMP_NUMB_BITS);
+    }
+    return;
+}
+
+//ctx must not hold a key yet, verified tells whether encrypt can skip checking s
+bool keyfile_read_pub(rsa_ctx_t *ctx, FILE *file, mpz_t s, char username[], size_t size,
+    bool *verified) {
+    map_input_t in;
+    uint8_t *copy;
+    size_t len;
+    key_fields_t fields;
+    uint8_t flags = 0;
+
+    const uint8_t *data = load_key(file, &in, &copy, &len);
+    bool ok = parse_key(data, len, KEY_PUBLIC, &fields, &flags) && fields.data[FIELD_E] != NULL
+              && fields.data[FIELD_S] != NULL && fields.data[FIELD_USER] != NULL
+              && has_mont(&fields, FIELD_N, FIELD_N_NINV);
+
+    if (ok) {
+        set_modulus(ctx, &fields);
+        get_mpz(ctx->e, &fields, FIELD_E);
+        get_mpz(s, &fields, FIELD_S);
+        size_t n = (fields.count[FIELD_USER] < size) ? fields.count[FIELD_USER] : size - 1;
+        memcpy(username, fields.data[FIELD_USER], n);
+        username[n] = '\0';
+        ctx->has_pub = true;
+        *verified = (flags & KEY_VERIFIED) != 0;
+    }
+
+    if (copy != NULL) {
+        free(copy);
+    } else {
+        mapio_close(&in);
+    }
+    return ok;
+}
+
+//ctx must not hold a key yet
+bool keyfile_read_priv(rsa_ctx_t *ctx, FILE *file) {
+    map_input_t in;
+    uint8_t *copy;
+    size_t len;
+    key_fields_t fields;
+    uint8_t flags = 0;
+
+    const uint8_t *data = load_key(file, &in, &copy, &len);
+    bool ok = parse_key(data, len, KEY_PRIVATE, &fields, &flags) && fields.data[FIELD_D] != NULL
+              && has_mont(&fields, FIELD_N, FIELD_N_NINV);
+    bool crt = ok && fields.data[FIELD_P] != NULL;
+    ok = ok
+         && (!crt
+             || (fields.data[FIELD_DP] != NULL && fields.data[FIELD_DQ] != NULL
+                 && fields.data[FIELD_QINV] != NULL && has_mont(&fields, FIELD_P, FIELD_P_NINV)
+                 && has_mont(&fields, FIELD_Q, FIELD_Q_NINV)));
+
+    if (ok) {
+        set_modulus(ctx, &fields);
+        mpz_set(ctx->priv.n, ctx->n);
+        get_mpz(ctx->priv.d, &fields, FIELD_D);
+        ctx->priv.crt = crt;
+        if (crt) {
+            get_mpz(ctx->priv.p, &fields, FIELD_P);
+            get_mpz(ctx->priv.q, &fields, FIELD_Q);
+            get_mpz(ctx->priv.dp, &fields, FIELD_DP);
+            get_mpz(ctx->priv.dq, &fields, FIELD_DQ);
+            get_mpz(ctx->priv.qinv, &fields, FIELD_QINV);
+            get_mont(&ctx->mont_p, ctx->priv.p, &fields, FIELD_P_NINV);
+            get_mont(&ctx->mont_q, ctx->priv.q, &fields, FIELD_Q_NINV);
+        }
+        ctx->priv.extra = 0; //extra primes come as whole triples, in order
+        while (crt && ctx->priv.extra < RSA_MAX_PRIMES - 2) {
+            uint64_t i = ctx->priv.extra;
+            if (fields.data[FIELD_R1 + 3 * i] == NULL || fields.data[FIELD_DR1 + 3 * i] == NULL
+                || fields.data[FIELD_TR1 + 3 * i] == NULL) {
+                break;
+            }
+            get_mpz(ctx->priv.r[i], &fields, FIELD_R1 + 3 * i);
+            get_mpz(ctx->priv.dr[i], &fields, FIELD_DR1 + 3 * i);
+            get_mpz(ctx->priv.tr[i], &fields, FIELD_TR1 + 3 * i);
+            mont_init(&ctx->mont_r[i], ctx->priv.r[i]); //no stored montgomery values for these
+            ctx->priv.extra += 1;
+        }
+        rsa_priv_find_e(&ctx->priv); //for blinding, compiled keys do not store it
+        ctx->has_priv = true;
+    }
+
+    if (copy != NULL) {
+        free(copy);
+    } else {
+        mapio_close(&in);
+    }
+    return ok;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+#include "rsa.h"
+#include "rsactx.h"
+
+#define KEYFILE_MAGIC "RSAK" //first bytes of a compiled key, never valid hex
+#define KEYFILE_SUFFIX ".k" //appended to the text key name by keygen -k and -c
+
+bool keyfile_detect(FILE *file);
+
+bool keyfile_write_pub(FILE *file, mpz_t n, mpz_t e, mpz_t s, char username[]);
+
+bool keyfile_write_priv(FILE *file, rsa_priv_t *key);
+
+bool keyfile_read_pub(rsa_ctx_t *ctx, FILE *file, mpz_t s, char username[], size_t size,
+    bool *verified);
+
+bool keyfile_read_priv(rsa_ctx_t *ctx, FILE *file);
@@ -2,36 +2,68 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <gmp.h>
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "stats.h"
+#include "arena.h"
+#include "keyfile.h"
 
-#define OPTIONS "hvb:i:n:d:s:"
+#define OPTIONS "hvfkcb:i:n:d:s:t:e:m:u:N:p:o:"
+
+static const struct option long_options[] = { //long only options
+    { "stats", optional_argument, NULL, 'S' },
+    { "alloc", required_argument, NULL, 'A' },
+    { NULL, 0, NULL, 0 },
+};
 
 void program_usage(void) { //prints help message
     fprintf(stderr, "SYNOPSIS\n");
     fprintf(stderr, "   Generates an RSA public/private key pair.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "USAGE\n");
-    fprintf(stderr, "   ./keygen [-hv] [-b bits] -n pbfile -d pvfile\n");
+    fprintf(stderr, "   ./keygen [-hvfkc] [--stats[=json]] [--alloc=arena] [-b bits] [-e exponent] [-m primes] [-t threads] -n pbfile -d pvfile\n");
+    fprintf(stderr, "   ./keygen [-hvfk] [-b bits] [-e exponent] [-m primes] [-t threads] [-s seed] -o dir -u users\n");
+    fprintf(stderr, "   ./keygen [-hvfk] [-b bits] [-e exponent] [-m primes] [-t threads] [-s seed] -o dir -N count [-p prefix]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "OPTIONS\n");
     fprintf(stderr, "   -h              Display program help and usage.\n");
     fprintf(stderr, "   -v              Display verbose program output.\n");
+    fprintf(stderr, "   --stats[=json]  Print hot path counters and timers to stderr at exit.\n");
+    fprintf(stderr, "   --alloc=arena   Serve GMP allocations from per thread arenas (default: system).\n");
+    fprintf(stderr, "   -f              Use the fixed public exponent e = %d (the default).\n", RSA_DEFAULT_E);
+    fprintf(stderr, "   -e exponent     Use a fixed odd public exponent, 0 picks a random one as wide as n\n");
+    fprintf(stderr, "                   (default: %d).\n", RSA_DEFAULT_E);
+    fprintf(stderr, "   -m primes       Prime factors of n, 2 to %d, more are faster for large n (default: 2).\n", RSA_MAX_PRIMES);
+    fprintf(stderr, "   -k              Also write compiled keys to pbfile.k and pvfile.k.\n");
+    fprintf(stderr, "   -c              Compile the existing pbfile and pvfile instead of generating.\n");
     fprintf(stderr, "   -b bits         Minimum bits needed for public key n (default: 256).\n");
     fprintf(
-        stderr, "   -i confidence   Miller-Rabin iterations for testing primes (default: 50).\n");
+        stderr, "   -i confidence   Miller-Rabin rounds after Baillie-PSW (default: by size).\n");
     fprintf(stderr, "   -n pbfile       Public key file (default: rsa.pub).\n");
     fprintf(stderr, "   -d pvfile       Private key file (default: rsa.priv).\n");
     fprintf(stderr, "   -s seed         Random seed for testing.\n");
+    fprintf(stderr, "   -t threads      Threads searching for p and q, or generating keys in bulk\n");
+    fprintf(stderr, "                   mode (default: 1).\n");
+    fprintf(stderr, "   -o dir          Bulk mode, write user.pub and user.priv for every user to dir.\n");
+    fprintf(stderr, "   -u users        File of usernames, one per line, for bulk mode.\n");
+    fprintf(stderr, "   -N count        Make count users named prefix0, prefix1, ... for bulk mode.\n");
+    fprintf(stderr, "   -p prefix       Username prefix for -N (default: user).\n");
 }
 
 int bitcounter(mpz_t x) { //For verbose printing. Print the number of bits.
@@ -49,46 +81,385 @@ int bitcounter(mpz_t x) { //For verbose printing. Print the number of bits.
     return count;
 }
 
+static FILE *open_compiled(char *name, bool private) { //name with the compiled key suffix
+    char *path = malloc(strlen(name) + strlen(KEYFILE_SUFFIX) + 1);
+    strcpy(path, name);
+    strcat(path, KEYFILE_SUFFIX);
+
+    FILE *file = fopen(path, "w");
+    if (file != NULL && private) {
+        fchmod(fileno(file), 0600); //same permissions as the text private key
+    }
+    free(path);
+    return file;
+}
+
+bool write_compiled(char *pubname, char *privname, mpz_t n, mpz_t e, mpz_t s, char *username,
+    rsa_priv_t *key) {
+    FILE *public = open_compiled(pubname, false);
+    FILE *private = open_compiled(privname, true);
+
+    bool ok = public && private && keyfile_write_pub(public, n, e, s, username)
+              && keyfile_write_priv(private, key);
+
+    if (public) {
+        ok = fclose(public) == 0 && ok; //the last buffered bytes can still fail to write
+    }
+    if (private) {
+        ok = fclose(private) == 0 && ok;
+    }
+    return ok;
+}
+
+int convert_keys(char *pubname, char *privname) { //compiles an existing text key pair
+    FILE *public = fopen(pubname, "r");
+    FILE *private = fopen(privname, "r");
+
+    if (!public || !private) {
+        perror("Error");
+        return 1;
+    }
+
+    mpz_t n, e, s;
+    mpz_inits(n, e, s, NULL);
+    char username[_POSIX_LOGIN_NAME_MAX];
+    rsa_priv_t key;
+    rsa_priv_init(&key);
+
+    rsa_read_pub(n, e, s, username, public);
+    rsa_read_priv_crt(&key, private); //old keys without CRT values compile without them
+
+    int status = 0;
+    if (!write_compiled(pubname, privname, n, e, s, username, &key)) {
+        perror("Error");
+        status = 1;
+    }
+
+    mpz_clears(n, e, s, NULL);
+    rsa_priv_clear(&key);
+    fclose(public);
+    fclose(private);
+    return status;
+}
+
+//bulk mode hands out key numbers to a pool of threads, key i always draws from random stream i
+//of the seed so the keys do not depend on the thread count or on which thread made them
+typedef struct {
+    char **names; //usernames, one key pair each
+    uint64_t count;
+    atomic_uint_fast64_t next; //next key a worker takes
+    atomic_uint_fast64_t failed; //keys that could not be written
+    char *dir;
+    uint64_t bits, iters, exponent, seed;
+    uint64_t factors; //primes in every modulus
+    bool compiled;
+    bool verbose;
+} bulk_t;
+
+static bool valid_username(const char *name) { //signed as a base 62 number, read back as %s
+    size_t len = strlen(name);
+    if (len == 0 || len >= _POSIX_LOGIN_NAME_MAX) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i += 1) {
+        if (!isalnum((unsigned char) name[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void free_usernames(char **names, uint64_t count) {
+    for (uint64_t i = 0; i < count; i += 1) {
+        free(names[i]);
+    }
+    free(names);
+    return;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+//a name listed twice would have two workers writing the same files at once
+static bool unique_usernames(char **names, uint64_t count) {
+    char **sorted = malloc((count > 0 ? count : 1) * sizeof(char *));
+    bool unique = true;
+
+    memcpy(sorted, names, count * sizeof(char *));
+    qsort(sorted, count, sizeof(char *), compare_names);
+    for (uint64_t i = 1; i < count && unique; i += 1) {
+        if (strcmp(sorted[i - 1], sorted[i]) == 0) {
+            fprintf(stderr, "Error: username '%s' is listed more than once.\n", sorted[i]);
+            unique = false;
+        }
+    }
+    free(sorted);
+    return unique;
+}
+
+//one name per line, blank lines skipped, false on a name keys cannot be made for
+static bool read_usernames(FILE *file, char ***list, uint64_t *count) {
+    char **names = NULL;
+    char *line = NULL;
+    size_t cap = 0, size = 0;
+    *count = 0;
+
+    while (getline(&line, &cap, file) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        if (!valid_username(line)) {
+            fprintf(stderr, "Error: invalid username '%s', use 1 to %d letters and digits.\n", line,
+                _POSIX_LOGIN_NAME_MAX - 1);
+            free(line);
+            free_usernames(names, *count);
+            return false;
+        }
+        if (*count == size) {
+            size = (size > 0) ? 2 * size : 64;
+            names = realloc(names, size * sizeof(char *));
+        }
+        names[*count] = strdup(line);
+        *count += 1;
+    }
+    free(line);
+    if (!unique_usernames(names, *count)) {
+        free_usernames(names, *count);
+        return false;
+    }
+    *list = names;
+    return true;
+}
+
+static char **make_usernames(const char *prefix, uint64_t count) { //prefix0 ... prefix(count - 1)
+    char **names = malloc(count * sizeof(char *));
+    char name[_POSIX_LOGIN_NAME_MAX];
+
+    for (uint64_t i = 0; i < count; i += 1) {
+        int len = snprintf(name, sizeof(name), "%s%" PRIu64, prefix, i);
+        if (len < 0 || (size_t) len >= sizeof(name) || !valid_username(name)) {
+            fprintf(stderr, "Error: prefix too long or not letters and digits.\n");
+            free_usernames(names, i);
+            return NULL;
+        }
+        names[i] = strdup(name);
+    }
+    return names;
+}
+
+static bool bulk_write(bulk_t *bulk, char *name, mpz_t n, mpz_t e, mpz_t s, rsa_priv_t *key) {
+    size_t len = strlen(bulk->dir) + strlen(name) + sizeof(".priv") + 1;
+    char *pubname = malloc(len);
+    char *privname = malloc(len);
+    snprintf(pubname, len, "%s/%s.pub", bulk->dir, name);
+    snprintf(privname, len, "%s/%s.priv", bulk->dir, name);
+
+    FILE *public = fopen(pubname, "w");
+    if (public == NULL) { //reported here while errno still belongs to the failed open
+        fprintf(stderr, "Error: could not open %s: %s\n", pubname, strerror(errno));
+    }
+    FILE *private = fopen(privname, "w");
+    if (private == NULL) {
+        fprintf(stderr, "Error: could not open %s: %s\n", privname, strerror(errno));
+    }
+    bool ok = public && private;
+    if (ok) {
+        fchmod(fileno(private), 0600); //same permissions as a single private key
+        rsa_write_pub(n, e, s, name, public);
+        rsa_write_priv_crt(key, private);
+    }
+    if (public) {
+        ok = fclose(public) == 0 && ok;
+    }
+    if (private) {
+        ok = fclose(private) == 0 && ok;
+    }
+    if (ok && bulk->compiled) {
+        ok = write_compiled(pubname, privname, n, e, s, name, key);
+    }
+
+    free(pubname);
+    free(privname);
+    return ok;
+}
+
+static void *bulk_worker(void *arg) {
+    bulk_t *bulk = arg;
+    gmp_randstate_t st;
+    gmp_randinit_mt(st);
+
+    mpz_t s, str, d, p, q, n, e, extra[RSA_MAX_PRIMES - 2];
+    mpz_inits(s, str, d, p, q, n, e, extra[0], extra[1], NULL);
+    mpz_ptr primes[RSA_MAX_PRIMES] = { p, q, extra[0], extra[1] };
+    rsa_priv_t key;
+    rsa_priv_init(&key);
+
+    uint64_t index;
+    while ((index = atomic_fetch_add(&bulk->next, 1)) < bulk->count) {
+        char *name = bulk->names[index];
+        randstate_seed_stream(st, bulk->seed, index);
+
+        rsa_make_pub_multi(primes, bulk->factors, n, e, bulk->bits, bulk->iters, bulk->exponent, 1, st);
+        rsa_make_priv_multi(d, e, primes, bulk->factors);
+        rsa_make_crt_multi(&key, n, d, primes, bulk->factors);
+
+        mpz_set_str(str, name, 62);
+        rsa_sign_crt(s, str, &key); //same signature a single keygen run makes
+
+        if (!bulk_write(bulk, name, n, e, s, &key)) {
+            fprintf(stderr, "Error: could not write the keys of %s.\n", name);
+            atomic_fetch_add(&bulk->failed, 1);
+        } else if (bulk->verbose) {
+            gmp_printf("%s n (%d bits) = %Zd\n", name, bitcounter(n), n);
+        }
+        arena_block(); //one key pair is one block of work
+    }
+
+    mpz_clears(s, str, d, p, q, n, e, extra[0], extra[1], NULL);
+    rsa_priv_clear(&key);
+    gmp_randclear(st);
+    return NULL;
+}
+
+int bulk_keys(bulk_t *bulk, uint64_t threads) { //every key pair of bulk, threads at a time
+    if (mkdir(bulk->dir, 0700) != 0 && errno != EEXIST) {
+        perror("Error");
+        return 1;
+    }
+
+    threads = (threads > 0) ? threads : 1;
+    threads = (threads < bulk->count) ? threads : (bulk->count > 0 ? bulk->count : 1);
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+
+    for (uint64_t t = 0; t < threads; t += 1) {
+        pthread_create(&workers[t], NULL, bulk_worker, bulk);
+    }
+    for (uint64_t t = 0; t < threads; t += 1) {
+        pthread_join(workers[t], NULL);
+    }
+    free(workers);
+
+    uint64_t failed = atomic_load(&bulk->failed);
+    if (bulk->verbose) {
+        fprintf(stderr, "%" PRIu64 " key pairs in %s, seed %" PRIu64 "\n", bulk->count - failed,
+            bulk->dir, bulk->seed);
+    }
+    return (failed > 0) ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
 
     int opt = 0;
     bool test_v = false; 
-    bool openpubfile = false; 
-    bool openprivfile = false;
+    bool compiled = false; //write pbfile.k and pvfile.k next to the text keys
+    bool convert = false; //only compile the text keys that already exist
+    char *pubname = "rsa.pub";
+    char *privname = "rsa.priv";
     FILE *public;
     FILE *private;
     
     uint64_t b = 256; //the minimum bits for modulus n
-    uint64_t i = 50; //number of MR iterations for primes
+    uint64_t i = PRIME_ITERS_AUTO; //MR rounds for primes, picked from the prime size
     uint64_t seed = time(NULL); //set seed to time module.
+    uint64_t threads = 1; //prime search threads, the key does not depend on it
+    uint64_t exponent = RSA_DEFAULT_E; //fixed public exponent, 0 picks a random e as wide as n
+    uint64_t factors = 2; //primes in n
+    char *bulkdir = NULL; //bulk mode writes every key pair here
+    char *userfile = NULL; //bulk usernames, one per line
+    char *prefix = "user"; //bulk usernames made from a count
+    uint64_t count = 0;
 
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'h': program_usage(); exit(0);
         case 'v': test_v = true; break;
+        case 'f': exponent = RSA_DEFAULT_E; break; //fixed small public exponent, also the default
+        case 'e': exponent = strtoull(optarg, NULL, 10); break; //user chosen public exponent
+        case 'm': factors = strtoull(optarg, NULL, 10); break; //multi-prime modulus
         case 'b': b = strtoull(optarg, NULL, 10); break; //takes new min bits from user
         case 'i': i = strtoull(optarg, NULL, 10); break; //takes iterations num from user
-        case 'n': public = fopen(optarg, "w");
-                  openpubfile = true; //does not open default file created
-                  break;
-        case 'd':
-            //open private file from user
-                  private = fopen(optarg, "w");
-                  openprivfile = true; //stops default file from opening
-                  break;
+        case 'k': compiled = true; break; //binary keys the tools load without parsing
+        case 'c': convert = true; break; //compile existing keys
+        case 'n': pubname = optarg; break; //public file from user
+        case 'd': privname = optarg; break; //private file from user
         case 's': seed = strtoull(optarg, NULL, 10); break; //make seed to user inputs
+        case 't': threads = strtoull(optarg, NULL, 10); break; //threads for make prime
+        case 'o': bulkdir = optarg; break; //bulk output directory
+        case 'u': userfile = optarg; break; //bulk usernames from a file
+        case 'N': count = strtoull(optarg, NULL, 10); break; //bulk usernames from a count
+        case 'p': prefix = optarg; break;
+        case 'S':
+            if (!stats_parse(optarg)) { //only text and json reports exist
+                program_usage();
+                exit(1);
+            }
+            break;
+        case 'A':
+            if (!arena_select(optarg)) { //arena or system, installed before gmp allocates
+                program_usage();
+                exit(1);
+            }
+            break;
         default: program_usage(); exit(1);
         }
     }
 
-    if (openpubfile == false) {
-        //open default public file
-        public = fopen("rsa.pub", "w");
+    if (exponent != 0 && (exponent < 3 || exponent % 2 == 0)) { //even e is never invertible
+        fprintf(stderr, "Error: public exponent must be odd and at least 3.\n");
+        exit(1);
+    }
+
+    if (factors < 2 || factors > RSA_MAX_PRIMES || (factors > 2 && b / factors < 32)) { //tiny primes repeat too often
+        fprintf(stderr, "Error: use 2 to %d primes of at least 32 bits each.\n", RSA_MAX_PRIMES);
+        exit(1);
     }
 
-    if (openprivfile == false) {
-        //open default private file
-        private = fopen("rsa.priv", "w");
+    if (convert) {
+        return convert_keys(pubname, privname);
+    }
+
+    arena_size_for(b);
+
+    if (bulkdir != NULL) { //many key pairs in one process, one per thread at a time
+        if ((userfile == NULL) == (count == 0)) { //names come from exactly one source
+            program_usage();
+            exit(1);
+        }
+        bulk_t bulk = { .dir = bulkdir, .bits = b, .iters = i, .exponent = exponent, .seed = seed,
+            .factors = factors, .compiled = compiled, .verbose = test_v };
+        if (userfile != NULL) {
+            FILE *users = fopen(userfile, "r");
+            if (!users) {
+                perror("Error");
+                exit(1);
+            }
+            bool read = read_usernames(users, &bulk.names, &bulk.count);
+            fclose(users);
+            if (!read) {
+                exit(1);
+            }
+        } else {
+            bulk.names = make_usernames(prefix, count);
+            bulk.count = count;
+            if (bulk.names == NULL) {
+                exit(1);
+            }
+        }
+
+        int status = bulk_keys(&bulk, threads);
+        free_usernames(bulk.names, bulk.count);
+        arena_flush();
+        stats_report(stderr); //no output unless --stats was given
+        return status;
+    }
+
+    public = fopen(pubname, "w"); //open the public and private files, rsa.pub and rsa.priv by default
+    private = fopen(privname, "w");
+    if (!public || !private) {
+        perror("Error");
+        exit(1);
     }
 
     int fd = fileno(private); //create file desc for fchmod
@@ -97,25 +468,39 @@ int main(int argc, char **argv) {
 
     randstate_init(seed); //create Mersenne Twister with seed
 
-    mpz_t m, s, str, d, p, q, n, e;
-    mpz_inits(m, s, str, d, p, q, n, e, NULL); //inits all the values
+    mpz_t m, s, str, d, p, q, n, e, extra[RSA_MAX_PRIMES - 2];
+    mpz_inits(m, s, str, d, p, q, n, e, extra[0], extra[1], NULL); //inits all the values
+    mpz_ptr primes[RSA_MAX_PRIMES] = { p, q, extra[0], extra[1] }; //p and q, then any extra primes
 
-    rsa_make_pub(p, q, n, e, b, i); //create a public key
-    rsa_make_priv(d, e, p, q); //create a private key
+    rsa_make_pub_multi(primes, factors, n, e, b, i, exponent, threads, state); //create a public key
+    rsa_make_priv_multi(d, e, primes, factors); //create a private key
+
+    rsa_priv_t key;
+    rsa_priv_init(&key);
+    rsa_make_crt_multi(&key, n, d, primes, factors); //keep p, q, dp, dq and qinv for CRT
 
     char *username = getenv("USER"); 
 
     mpz_set_str(str, username, 62); 
-    rsa_sign(s, str, d, n); //sign the username to show it was checked by keygen
+    rsa_sign_crt(s, str, &key); //sign the username to show it was checked by keygen
 
     rsa_write_pub(n, e, s, username, public); //write to the public file
-    rsa_write_priv(n, d, private); //write to the private file
+    rsa_write_priv_crt(&key, private); //write to the private file
+
+    int exit_code = 0;
+    if (compiled && !write_compiled(pubname, privname, n, e, s, username, &key)) {
+        perror("Error");
+        exit_code = 1; //the text pair is written, but scripts must not go on with a partial .k
+    }
 
     if (test_v) { //print verbose 
         printf("user = %s\n", username); //username
         gmp_printf("s (%d bits) = %Zd\n", bitcounter(s), s); //signature
         gmp_printf("p (%d bits) = %Zd\n", bitcounter(p), p); //first large prime
         gmp_printf("q (%d bits) = %Zd\n", bitcounter(q), q); //second large prime
+        for (uint64_t k = 2; k < factors; k += 1) { //extra primes of a multi-prime key
+            gmp_printf("r%" PRIu64 " (%d bits) = %Zd\n", k - 1, bitcounter(primes[k]), primes[k]);
+        }
         gmp_printf("n (%d bits) = %Zd\n", bitcounter(n), n); //pub mod
         gmp_printf("e (%d bits) = %Zd\n", bitcounter(e), e); //pub exponenet
         gmp_printf("d (%d bits) = %Zd\n", bitcounter(d), d); //private key
@@ -123,9 +508,13 @@ int main(int argc, char **argv) {
 
     //clear MT, clear mpz, and close all files
     randstate_clear();
-    mpz_clears(m, s, str, d, p, q, n, e, NULL);
+    mpz_clears(m, s, str, d, p, q, n, e, extra[0], extra[1], NULL);
+    rsa_priv_clear(&key);
     fclose(public);
     fclose(private);
 
-    return 0;
+    arena_flush(); //counts of the main thread, workers added theirs as they exited
+    stats_report(stderr); //no output unless --stats was given
+
+    return exit_code;
 }
@@ -0,0 +1,99 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "mapio.h"
+
+bool mapio_open(map_input_t *in, FILE *file) {
+    struct stat st;
+    int fd = fileno(file);
+    off_t offset = ftello(file); //stdio may already have read past a header
+
+    in->base = NULL;
+    in->size = 0;
+    if (fd < 0 || offset < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+        || st.st_size <= offset) { //pipes, terminals and empty files are streamed instead
+        return false;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL); //read ahead aggressively, drop pages behind
+
+    in->base = base;
+    in->size = st.st_size;
+    in->data = in->base + offset;
+    in->len = st.st_size - offset;
+    in->pos = 0;
+    return true;
+}
+
+void mapio_close(map_input_t *in) {
+    if (in->base != NULL) {
+        munmap(in->base, in->size);
+        in->base = NULL;
+    }
+    return;
+}
+
+void outbuf_init(out_buffer_t *out, FILE *file) {
+    fflush(file); //anything already written through stdio goes first
+    out->fd = fileno(file);
+    out->len = 0;
+    out->failed = false;
+    if (posix_memalign((void **) &out->buf, OUTBUF_ALIGN, OUTBUF_SIZE) != 0) {
+        out->buf = NULL;
+        out->failed = true;
+    }
+    return;
+}
+
+void outbuf_flush(out_buffer_t *out) {
+    size_t done = 0;
+
+    while (!out->failed && done < out->len) {
+        ssize_t n = write(out->fd, out->buf + done, out->len - done);
+        if (n <= 0) {
+            perror("Error");
+            out->failed = true;
+            break;
+        }
+        done += n;
+    }
+    out->len = 0;
+    return;
+}
+
+void outbuf_write(out_buffer_t *out, const void *data, size_t len) {
+    const uint8_t *bytes = data;
+
+    while (len > 0 && !out->failed) {
+        size_t room = OUTBUF_SIZE - out->len;
+        size_t n = (len < room) ? len : room;
+
+        memcpy(out->buf + out->len, bytes, n);
+        out->len += n;
+        bytes += n;
+        len -= n;
+
+        if (out->len == OUTBUF_SIZE) {
+            outbuf_flush(out);
+        }
+    }
+    return;
+}
+
+void outbuf_close(out_buffer_t *out) {
+    outbuf_flush(out);
+    free(out->buf);
+    out->buf = NULL;
+    return;
+}
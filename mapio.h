@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define OUTBUF_SIZE (1 << 20) //bytes collected before each write
+#define OUTBUF_ALIGN 4096 //page aligned so the kernel can copy whole pages
+
+typedef struct {
+    uint8_t *base; //start of the mapping
+    size_t size; //length of the mapping
+    const uint8_t *data; //input starting at the file position when it was mapped
+    size_t len; //bytes available at data
+    size_t pos; //bytes consumed so far
+} map_input_t;
+
+typedef struct {
+    int fd; //descriptor written to directly, bypassing stdio
+    uint8_t *buf;
+    size_t len; //bytes waiting in buf
+    bool failed; //a write failed, later data is dropped
+} out_buffer_t;
+
+bool mapio_open(map_input_t *in, FILE *file);
+
+void mapio_close(map_input_t *in);
+
+void outbuf_init(out_buffer_t *out, FILE *file);
+
+void outbuf_write(out_buffer_t *out, const void *data, size_t len);
+
+void outbuf_flush(out_buffer_t *out);
+
+void outbuf_close(out_buffer_t *out);
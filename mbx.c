@@ -0,0 +1,295 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define MBX_X86 1
+#else
+#define MBX_X86 0
+#endif
+
+#include "mbx.h"
+#include "stats.h"
+
+//values are below 2n between multiplications and only reduced fully at the end, which needs
+//R > 4n, every digit stays below 2^bits so the 64 bit accumulators cannot overflow
+#if MBX_X86
+
+#define IFMA_BITS 52
+#define IFMA_MASK ((UINT64_C(1) << IFMA_BITS) - 1)
+
+__attribute__((target("avx512f,avx512ifma"))) static void mul_ifma(
+    mbx_t *ctx, uint64_t *rp, const uint64_t *ap, const uint64_t *bp) {
+    size_t limbs = ctx->limbs;
+    __m512i *t = (__m512i *) ctx->prod;
+    const __m512i *a = (const __m512i *) ap;
+    const __m512i *b = (const __m512i *) bp;
+    const __m512i *n = (const __m512i *) ctx->np;
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i ninv = _mm512_set1_epi64(ctx->ninv);
+
+    for (size_t j = 0; j <= 2 * limbs; j += 1) {
+        t[j] = zero;
+    }
+
+    for (size_t i = 0; i < limbs; i += 1) { //one digit of a, then one montgomery step
+        __m512i *ti = t + i;
+        for (size_t j = 0; j < limbs; j += 1) { //52 x 52 bit products split in low and high halves
+            ti[j] = _mm512_madd52lo_epu64(ti[j], a[i], b[j]);
+            ti[j + 1] = _mm512_madd52hi_epu64(ti[j + 1], a[i], b[j]);
+        }
+        __m512i m = _mm512_madd52lo_epu64(zero, ti[0], ninv); //makes digit i zero mod 2^52
+        for (size_t j = 0; j < limbs; j += 1) {
+            ti[j] = _mm512_madd52lo_epu64(ti[j], m, n[j]);
+            ti[j + 1] = _mm512_madd52hi_epu64(ti[j + 1], m, n[j]);
+        }
+        ti[1] = _mm512_add_epi64(ti[1], _mm512_srli_epi64(ti[0], IFMA_BITS));
+    }
+
+    __m512i *r = (__m512i *) rp;
+    __m512i carry = zero;
+    const __m512i mask = _mm512_set1_epi64(IFMA_MASK);
+    for (size_t j = 0; j < limbs; j += 1) { //the result is below 2n < R, nothing carries out
+        __m512i v = _mm512_add_epi64(t[limbs + j], carry);
+        r[j] = _mm512_and_si512(v, mask);
+        carry = _mm512_srli_epi64(v, IFMA_BITS);
+    }
+    return;
+}
+
+#endif
+
+//avx2 has no 52 bit multiply, 4 lanes of 26 bit digits came out slower than gmp's scalar code
+size_t mbx_lanes(void) { //values per call on this cpu, 0 when only the scalar path runs
+#if MBX_X86 && GMP_NUMB_BITS == 64 && GMP_NAIL_BITS == 0
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512ifma")) {
+        return 8;
+    }
+#endif
+    return 0;
+}
+
+static uint64_t *digits_alloc(mbx_t *ctx, size_t count) { //count digits of every lane, aligned
+    size_t bytes = count * ctx->lanes * sizeof(uint64_t);
+    bytes = (bytes + 63) & ~(size_t) 63;
+    uint64_t *p = aligned_alloc(64, bytes);
+    memset(p, 0, bytes);
+    return p;
+}
+
+//stores x in lane of dp, x is below R and non negative
+static void digits_from_mpz(mbx_t *ctx, uint64_t *dp, size_t lane, mpz_t x) {
+    const mp_limb_t *xp = mpz_limbs_read(x);
+    size_t used = mpz_size(x);
+    uint64_t mask = (UINT64_C(1) << ctx->bits) - 1;
+
+    for (size_t i = 0; i < ctx->limbs; i += 1) {
+        size_t bit = i * ctx->bits;
+        size_t q = bit / 64, s = bit % 64;
+        uint64_t v = (q < used) ? xp[q] >> s : 0;
+        if (s + ctx->bits > 64 && q + 1 < used) {
+            v |= xp[q + 1] << (64 - s);
+        }
+        dp[i * ctx->lanes + lane] = v & mask;
+    }
+    return;
+}
+
+static void digits_to_mpz(mbx_t *ctx, mpz_t x, const uint64_t *dp, size_t lane) {
+    size_t size = (ctx->limbs * ctx->bits + 63) / 64;
+    mp_limb_t *xp = mpz_limbs_write(x, size);
+    memset(xp, 0, size * sizeof(mp_limb_t));
+
+    for (size_t i = 0; i < ctx->limbs; i += 1) {
+        size_t bit = i * ctx->bits;
+        size_t q = bit / 64, s = bit % 64;
+        uint64_t v = dp[i * ctx->lanes + lane];
+        xp[q] |= v << s;
+        if (s + ctx->bits > 64) {
+            xp[q + 1] |= v >> (64 - s);
+        }
+    }
+    mpz_limbs_finish(x, size);
+    return;
+}
+
+static void digits_broadcast(mbx_t *ctx, uint64_t *dp, mpz_t x) { //x in every lane
+    for (size_t lane = 0; lane < ctx->lanes; lane += 1) {
+        digits_from_mpz(ctx, dp, lane, x);
+    }
+    return;
+}
+
+bool mbx_init(mbx_t *ctx, mpz_t n) {
+    size_t lanes = mbx_lanes();
+    ctx->lanes = 0;
+    if (lanes == 0 || mpz_even_p(n) || mpz_cmp_ui(n, 1) <= 0) { //montgomery needs an odd modulus
+        return false;
+    }
+
+#if MBX_X86
+    ctx->lanes = lanes;
+    ctx->bits = IFMA_BITS;
+    ctx->mul = mul_ifma;
+#endif
+    ctx->limbs = (mpz_sizeinbase(n, 2) + 2 + ctx->bits - 1) / ctx->bits; //R > 4n
+
+    mpz_inits(ctx->n, ctx->t, NULL);
+    mpz_set(ctx->n, n);
+
+    mpz_setbit(ctx->t, ctx->bits); //ninv = -n^-1 mod 2^bits
+    mpz_invert(ctx->t, n, ctx->t);
+    mpz_ui_sub(ctx->t, UINT64_C(1) << ctx->bits, ctx->t);
+    ctx->ninv = mpz_get_ui(ctx->t);
+
+    ctx->np = digits_alloc(ctx, ctx->limbs);
+    ctx->rr = digits_alloc(ctx, ctx->limbs);
+    ctx->one = digits_alloc(ctx, ctx->limbs);
+    ctx->prod = digits_alloc(ctx, 2 * ctx->limbs + 1);
+    ctx->acc = digits_alloc(ctx, ctx->limbs);
+    ctx->table = NULL;
+    ctx->entries = 0;
+
+    digits_broadcast(ctx, ctx->np, n);
+    mpz_set_ui(ctx->t, 0);
+    mpz_setbit(ctx->t, 2 * ctx->bits * ctx->limbs); //R^2
+    mpz_mod(ctx->t, ctx->t, n);
+    digits_broadcast(ctx, ctx->rr, ctx->t);
+    mpz_set_ui(ctx->t, 1);
+    digits_broadcast(ctx, ctx->one, ctx->t);
+    return true;
+}
+
+void mbx_clear(mbx_t *ctx) {
+    if (ctx->lanes == 0) {
+        return;
+    }
+    mpz_clears(ctx->n, ctx->t, NULL);
+    free(ctx->np);
+    free(ctx->rr);
+    free(ctx->one);
+    free(ctx->prod);
+    free(ctx->acc);
+    free(ctx->table);
+    ctx->lanes = 0;
+    ctx->entries = 0;
+    return;
+}
+
+static unsigned window_bits(mp_bitcnt_t bits) { //same windows as mont_powm
+    if (bits > 671) {
+        return 6;
+    }
+    if (bits > 239) {
+        return 5;
+    }
+    if (bits > 79) {
+        return 4;
+    }
+    if (bits > 23) {
+        return 3;
+    }
+    return 1;
+}
+
+//out[i] = base[i]^exponent mod n for i < count <= lanes, out and base may be the same
+void mbx_powm(mbx_t *ctx, mpz_ptr *out, mpz_ptr *base, size_t count, mpz_t exponent) {
+    size_t stride = ctx->limbs * ctx->lanes; //one value in every lane
+
+    if (mpz_sgn(exponent) == 0) { //x^0 = 1, n > 1 so no reduction is needed
+        for (size_t l = 0; l < count; l += 1) {
+            mpz_set_ui(out[l], 1);
+        }
+        return;
+    }
+
+    uint64_t start = stats_start();
+    mp_bitcnt_t bits = mpz_sizeinbase(exponent, 2);
+    unsigned k = window_bits(bits);
+    size_t entries = (size_t) 1 << (k - 1); //odd powers base^1, base^3, ... base^(2^k - 1)
+
+    if (ctx->entries < entries) { //the table only ever grows, so later calls reuse it
+        free(ctx->table);
+        ctx->table = digits_alloc(ctx, entries * ctx->limbs);
+        ctx->entries = entries;
+    }
+
+    uint64_t *table = ctx->table;
+    uint64_t *acc = ctx->acc;
+
+    for (size_t l = 0; l < ctx->lanes; l += 1) { //unused lanes run on zero
+        mpz_set_ui(ctx->t, 0);
+        if (l < count) {
+            mpz_mod(ctx->t, base[l], ctx->n);
+        }
+        digits_from_mpz(ctx, table, l, ctx->t);
+    }
+    ctx->mul(ctx, table, table, ctx->rr); //table[0] = base * R mod n
+
+    if (entries > 1) {
+        ctx->mul(ctx, acc, table, table); //acc = base^2 in montgomery form
+        for (size_t i = 1; i < entries; i += 1) {
+            ctx->mul(ctx, table + i * stride, table + (i - 1) * stride, acc);
+        }
+    }
+
+    bool started = false;
+    mp_bitcnt_t i = bits; //bits above i have been processed
+
+    while (i > 0) {
+        if (!mpz_tstbit(exponent, i - 1)) { //zero bits only square
+            ctx->mul(ctx, acc, acc, acc);
+            i -= 1;
+            continue;
+        }
+
+        mp_bitcnt_t j = (i > k) ? i - k : 0; //window covers bits i - 1 down to j
+        while (!mpz_tstbit(exponent, j)) { //windows end on a one bit so the entry is odd
+            j += 1;
+        }
+
+        size_t w = 0;
+        for (mp_bitcnt_t l = i; l > j; l -= 1) {
+            w = (w << 1) | mpz_tstbit(exponent, l - 1);
+        }
+
+        if (started) {
+            for (mp_bitcnt_t l = j; l < i; l += 1) {
+                ctx->mul(ctx, acc, acc, acc);
+            }
+            ctx->mul(ctx, acc, acc, table + ((w - 1) / 2) * stride);
+        } else { //first window, skip squaring a one
+            memcpy(acc, table + ((w - 1) / 2) * stride, stride * sizeof(uint64_t));
+            started = true;
+        }
+        i = j;
+    }
+
+    ctx->mul(ctx, acc, acc, ctx->one); //leave montgomery form, the result is at most n
+    for (size_t l = 0; l < count; l += 1) {
+        digits_to_mpz(ctx, out[l], acc, l);
+        if (mpz_cmp(out[l], ctx->n) >= 0) {
+            mpz_sub(out[l], out[l], ctx->n);
+        }
+    }
+
+    stats_add(STAT_POW_MOD, count);
+    stats_stop(TIMER_POW_MOD, start);
+    return;
+}
+
+//runs groups of lanes while at least MBX_MIN values are left, returns how many it did
+size_t mbx_powm_many(mbx_t *ctx, mpz_ptr *out, mpz_ptr *base, size_t count, mpz_t exponent) {
+    size_t done = 0;
+
+    while (count - done >= MBX_MIN) {
+        size_t group = (count - done < ctx->lanes) ? count - done : ctx->lanes;
+        mbx_powm(ctx, out + done, base + done, group, exponent);
+        done += group;
+    }
+    return done;
+}
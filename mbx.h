@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+#define MBX_LANES 8 //most values one call works on
+#define MBX_MIN 3 //a call costs about two scalar exponentiations, fewer values stay scalar
+
+//montgomery exponentiation of several values under one modulus and exponent, each value in
+//its own vector lane, digits are radix 2^bits and lane l of digit i is at [i * lanes + l]
+typedef struct mbx mbx_t;
+
+struct mbx {
+    mpz_t n; //modulus the context was built for
+    mpz_t t; //scratch for conversions
+    size_t lanes; //values per kernel call, 0 when the context is not initialized
+    size_t limbs; //digits per value, R = 2^(bits * limbs) is above 4n
+    unsigned bits; //digit width of the kernel
+    uint64_t ninv; //-n^-1 mod 2^bits
+    uint64_t *np; //digits of n, the same in every lane
+    uint64_t *rr; //R^2 mod n, used to move values into montgomery form
+    uint64_t *one; //1, used to move values out of montgomery form
+    uint64_t *prod; //2 * limbs + 1 digits of products before reduction
+    uint64_t *acc; //running result of the exponentiation
+    uint64_t *table; //odd powers of the bases for the sliding window
+    size_t entries; //number of table entries allocated
+    void (*mul)(mbx_t *ctx, uint64_t *rp, const uint64_t *ap, const uint64_t *bp);
+};
+
+size_t mbx_lanes(void);
+
+bool mbx_init(mbx_t *ctx, mpz_t n);
+
+void mbx_clear(mbx_t *ctx);
+
+void mbx_powm(mbx_t *ctx, mpz_ptr *out, mpz_ptr *base, size_t count, mpz_t exponent);
+
+size_t mbx_powm_many(mbx_t *ctx, mpz_ptr *out, mpz_ptr *base, size_t count, mpz_t exponent);
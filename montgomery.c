@@ -0,0 +1,235 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+
+#include "montgomery.h"
+#include "stats.h"
+
+static mp_limb_t limb_inverse(mp_limb_t n0) { //returns -n0^-1 mod 2^GMP_NUMB_BITS for odd n0
+    mp_limb_t inv = n0; //n0 * n0 = 1 mod 8, so inv starts correct to 3 bits
+
+    for (int i = 0; i < 6; i += 1) {
+        inv *= 2 - n0 * inv; //each newton step doubles the correct bits
+    }
+    return -inv;
+}
+
+static unsigned window_bits(mp_bitcnt_t bits) { //window size for an exponent length
+    if (bits > 671) {
+        return 6;
+    }
+    if (bits > 239) {
+        return 5;
+    }
+    if (bits > 79) {
+        return 4;
+    }
+    if (bits > 23) {
+        return 3;
+    }
+    return 1;
+}
+
+static void limbs_from_mpz(mp_limb_t *rp, mpz_t x, mp_size_t size) { //zero padded copy of x
+    mp_size_t used = mpz_size(x);
+
+    if (used > 0) {
+        memcpy(rp, mpz_limbs_read(x), used * sizeof(mp_limb_t));
+    }
+    memset(rp + used, 0, (size - used) * sizeof(mp_limb_t));
+    return;
+}
+
+static void mont_alloc(mont_t *ctx, mpz_t n) { //everything except ninv and rr
+    mp_size_t size = mpz_size(n);
+
+    mpz_inits(ctx->n, ctx->t, NULL);
+    mpz_set(ctx->n, n);
+
+    ctx->size = size;
+    ctx->np = malloc(size * sizeof(mp_limb_t));
+    ctx->rr = malloc(size * sizeof(mp_limb_t));
+    ctx->prod = malloc(2 * size * sizeof(mp_limb_t));
+    ctx->acc = malloc(size * sizeof(mp_limb_t));
+    ctx->table = NULL;
+    ctx->entries = 0;
+    ctx->fixed = fixed_mul_for(size);
+
+    limbs_from_mpz(ctx->np, n, size);
+    return;
+}
+
+void mont_init(mont_t *ctx, mpz_t n) {
+    mont_alloc(ctx, n);
+    ctx->ninv = limb_inverse(ctx->np[0]);
+
+    mpz_setbit(ctx->t, 2 * ctx->size * GMP_NUMB_BITS); //R^2 where R = 2^(size * limb bits)
+    mpz_mod(ctx->t, ctx->t, n);
+    limbs_from_mpz(ctx->rr, ctx->t, ctx->size);
+    return;
+}
+
+void mont_init_pre(mont_t *ctx, mpz_t n, mp_limb_t ninv, const mp_limb_t *rr) {
+    mont_alloc(ctx, n); //values from mont_init saved earlier, rr has mpz_size(n) limbs
+    ctx->ninv = ninv;
+    memcpy(ctx->rr, rr, ctx->size * sizeof(mp_limb_t));
+    return;
+}
+
+void mont_clear(mont_t *ctx) {
+    mpz_clears(ctx->n, ctx->t, NULL);
+    free(ctx->np);
+    free(ctx->rr);
+    free(ctx->prod);
+    free(ctx->acc);
+    free(ctx->table);
+    ctx->size = 0;
+    ctx->entries = 0;
+    return;
+}
+
+//reduces the 2 * size limbs in tp to tp * R^-1 mod n, tp is destroyed
+static void mont_redc(mont_t *ctx, mp_limb_t *rp, mp_limb_t *tp) {
+    mp_size_t size = ctx->size;
+
+    for (mp_size_t i = 0; i < size; i += 1) {
+        mp_limb_t u = tp[i] * ctx->ninv; //makes limb i zero
+        //limb i is zero now, park the carry there and add it in one pass below
+        tp[i] = mpn_addmul_1(tp + i, ctx->np, size, u);
+    }
+
+    mp_limb_t hi = mpn_add_n(rp, tp + size, tp, size);
+    if (hi != 0 || mpn_cmp(rp, ctx->np, size) >= 0) { //result is below 2n, one subtract at most
+        mpn_sub_n(rp, rp, ctx->np, size);
+    }
+    return;
+}
+
+void mont_mul(mont_t *ctx, mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp) {
+    if (ctx->fixed != NULL) { //2048, 3072 and 4096 bit moduli among others, see fixed.h
+        ctx->fixed(rp, ap, bp, ctx->np, ctx->ninv);
+        return;
+    }
+    if (ap == bp) {
+        mpn_sqr(ctx->prod, ap, ctx->size); //squaring is cheaper than a general multiply
+    } else {
+        mpn_mul_n(ctx->prod, ap, bp, ctx->size);
+    }
+    mont_redc(ctx, rp, ctx->prod);
+    return;
+}
+
+//reduces base into table[0] in montgomery form, making room for entries table entries
+static void mont_load_base(mont_t *ctx, mpz_t base, size_t entries) {
+    if (ctx->entries < entries) { //the table only ever grows, so later calls reuse it
+        ctx->table = realloc(ctx->table, entries * ctx->size * sizeof(mp_limb_t));
+        ctx->entries = entries;
+    }
+
+    mpz_mod(ctx->t, base, ctx->n);
+    limbs_from_mpz(ctx->table, ctx->t, ctx->size);
+    mont_mul(ctx, ctx->table, ctx->table, ctx->rr); //table[0] = base * R mod n
+    return;
+}
+
+static void mont_store_result(mont_t *ctx, mpz_t out) { //out = acc * R^-1, leaving montgomery form
+    mp_size_t size = ctx->size;
+
+    memcpy(ctx->prod, ctx->acc, size * sizeof(mp_limb_t));
+    memset(ctx->prod + size, 0, size * sizeof(mp_limb_t));
+
+    mp_limb_t *op = mpz_limbs_write(out, size);
+    mont_redc(ctx, op, ctx->prod);
+    mpz_limbs_finish(out, size);
+    return;
+}
+
+void mont_powm(mont_t *ctx, mpz_t out, mpz_t base, mpz_t exponent) {
+    mp_size_t size = ctx->size;
+
+    if (mpz_sgn(exponent) == 0) { //x^0 = 1, n > 1 so no reduction is needed
+        mpz_set_ui(out, 1);
+        return;
+    }
+
+    uint64_t start = stats_start();
+    mp_bitcnt_t bits = mpz_sizeinbase(exponent, 2);
+    unsigned k = window_bits(bits);
+    size_t entries = (size_t) 1 << (k - 1); //odd powers base^1, base^3, ... base^(2^k - 1)
+
+    mont_load_base(ctx, base, entries);
+
+    mp_limb_t *table = ctx->table;
+    mp_limb_t *acc = ctx->acc;
+
+    if (entries > 1) {
+        mont_mul(ctx, acc, table, table); //acc = base^2 in montgomery form
+        for (size_t i = 1; i < entries; i += 1) {
+            mont_mul(ctx, table + i * size, table + (i - 1) * size, acc);
+        }
+    }
+
+    bool started = false;
+    mp_bitcnt_t i = bits; //bits above i have been processed
+
+    while (i > 0) {
+        if (!mpz_tstbit(exponent, i - 1)) { //zero bits only square
+            mont_mul(ctx, acc, acc, acc);
+            i -= 1;
+            continue;
+        }
+
+        mp_bitcnt_t j = (i > k) ? i - k : 0; //window covers bits i - 1 down to j
+        while (!mpz_tstbit(exponent, j)) { //windows end on a one bit so the entry is odd
+            j += 1;
+        }
+
+        size_t w = 0;
+        for (mp_bitcnt_t l = i; l > j; l -= 1) {
+            w = (w << 1) | mpz_tstbit(exponent, l - 1);
+        }
+
+        if (started) {
+            for (mp_bitcnt_t l = j; l < i; l += 1) {
+                mont_mul(ctx, acc, acc, acc);
+            }
+            mont_mul(ctx, acc, acc, table + ((w - 1) / 2) * size);
+        } else { //first window, skip squaring a one
+            memcpy(acc, table + ((w - 1) / 2) * size, size * sizeof(mp_limb_t));
+            started = true;
+        }
+        i = j;
+    }
+
+    mont_store_result(ctx, out);
+    stats_add(STAT_POW_MOD, 1);
+    stats_stop(TIMER_POW_MOD, start);
+    return;
+}
+
+void mont_powm_ui(mont_t *ctx, mpz_t out, mpz_t base, unsigned long exponent) {
+    if (exponent == 0) { //x^0 = 1, n > 1 so no reduction is needed
+        mpz_set_ui(out, 1);
+        return;
+    }
+
+    uint64_t start = stats_start();
+    mont_load_base(ctx, base, 1);
+    memcpy(ctx->acc, ctx->table, ctx->size * sizeof(mp_limb_t)); //top bit of the exponent
+
+    //left to right square and multiply, the exponent is a single word so no window table
+    for (int i = (int) (sizeof(unsigned long) * 8) - __builtin_clzl(exponent) - 2; i >= 0; i -= 1) {
+        mont_mul(ctx, ctx->acc, ctx->acc, ctx->acc);
+        if ((exponent >> i) & 1) {
+            mont_mul(ctx, ctx->acc, ctx->acc, ctx->table);
+        }
+    }
+
+    mont_store_result(ctx, out);
+    stats_add(STAT_POW_MOD, 1);
+    stats_stop(TIMER_POW_MOD, start);
+    return;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+#include "fixed.h"
+
+typedef struct {
+    mpz_t n; //modulus the context was built for
+    mpz_t t; //base reduced mod n
+    mp_size_t size; //limbs in n, 0 when the context is not initialized
+    mp_limb_t ninv; //-n^-1 mod 2^GMP_NUMB_BITS
+    mp_limb_t *np; //limbs of n
+    mp_limb_t *rr; //R^2 mod n, used to move values into montgomery form
+    mp_limb_t *prod; //2 * size limbs for products before reduction
+    mp_limb_t *acc; //running result of the exponentiation
+    mp_limb_t *table; //odd powers of the base for the sliding window
+    size_t entries; //number of table entries allocated
+    fixed_mul_fn fixed; //unrolled kernel for this many limbs, NULL for the generic path
+} mont_t;
+
+void mont_init(mont_t *ctx, mpz_t n);
+
+void mont_init_pre(mont_t *ctx, mpz_t n, mp_limb_t ninv, const mp_limb_t *rr);
+
+void mont_clear(mont_t *ctx);
+
+void mont_mul(mont_t *ctx, mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp);
+
+void mont_powm(mont_t *ctx, mpz_t out, mpz_t base, mpz_t exponent);
+
+void mont_powm_ui(mont_t *ctx, mpz_t out, mpz_t base, unsigned long exponent);
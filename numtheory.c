@@ -1,169 +1,702 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <pthread.h>
 #include <gmp.h>
 
 #include "randstate.h"
 #include "numtheory.h"
+#include "montgomery.h"
+#include "mbx.h"
+#include "stats.h"
+
+#define LEHMER_BITS 60 //leading bits the single word steps look at, signed 64 bit headroom
+
+//one batch of Lehmer steps on the leading bits of a >= b, run in single words until the
+//quotients could differ from those of the full values (Jebelean's condition, cofactors stay
+//below 2^30), the full values then move by the matrix
+//  k odd:  a, b = A*b - B*a, D*a - C*b
+//  k even: a, b = A*a - B*b, D*b - C*a
+//k is 0 when not even one quotient was certain, the caller then does a full division
+static uint64_t lehmer_step(mpz_t a, mpz_t b, mpz_t t, unsigned long *m) {
+    mp_bitcnt_t shift = mpz_sizeinbase(a, 2) - LEHMER_BITS;
+
+    mpz_tdiv_q_2exp(t, a, shift);
+    int64_t x = mpz_get_ui(t);
+    mpz_tdiv_q_2exp(t, b, shift);
+    int64_t y = mpz_get_ui(t);
+
+    int64_t A = 1, B = 0, C = 0, D = 1;
+    uint64_t k = 0;
+    while (y != C) {
+        int64_t q = (x + (A - 1)) / (y - C); //an upper bound, r goes negative when it is too big
+        int64_t s = B + q * D;
+        int64_t r = x - q * y;
+        if (s > r) {
+            break;
+        }
+        x = y;
+        y = r;
+        r = A + q * C;
+        A = D;
+        B = C;
+        C = s;
+        D = r;
+        k += 1;
+    }
+
+    m[0] = A;
+    m[1] = B;
+    m[2] = C;
+    m[3] = D;
+    return k;
+}
+
+//applies the matrix of lehmer_step to a pair, t is scratch, the pair ends up in x and y
+static void lehmer_apply(mpz_t x, mpz_t y, mpz_t t, const unsigned long *m, uint64_t k) {
+    if (k % 2 == 1) {
+        mpz_swap(x, y); //the odd case is the even one with the pair swapped
+    }
+    mpz_mul_ui(t, x, m[0]);
+    mpz_submul_ui(t, y, m[1]); //t = A*x - B*y
+    mpz_mul_ui(y, y, m[3]);
+    mpz_submul_ui(y, x, m[2]); //y = D*y - C*x
+    mpz_swap(x, t);
+    return;
+}
 
+//Lehmer's algorithm, every temporary is made once and the values move by swaps
 void gcd(mpz_t d, mpz_t a, mpz_t b) {
-    mpz_t zero, temp_b, temp_a, t;
-    mpz_inits(zero, temp_b, temp_a, t, NULL); //initalize values
+    mpz_t x, y, t;
+    mpz_inits(x, y, t, NULL);
+
+    mpz_abs(x, a);
+    mpz_abs(y, b);
+    if (mpz_cmp(x, y) < 0) {
+        mpz_swap(x, y);
+    }
 
-    mpz_set(temp_a, a); 
-    mpz_set(temp_b, b); 
-    while (mpz_cmp_ui(temp_b, 0) != 0) { //check if b != zero
-        mpz_set(t, temp_b); //t = b
-        mpz_mod(temp_b, temp_a, temp_b); //b = a % b
-        mpz_set(temp_a, t); //a = t
+    unsigned long m[4]; //A, B, C and D of the last lehmer_step
+    while (mpz_sizeinbase(y, 2) > LEHMER_BITS) { //x >= y through the loop
+        uint64_t k = lehmer_step(x, y, t, m);
+        if (k == 0) { //y is much shorter than x, one division catches it up
+            mpz_tdiv_r(t, x, y);
+            mpz_swap(x, y);
+            mpz_swap(y, t);
+        } else {
+            lehmer_apply(x, y, t, m, k);
+        }
+    }
+
+    while (mpz_sgn(y) != 0) { //both fit in a word now, or y is zero
+        mpz_tdiv_r(t, x, y);
+        mpz_swap(x, y);
+        mpz_swap(y, t);
     }
 
-    mpz_set(d, temp_a); 
-    mpz_clears(zero, temp_b, temp_a, t, NULL); //clear init values
+    mpz_swap(d, x);
+    mpz_clears(x, y, t, NULL);
     return;
 }
 
+//i = a^-1 mod n, 0 when gcd(a, n) != 1, the same Lehmer steps as gcd also move the cofactors
+//of a, so r = u * a mod n holds for both rows throughout
 void mod_inverse(mpz_t i, mpz_t a, mpz_t n) {
-    mpz_t finalt, finalvaluet, tempi, value, value_1, r, r_singlequote, t, t_singlequote, q, tempr,
-        tempr_singlequote, tempt, tempt_singlequote; //create values
-    mpz_inits(finalt, finalvaluet, tempi, value, value_1, r, r_singlequote, t, t_singlequote, q,
-        tempr, tempr_singlequote, tempt, tempt_singlequote, NULL); //initalize values
+    mpz_t r0, r1, u0, u1, t;
+    mpz_inits(r0, r1, u0, u1, t, NULL);
+
+    mpz_abs(r0, n);
+    mpz_mod(r1, a, r0); //r0 = n, u0 = 0 and r1 = a, u1 = 1
+    mpz_set_ui(u1, 1);
+
+    unsigned long m[4]; //A, B, C and D of the last lehmer_step
+    while (mpz_sgn(r1) != 0) {
+        uint64_t k = (mpz_sizeinbase(r1, 2) > LEHMER_BITS) ? lehmer_step(r0, r1, t, m) : 0;
+        if (k == 0) {
+            mpz_tdiv_qr(t, r0, r0, r1); //r0 = r0 - t * r1, then swap the rows
+            mpz_submul(u0, t, u1);
+            mpz_swap(r0, r1);
+            mpz_swap(u0, u1);
+        } else {
+            lehmer_apply(r0, r1, t, m, k);
+            lehmer_apply(u0, u1, t, m, k);
+        }
+    }
 
-    mpz_set(r, n); //r = n
-    mpz_set(r_singlequote, a); //r' = a
+    if (mpz_cmp_ui(r0, 1) == 0) {
+        mpz_mod(i, u0, n);
+    } else { //return no inverse
+        mpz_set_ui(i, 0);
+    }
 
-    mpz_set_ui(t, 0); //t = 0
-    mpz_set_ui(t_singlequote, 1); //t' = 1
+    mpz_clears(r0, r1, u0, u1, t, NULL);
+    return;
+}
 
-    while (mpz_cmp_ui(r_singlequote, 0) != 0) { //r' != 0
+//out[j] = a[j]^-1 mod n with one inversion for the whole batch (Montgomery's trick): the
+//prefix products are inverted once and walked back, out and a may be the same array
+void mod_inverse_batch(mpz_ptr *out, mpz_ptr *a, size_t count, mpz_t n) {
+    if (count == 0) {
+        return;
+    }
 
-        mpz_fdiv_q(q, r, r_singlequote); //floor div for r/r' = q
+    mpz_t *prefix = malloc(count * sizeof(mpz_t));
+    mpz_t inv, t;
+    mpz_inits(inv, t, NULL);
 
-        mpz_set(tempr, r); //tempr = r
-        mpz_set(tempr_singlequote, r_singlequote); //temp_r' = r'
+    mpz_init(prefix[0]);
+    mpz_mod(prefix[0], a[0], n);
+    for (size_t j = 1; j < count; j += 1) { //prefix[j] = a[0] * ... * a[j] mod n
+        mpz_init(prefix[j]);
+        mpz_mul(prefix[j], prefix[j - 1], a[j]);
+        mpz_mod(prefix[j], prefix[j], n);
+    }
 
-        mpz_set(r, r_singlequote); //r = r'
+    mod_inverse(inv, prefix[count - 1], n);
+    if (mpz_sgn(inv) == 0) { //some a[j] has no inverse, so give each its own
+        for (size_t j = 0; j < count; j += 1) {
+            mod_inverse(out[j], a[j], n);
+        }
+    } else {
+        for (size_t j = count - 1; j > 0; j -= 1) { //inv = (a[0] * ... * a[j])^-1 here
+            mpz_mul(t, inv, a[j]);
+            mpz_mod(t, t, n); //inverse of the prefix one shorter
+            mpz_mul(out[j], inv, prefix[j - 1]);
+            mpz_mod(out[j], out[j], n);
+            mpz_swap(inv, t);
+        }
+        mpz_swap(out[0], inv);
+    }
 
-        mpz_mul(value, q, tempr_singlequote); //value = q*r'
-        mpz_sub(value_1, tempr, value); //value_1 = r - value
-        mpz_set(r_singlequote, value_1); //r' = r - q*r'
+    for (size_t j = 0; j < count; j += 1) {
+        mpz_clear(prefix[j]);
+    }
+    free(prefix);
+    mpz_clears(inv, t, NULL);
+    return;
+}
 
-        mpz_set(tempt, t); //tempt = t
-        mpz_set(tempt_singlequote, t_singlequote); //temp_t' = t'
+#define POW_MOD_CACHE 4 //montgomery contexts kept per thread, enough for n, p and q
 
-        mpz_set(t, tempt_singlequote); //t = t'
+static _Thread_local mont_t pow_mod_cache[POW_MOD_CACHE];
+static _Thread_local int pow_mod_next = 0;
 
-        mpz_mul(finalt, q, tempt_singlequote); //value = q*t' reuse value from prev
-        mpz_sub(finalvaluet, tempt, finalt); //value_1 = t - value
-        mpz_set(t_singlequote, finalvaluet); //t' = t - q*t'
+static mont_t *pow_mod_context(mpz_t modulus) { //finds or builds the context for modulus
+    for (int i = 0; i < POW_MOD_CACHE; i += 1) {
+        if (pow_mod_cache[i].size > 0 && mpz_cmp(pow_mod_cache[i].n, modulus) == 0) {
+            return &pow_mod_cache[i];
+        }
     }
 
-    if (mpz_cmp_ui(r, 1) > 0) { //r > 1
-        mpz_set_ui(i, 0); // return no inverse
-        mpz_clears(finalt, finalvaluet, tempi, value, value_1, r, r_singlequote, t, t_singlequote,
-            q, tempr, tempr_singlequote, tempt, tempt_singlequote, NULL); //clear values
-        return;
+    mont_t *ctx = &pow_mod_cache[pow_mod_next]; //replace the oldest entry
+    pow_mod_next = (pow_mod_next + 1) % POW_MOD_CACHE;
+
+    if (ctx->size > 0) {
+        mont_clear(ctx);
     }
+    mont_init(ctx, modulus);
+    return ctx;
+}
+
+static _Thread_local mbx_t pow_mod_batch_cache[POW_MOD_CACHE]; //vector contexts, same policy
+static _Thread_local int pow_mod_batch_next = 0;
 
-    if (mpz_cmp_ui(t, 0) < 0) { //t < 0
-        mpz_set(tempi, t);
-        mpz_add(t, tempi, n);
+static mbx_t *pow_mod_batch_context(mpz_t modulus) { //NULL when the cpu has no vector kernel
+    for (int i = 0; i < POW_MOD_CACHE; i += 1) {
+        if (pow_mod_batch_cache[i].lanes > 0 && mpz_cmp(pow_mod_batch_cache[i].n, modulus) == 0) {
+            return &pow_mod_batch_cache[i];
+        }
     }
 
-    mpz_set(i, t); //return t
-    mpz_clears(finalt, finalvaluet, tempi, value, value_1, r, r_singlequote, t, t_singlequote, q,
-        tempr, tempr_singlequote, tempt, tempt_singlequote, NULL); //clear values
+    mbx_t *ctx = &pow_mod_batch_cache[pow_mod_batch_next];
+    mbx_clear(ctx);
+    if (!mbx_init(ctx, modulus)) {
+        return NULL;
+    }
+    pow_mod_batch_next = (pow_mod_batch_next + 1) % POW_MOD_CACHE;
+    return ctx;
+}
+
+void pow_mod_cache_clear(void) {
+    for (int i = 0; i < POW_MOD_CACHE; i += 1) {
+        if (pow_mod_cache[i].size > 0) {
+            mont_clear(&pow_mod_cache[i]);
+        }
+        mbx_clear(&pow_mod_batch_cache[i]);
+    }
+    pow_mod_next = 0;
+    pow_mod_batch_next = 0;
     return;
 }
 
 void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
-    mpz_t modtemp, tempd, two, storep, vmul, modv, v, p;
-    mpz_inits(modtemp, tempd, two, storep, vmul, modv, v, p, NULL); //init values
+    if (mpz_odd_p(modulus) && mpz_cmp_ui(modulus, 1) > 0) { //montgomery needs an odd modulus
+        mont_powm(pow_mod_context(modulus), out, base, exponent);
+        return;
+    }
+
+    uint64_t start = stats_start();
+    mpz_t v, p;
+    mpz_inits(v, p, NULL); //even moduli are rare, use plain square and multiply
 
     mpz_set_ui(v, 1); //v = 1
     mpz_set(p, base); //p = base
-    mpz_set_ui(two, 2); //this is for checking if exponent is odd
-    mpz_set(tempd, exponent);
-    mpz_set(modtemp, modulus);
-
-    while (mpz_cmp_ui(tempd, 0) > 0) { //while exponent > 0
-        mpz_mod(modv, tempd, two); //exponent % 2 != 0 checks for odd
 
-        if (mpz_cmp_ui(modv, 0) != 0) { //check if odd
-            mpz_mul(vmul, v, p); //v * p
-            mpz_mod(v, vmul, modtemp); //v = (v*p) % modulus
+    mp_bitcnt_t bits = mpz_sgn(exponent) > 0 ? mpz_sizeinbase(exponent, 2) : 0;
+    for (mp_bitcnt_t i = 0; i < bits; i += 1) {
+        if (mpz_tstbit(exponent, i)) { //check if odd
+            mpz_mul(v, v, p);
+            mpz_mod(v, v, modulus); //v = (v*p) % modulus
         }
+        mpz_mul(p, p, p);
+        mpz_mod(p, p, modulus); // p = (p*p) % modulus
+    }
 
-        mpz_mul(storep, p, p); //p*p
-        mpz_mod(p, storep, modtemp); // p = (p*p) % modulus
+    mpz_set(out, v); //return v
+    mpz_clears(v, p, NULL);
+    stats_add(STAT_POW_MOD, 1);
+    stats_stop(TIMER_POW_MOD, start);
+    return;
+}
 
-        mpz_fdiv_q_ui(tempd, tempd, 2); //floor div for exponent/2 = exponent
+//fixed window with a table scan that touches every entry, so time and memory accesses depend
+//only on the sizes of the operands and not on the bits of exponent, for private exponents
+void pow_mod_sec(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
+    if (mpz_sgn(exponent) <= 0 || mpz_even_p(modulus)) { //powm_sec needs both, keys never hit this
+        pow_mod(out, base, exponent, modulus);
+        return;
     }
 
-    mpz_set(out, v); //return v
-    mpz_clears(modtemp, tempd, two, storep, vmul, modv, v, p, NULL); //clear values
+    uint64_t start = stats_start();
+    mpz_powm_sec(out, base, exponent, modulus);
+    stats_add(STAT_POW_MOD, 1);
+    stats_stop(TIMER_POW_MOD, start);
     return;
 }
 
-bool is_prime(mpz_t n, uint64_t iters) {
-    mpz_t a, r, y, randupvalue, two, modv, nminone;
-    mpz_inits(a, r, y, randupvalue, two, modv, nminone, NULL);
+//out[i] = base[i]^exponent mod modulus, several at once in vector lanes when the cpu allows
+void pow_mod_batch(mpz_ptr *out, mpz_ptr *base, size_t count, mpz_t exponent, mpz_t modulus) {
+    mbx_t *ctx = (count >= MBX_MIN) ? pow_mod_batch_context(modulus) : NULL;
+    size_t done = (ctx != NULL) ? mbx_powm_many(ctx, out, base, count, exponent) : 0;
 
-    if ((mpz_cmp_ui(n, 2) == 0) || ((mpz_cmp_ui(n, 3) == 0))) { //check if n == 2 or n == 3
-        mpz_clears(a, r, y, randupvalue, two, modv, nminone, NULL); //return true
+    for (size_t i = done; i < count; i += 1) {
+        pow_mod(out[i], base[i], exponent, modulus);
+    }
+    return;
+}
+
+void pow_mod_ui(mpz_t out, mpz_t base, unsigned long exponent, mpz_t modulus) {
+    if (mpz_odd_p(modulus) && mpz_cmp_ui(modulus, 1) > 0) {
+        mont_powm_ui(pow_mod_context(modulus), out, base, exponent);
+        return;
+    }
+
+    mpz_t e;
+    mpz_init_set_ui(e, exponent);
+    pow_mod(out, base, e, modulus);
+    mpz_clear(e);
+    return;
+}
+
+void sqr_mod(mpz_t out, mpz_t x, mpz_t modulus) {
+    mpz_mul(out, x, x); //gmp squares when both operands are the same
+    mpz_mod(out, out, modulus);
+    return;
+}
+
+#define SIEVE_PRIMES 2048 //odd primes used to sieve candidates
+#define SIEVE_WINDOW 4096 //odd candidates sieved at once
+
+static uint32_t sieve_primes[SIEVE_PRIMES];
+static pthread_once_t sieve_once = PTHREAD_ONCE_INIT;
+
+#define TRIAL_PRIMES 256 //sieve primes is_prime divides by before any exponentiation
+
+static unsigned long trial_products[TRIAL_PRIMES]; //runs of trial primes multiplied into one word
+static size_t trial_ends[TRIAL_PRIMES]; //index after the last prime of each run
+static size_t trial_runs;
+
+static void sieve_init(void) { //first SIEVE_PRIMES odd primes by trial division
+    uint32_t count = 0;
+
+    for (uint32_t x = 3; count < SIEVE_PRIMES; x += 2) {
+        bool prime = true;
+        for (uint32_t i = 0; i < count && sieve_primes[i] * sieve_primes[i] <= x; i += 1) {
+            if (x % sieve_primes[i] == 0) {
+                prime = false;
+                break;
+            }
+        }
+        if (prime) {
+            sieve_primes[count] = x;
+            count += 1;
+        }
+    }
+
+    //one mpz_fdiv_ui per run instead of per prime, the word remainder is then split up
+    unsigned long product = 1;
+    for (size_t i = 0; i < TRIAL_PRIMES; i += 1) {
+        if (product > ULONG_MAX / sieve_primes[i]) {
+            trial_products[trial_runs] = product;
+            trial_ends[trial_runs] = i;
+            trial_runs += 1;
+            product = 1;
+        }
+        product *= sieve_primes[i];
+    }
+    trial_products[trial_runs] = product;
+    trial_ends[trial_runs] = TRIAL_PRIMES;
+    trial_runs += 1;
+    return;
+}
+
+//-1 if a trial prime divides odd n > 1 and is not n itself, 1 if n is a trial prime or has
+//no factor below sqrt(n), 0 if it has to be tested further
+static int trial_division(mpz_t n) {
+    size_t first = 0;
+
+    for (size_t run = 0; run < trial_runs; run += 1) {
+        unsigned long r = mpz_fdiv_ui(n, trial_products[run]);
+        for (size_t i = first; i < trial_ends[run]; i += 1) {
+            if (r % sieve_primes[i] == 0) {
+                return (mpz_cmp_ui(n, sieve_primes[i]) == 0) ? 1 : -1;
+            }
+        }
+        first = trial_ends[run];
+    }
+
+    unsigned long last = sieve_primes[TRIAL_PRIMES - 1];
+    return (mpz_cmp_ui(n, last * last) < 0) ? 1 : 0; //no factor up to sqrt(n)
+}
+
+//one Miller-Rabin round, n - 1 = r * 2^s with r odd, y is scratch
+static bool strong_probable_prime(mpz_t n, mpz_t a, mpz_t r, mp_bitcnt_t s, mpz_t nminone, mpz_t y) {
+    stats_add(STAT_MR_ROUNDS, 1);
+    pow_mod(y, a, r, n);
+    if ((mpz_cmp_ui(y, 1) == 0) || (mpz_cmp(y, nminone) == 0)) { //y == 1 or y == n - 1
         return true;
     }
 
-    mpz_set_ui(two, 2);
-    mpz_mod(modv, n, two);
+    for (mp_bitcnt_t j = 1; j < s; j += 1) {
+        sqr_mod(y, y, n);
+        if (mpz_cmp(y, nminone) == 0) {
+            return true;
+        }
+        if (mpz_cmp_ui(y, 1) == 0) { //1 without passing -1, a nontrivial root of 1
+            return false;
+        }
+    }
+    return false;
+}
+
+static void half_mod(mpz_t x, mpz_t n) { //x / 2 mod n for x in [0, n)
+    if (mpz_odd_p(x)) {
+        mpz_add(x, x, n);
+    }
+    mpz_tdiv_q_2exp(x, x, 1);
+    return;
+}
 
-    if ((mpz_cmp_ui(modv, 0) == 0) || ((mpz_cmp_ui(n, 1) == 0))) { //check if n % 2 == 0 or n == 1
-        mpz_clears(a, r, y, randupvalue, two, modv, nminone, NULL); //return false
+//strong Lucas probable prime test with Selfridge's parameters P = 1, Q = (1 - D) / 4,
+//n odd, not divisible by the trial primes and above their squares
+static bool strong_lucas(mpz_t n) {
+    stats_add(STAT_LUCAS_TESTS, 1);
+    if (mpz_perfect_square_p(n)) { //no D has (D/n) = -1 when n is a square
         return false;
     }
 
-    mp_bitcnt_t s = 2;
-    mpz_sub_ui(nminone, n, 1);
+    long d = 5; //5, -7, 9, -11, ... until the jacobi symbol is -1
+    for (;;) {
+        int j = mpz_si_kronecker(d, n);
+        if (j == -1) {
+            break;
+        }
+        if (j == 0 && mpz_cmp_ui(n, labs(d)) != 0) { //shares a factor with d
+            return false;
+        }
+        d = (d > 0) ? -(d + 2) : -(d - 2);
+    }
+    long q = (1 - d) / 4;
+
+    mpz_t k, u, v, qk, t;
+    mpz_inits(k, u, v, qk, t, NULL);
+
+    mpz_add_ui(k, n, 1); //n + 1 = k * 2^s with k odd
+    mp_bitcnt_t s = mpz_scan1(k, 0);
+    mpz_tdiv_q_2exp(k, k, s);
+
+    mpz_set_ui(u, 1); //U_1 = 1
+    mpz_set_ui(v, 1); //V_1 = P
+    mpz_set_si(qk, q);
+    mpz_mod(qk, qk, n); //Q^1
+
+    for (mp_bitcnt_t bit = mpz_sizeinbase(k, 2) - 1; bit > 0; bit -= 1) {
+        mpz_mul(u, u, v);
+        mpz_mod(u, u, n); //U_2m = U_m * V_m
+        sqr_mod(v, v, n);
+        mpz_submul_ui(v, qk, 2);
+        mpz_mod(v, v, n); //V_2m = V_m^2 - 2Q^m
+        sqr_mod(qk, qk, n); //Q^2m
+
+        if (mpz_tstbit(k, bit - 1)) {
+            mpz_add(t, u, v);
+            mpz_mod(t, t, n);
+            half_mod(t, n); //U_m+1 = (P * U_m + V_m) / 2
+            mpz_mul_si(u, u, d);
+            mpz_add(u, u, v);
+            mpz_mod(u, u, n);
+            half_mod(u, n); //V_m+1 = (D * U_m + P * V_m) / 2
+            mpz_swap(u, v);
+            mpz_swap(u, t);
+            mpz_mul_si(qk, qk, q);
+            mpz_mod(qk, qk, n); //Q^m+1
+        }
+    }
+
+    //n is a strong Lucas probable prime if U_k = 0 or V_(k * 2^r) = 0 for some r < s
+    bool prime = (mpz_sgn(u) == 0) || (mpz_sgn(v) == 0);
+    for (mp_bitcnt_t r = 1; r < s && !prime; r += 1) {
+        sqr_mod(v, v, n);
+        mpz_submul_ui(v, qk, 2);
+        mpz_mod(v, v, n);
+        sqr_mod(qk, qk, n);
+        prime = mpz_sgn(v) == 0;
+    }
+
+    mpz_clears(k, u, v, qk, t, NULL);
+    return prime;
+}
 
-    while (mpz_divisible_2exp_p(nminone, s)) {
-        s += 1;
+static uint64_t auto_rounds(mpz_t n) { //random bases after Baillie-PSW, fewer as n grows
+    size_t bits = mpz_sizeinbase(n, 2);
+
+    if (bits >= 1536) {
+        return 3;
+    }
+    if (bits >= 1024) {
+        return 4;
+    }
+    if (bits >= 512) {
+        return 5;
     }
-    s -= 1; //removes the power which it was div
+    return 7;
+}
+
+//trial division, a base 2 strong probable prime test and a strong Lucas test (Baillie-PSW),
+//then iters Miller-Rabin rounds with random bases, sieved skips the trial division
+static bool is_prime_stages(mpz_t n, uint64_t iters, gmp_randstate_t st, bool sieved) {
+    if ((mpz_cmp_ui(n, 2) == 0) || ((mpz_cmp_ui(n, 3) == 0))) { //check if n == 2 or n == 3
+        return true;
+    }
+    if (mpz_even_p(n) || (mpz_cmp_ui(n, 1) <= 0)) { //check if n % 2 == 0 or n <= 1
+        return false;
+    }
+
+    if (!sieved) {
+        pthread_once(&sieve_once, sieve_init);
+        int trial = trial_division(n);
+        if (trial != 0) {
+            stats_add(STAT_TRIAL_REJECTED, trial < 0);
+            return trial > 0;
+        }
+    }
+
+    mpz_t a, r, y, range, nminone;
+    mpz_inits(a, r, y, range, nminone, NULL);
 
+    mpz_sub_ui(nminone, n, 1);
+    mp_bitcnt_t s = mpz_scan1(nminone, 0); //n - 1 = r * 2^s
     mpz_tdiv_q_2exp(r, nminone, s);
 
-    for (uint64_t i = 0; i < iters; i += 1) {
-        mpz_sub_ui(randupvalue, n, 3); //n-3
-        mpz_urandomm(a, state, randupvalue);
-        mpz_add_ui(a, a, 2);
-        pow_mod(y, a, r, n);
-
-        if ((mpz_cmp_ui(y, 1) != 0) && (mpz_cmp(y, nminone) != 0)) { //y != 1 and y != n - 1
-            for (uint64_t j = 1; j <= (s - 1) && (mpz_cmp(y, nminone) != 0); j += 1) {
-                pow_mod(y, y, two, n);
-                if (mpz_cmp_ui(y, 1) == 0) { //y == 1
-                    mpz_clears(a, r, y, randupvalue, two, modv, nminone, NULL);
-                    return false; //clear mpz and return false
-                }
+    mpz_set_ui(a, 2);
+    bool prime = strong_probable_prime(n, a, r, s, nminone, y) && strong_lucas(n);
+
+    iters = (iters == PRIME_ITERS_AUTO) ? auto_rounds(n) : iters;
+    mpz_sub_ui(range, n, 3); //n-3
+    for (uint64_t i = 0; i < iters && prime; i += 1) {
+        mpz_urandomm(a, st, range);
+        mpz_add_ui(a, a, 2); //a in [2, n - 2]
+        prime = strong_probable_prime(n, a, r, s, nminone, y);
+    }
+
+    mpz_clears(a, r, y, range, nminone, NULL);
+    return prime;
+}
+
+static bool is_prime_timed(mpz_t n, uint64_t iters, gmp_randstate_t st, bool sieved) {
+    uint64_t start = stats_start();
+    bool prime = is_prime_stages(n, iters, st, sieved);
+    stats_add(STAT_IS_PRIME, 1);
+    stats_stop(TIMER_IS_PRIME, start);
+    return prime;
+}
+
+bool is_prime(mpz_t n, uint64_t iters) {
+    return is_prime_r(n, iters, state);
+}
+
+bool is_prime_r(mpz_t n, uint64_t iters, gmp_randstate_t st) {
+    return is_prime_timed(n, iters, st, false);
+}
+
+typedef struct {
+    mpz_t start; //first candidate of window 0, odd with the top bit set
+    mpz_t limit; //candidates have to stay below 2^(bits + 1)
+    mpz_t found; //prime from the lowest window that held one
+    uint32_t residues[SIEVE_PRIMES]; //start mod each sieve prime
+    size_t nprimes; //sieve primes below start, larger ones could be the candidate itself
+    uint64_t iters; //Miller-Rabin rounds after Baillie-PSW
+    uint64_t windows; //windows before the limit
+    uint64_t next; //next window to hand out
+    uint64_t best; //lowest window holding a prime, UINT64_MAX while none is known
+    pthread_mutex_t lock;
+} prime_search_t;
+
+typedef struct {
+    prime_search_t *search;
+    gmp_randstate_t st; //Miller-Rabin bases for this worker
+} prime_worker_t;
+
+//windows are handed out in order and a worker stops once a lower window found a prime, so
+//the result is the first prime after start no matter how many workers run
+static void *prime_worker(void *arg) {
+    prime_worker_t *worker = arg;
+    prime_search_t *search = worker->search;
+    uint8_t composite[SIEVE_WINDOW];
+    mpz_t candidate;
+    mpz_init(candidate);
+
+    for (;;) {
+        pthread_mutex_lock(&search->lock);
+        uint64_t w = search->next;
+        bool done = w >= search->best || w >= search->windows;
+        search->next += 1;
+        pthread_mutex_unlock(&search->lock);
+        if (done) {
+            break;
+        }
+
+        memset(composite, 0, SIEVE_WINDOW);
+        for (size_t j = 0; j < search->nprimes; j += 1) {
+            uint64_t prime = sieve_primes[j];
+            //residue of this window's first candidate, stepped on from the start residue
+            uint64_t r = (search->residues[j] + (2 * SIEVE_WINDOW % prime) * (w % prime)) % prime;
+            //first index i where start + 2i is divisible, (prime + 1) / 2 is 2^-1 mod prime
+            uint64_t i = (r == 0) ? 0 : ((prime - r) * ((prime + 1) / 2)) % prime;
+            for (; i < SIEVE_WINDOW; i += prime) {
+                composite[i] = 1;
+            }
+        }
+
+        mpz_set_ui(candidate, 2 * SIEVE_WINDOW);
+        mpz_mul_ui(candidate, candidate, w);
+        mpz_add(candidate, candidate, search->start); //first candidate of window w
+
+        for (uint64_t i = 0; i < SIEVE_WINDOW; i += 1, mpz_add_ui(candidate, candidate, 2)) {
+            if (composite[i]) {
+                stats_add(STAT_PRIME_SIEVED, 1);
+                continue;
+            }
+            if (mpz_cmp(candidate, search->limit) >= 0) {
+                break;
             }
-            if (mpz_cmp(y, nminone) != 0) { //y != n - 1
-                mpz_clears(a, r, y, randupvalue, two, modv, nminone, NULL);
-                return false;
+
+            pthread_mutex_lock(&search->lock);
+            bool beaten = search->best < w; //a lower window already has a prime
+            pthread_mutex_unlock(&search->lock);
+            if (beaten) {
+                break;
+            }
+
+            stats_add(STAT_PRIME_TESTED, 1);
+            if (is_prime_timed(candidate, search->iters, worker->st, true)) { //the sieve did the division
+                pthread_mutex_lock(&search->lock);
+                if (w < search->best) {
+                    search->best = w;
+                    mpz_set(search->found, candidate);
+                }
+                pthread_mutex_unlock(&search->lock);
+                break;
             }
+            stats_add(STAT_PRIME_REJECTED, 1);
         }
     }
-    mpz_clears(a, r, y, randupvalue, two, modv, nminone, NULL);
-    return true;
+
+    mpz_clear(candidate);
+    pow_mod_cache_clear();
+    return NULL;
 }
 
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
+    make_prime_r(p, bits, iters, 1, state);
+    return;
+}
+
+void make_prime_r(mpz_t p, uint64_t bits, uint64_t iters, uint64_t threads, gmp_randstate_t st) {
+    uint64_t start = stats_start();
+    pthread_once(&sieve_once, sieve_init);
+    threads = (threads > 0) ? threads : 1;
+
+    prime_search_t search;
+    mpz_inits(search.start, search.limit, search.found, NULL);
+    pthread_mutex_init(&search.lock, NULL);
+    search.iters = iters;
+
+    //one seed per call keeps st in step no matter how many workers there are
+    mpz_t seed;
+    mpz_init(seed);
+    mpz_urandomb(seed, st, RANDSTATE_SPLIT_BITS);
+    prime_worker_t *workers = malloc(threads * sizeof(prime_worker_t));
+    for (uint64_t i = 0; i < threads; i += 1) {
+        workers[i].search = &search;
+        gmp_randinit_mt(workers[i].st);
+        gmp_randseed(workers[i].st, seed);
+        mpz_add_ui(seed, seed, 1);
+    }
+    mpz_clear(seed);
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+
+    mpz_setbit(search.limit, bits + 1); //p has bits + 1 bits, as urandomb gave before
 
-    bits += 1; //create an offset due to urandomb
-    size_t k; //init k to size_t
     do {
-        mpz_urandomb(p, state, bits);
-        k = (mpz_sizeinbase(p, 2)); // p in base of
-    } while (is_prime(p, iters) == false || k < bits);
+        mpz_urandomb(search.start, st, bits);
+        mpz_setbit(search.start, bits); //force the top bit so no candidate comes out short
+        mpz_setbit(search.start, 0); //and only look at odd numbers
+
+        search.nprimes = 0;
+        while (search.nprimes < SIEVE_PRIMES
+               && mpz_cmp_ui(search.start, sieve_primes[search.nprimes]) > 0) {
+            search.residues[search.nprimes] = mpz_fdiv_ui(search.start, sieve_primes[search.nprimes]);
+            search.nprimes += 1;
+        }
 
+        mpz_sub(search.found, search.limit, search.start);
+        mpz_cdiv_q_ui(search.found, search.found, 2 * SIEVE_WINDOW);
+        search.windows = mpz_get_ui(search.found); //windows left before the limit
+        search.next = 0;
+        search.best = UINT64_MAX;
+
+        for (uint64_t i = 1; i < threads; i += 1) {
+            pthread_create(&tids[i], NULL, prime_worker, &workers[i]);
+        }
+        prime_worker(&workers[0]); //the calling thread is worker 0
+        for (uint64_t i = 1; i < threads; i += 1) {
+            pthread_join(tids[i], NULL);
+        }
+    } while (search.best == UINT64_MAX); //start was too close to the limit, draw again
+
+    mpz_set(p, search.found);
+
+    for (uint64_t i = 0; i < threads; i += 1) {
+        gmp_randclear(workers[i].st);
+    }
+    free(workers);
+    free(tids);
+    pthread_mutex_destroy(&search.lock);
+    mpz_clears(search.start, search.limit, search.found, NULL);
+    stats_stop(TIMER_MAKE_PRIME, start);
     return;
 }
@@ -5,12 +5,30 @@
 #include <stdio.h>
 #include <gmp.h>
 
+#define PRIME_ITERS_AUTO 0 //is_prime picks the extra Miller-Rabin rounds from the size of n
+
 void gcd(mpz_t d, mpz_t a, mpz_t b);
 
 void mod_inverse(mpz_t i, mpz_t a, mpz_t n);
 
+void mod_inverse_batch(mpz_ptr *out, mpz_ptr *a, size_t count, mpz_t n);
+
 void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus);
 
+void pow_mod_sec(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus);
+
+void pow_mod_ui(mpz_t out, mpz_t base, unsigned long exponent, mpz_t modulus);
+
+void sqr_mod(mpz_t out, mpz_t x, mpz_t modulus);
+
+void pow_mod_batch(mpz_ptr *out, mpz_ptr *base, size_t count, mpz_t exponent, mpz_t modulus);
+
+void pow_mod_cache_clear(void);
+
 bool is_prime(mpz_t n, uint64_t iters);
 
+bool is_prime_r(mpz_t n, uint64_t iters, gmp_randstate_t st);
+
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+
+void make_prime_r(mpz_t p, uint64_t bits, uint64_t iters, uint64_t threads, gmp_randstate_t st);
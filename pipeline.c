@@ -0,0 +1,226 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <gmp.h>
+
+#include "numtheory.h"
+#include "pipeline.h"
+#include "arena.h"
+
+typedef struct batch {
+    block_t blocks[PIPELINE_BATCH];
+    size_t count; //blocks filled by the reader
+    uint64_t seq; //position of the batch in the input
+    struct batch *next;
+} batch_t;
+
+typedef struct {
+    pipeline_t *pipe;
+    pthread_mutex_t lock;
+    pthread_cond_t free_cond; //a batch was returned to the free list
+    pthread_cond_t work_cond; //a batch is waiting for a worker, or input ended
+    pthread_cond_t done_cond; //a batch finished, or input ended
+    batch_t *free; //unused batches, bounds the memory of the whole pipeline
+    batch_t *work_head, *work_tail; //filled batches in input order
+    batch_t *done; //computed batches sorted by seq, waiting for the writer
+    bool finished; //reader hit the end of the input
+    uint64_t total; //number of batches read, valid once finished
+} queue_t;
+
+static batch_t *batch_create(size_t block_bytes) {
+    batch_t *batch = malloc(sizeof(batch_t));
+
+    for (size_t i = 0; i < PIPELINE_BATCH; i += 1) {
+        mpz_init(batch->blocks[i].value);
+        batch->blocks[i].bytes = malloc(block_bytes);
+        batch->blocks[i].src = NULL;
+        batch->blocks[i].len = 0;
+    }
+    batch->count = 0;
+    batch->next = NULL;
+    return batch;
+}
+
+static void batch_delete(batch_t *batch) {
+    for (size_t i = 0; i < PIPELINE_BATCH; i += 1) {
+        mpz_clear(batch->blocks[i].value);
+        free(batch->blocks[i].bytes);
+    }
+    free(batch);
+    return;
+}
+
+static size_t batch_fill(pipeline_t *pipe, batch_t *batch) { //reads up to a full batch
+    batch->count = 0;
+    while (batch->count < PIPELINE_BATCH && pipe->read(pipe->arg, &batch->blocks[batch->count])) {
+        batch->count += 1;
+    }
+    return batch->count;
+}
+
+static void *worker_thread(void *arg) {
+    queue_t *queue = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->work_head == NULL && !queue->finished) {
+            pthread_cond_wait(&queue->work_cond, &queue->lock);
+        }
+        batch_t *batch = queue->work_head;
+        if (batch == NULL) { //input ended and nothing is left to compute
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        queue->work_head = batch->next;
+        if (queue->work_head == NULL) {
+            queue->work_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        queue->pipe->work(queue->pipe->arg, batch->blocks, batch->count);
+        arena_block(); //the batch's temporaries are free again
+
+        pthread_mutex_lock(&queue->lock);
+        batch_t **link = &queue->done; //keep the done list sorted so the writer pops in order
+        while (*link != NULL && (*link)->seq < batch->seq) {
+            link = &(*link)->next;
+        }
+        batch->next = *link;
+        *link = batch;
+        pthread_cond_signal(&queue->done_cond);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    pow_mod_cache_clear(); //montgomery contexts are per thread
+    return NULL;
+}
+
+static void *writer_thread(void *arg) {
+    queue_t *queue = arg;
+
+    for (uint64_t next = 0;; next += 1) {
+        pthread_mutex_lock(&queue->lock);
+        while (!(queue->done != NULL && queue->done->seq == next)
+               && !(queue->finished && next == queue->total)) {
+            pthread_cond_wait(&queue->done_cond, &queue->lock);
+        }
+        if (queue->done == NULL || queue->done->seq != next) { //every batch was written
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        batch_t *batch = queue->done;
+        queue->done = batch->next;
+        pthread_mutex_unlock(&queue->lock);
+
+        for (size_t i = 0; i < batch->count; i += 1) {
+            queue->pipe->write(queue->pipe->arg, &batch->blocks[i]);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        batch->next = queue->free;
+        queue->free = batch;
+        pthread_cond_signal(&queue->free_cond);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return NULL;
+}
+
+static void pipeline_serial(pipeline_t *pipe) {
+    batch_t *batch = batch_create(pipe->block_bytes);
+
+    while (batch_fill(pipe, batch) > 0) {
+        pipe->work(pipe->arg, batch->blocks, batch->count);
+        arena_block();
+        for (size_t i = 0; i < batch->count; i += 1) {
+            pipe->write(pipe->arg, &batch->blocks[i]);
+        }
+    }
+
+    batch_delete(batch);
+    return;
+}
+
+void pipeline_run(pipeline_t *pipe, uint64_t threads) {
+    if (threads <= 1) {
+        pipeline_serial(pipe);
+        return;
+    }
+
+    queue_t queue = { .pipe = pipe };
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.free_cond, NULL);
+    pthread_cond_init(&queue.work_cond, NULL);
+    pthread_cond_init(&queue.done_cond, NULL);
+
+    uint64_t batches = 2 * threads + 2; //enough to keep every worker busy while the writer drains
+    for (uint64_t i = 0; i < batches; i += 1) {
+        batch_t *batch = batch_create(pipe->block_bytes);
+        batch->next = queue.free;
+        queue.free = batch;
+    }
+
+    pthread_t writer;
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    pthread_create(&writer, NULL, writer_thread, &queue);
+    for (uint64_t i = 0; i < threads; i += 1) {
+        pthread_create(&workers[i], NULL, worker_thread, &queue);
+    }
+
+    for (uint64_t seq = 0;; seq += 1) { //the calling thread is the reader stage
+        pthread_mutex_lock(&queue.lock);
+        while (queue.free == NULL) {
+            pthread_cond_wait(&queue.free_cond, &queue.lock);
+        }
+        batch_t *batch = queue.free;
+        queue.free = batch->next;
+        pthread_mutex_unlock(&queue.lock);
+
+        batch->seq = seq;
+        batch->next = NULL;
+        size_t count = batch_fill(pipe, batch);
+
+        pthread_mutex_lock(&queue.lock);
+        if (count > 0) {
+            if (queue.work_tail != NULL) {
+                queue.work_tail->next = batch;
+            } else {
+                queue.work_head = batch;
+            }
+            queue.work_tail = batch;
+            pthread_cond_signal(&queue.work_cond);
+        } else {
+            batch->next = queue.free;
+            queue.free = batch;
+        }
+
+        if (count < PIPELINE_BATCH) { //short batch means the input is exhausted
+            queue.finished = true;
+            queue.total = (count > 0) ? seq + 1 : seq;
+            pthread_cond_broadcast(&queue.work_cond);
+            pthread_cond_broadcast(&queue.done_cond);
+            pthread_mutex_unlock(&queue.lock);
+            break;
+        }
+        pthread_mutex_unlock(&queue.lock);
+    }
+
+    for (uint64_t i = 0; i < threads; i += 1) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_join(writer, NULL);
+
+    while (queue.free != NULL) { //every batch is back on the free list after the writer exits
+        batch_t *batch = queue.free;
+        queue.free = batch->next;
+        batch_delete(batch);
+    }
+
+    free(workers);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.free_cond);
+    pthread_cond_destroy(&queue.work_cond);
+    pthread_cond_destroy(&queue.done_cond);
+    return;
+}
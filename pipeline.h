@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+#define PIPELINE_BATCH 8 //blocks handed to a worker at once
+
+typedef struct {
+    mpz_t value; //block as an integer, the work stage replaces it with its result
+    uint8_t *bytes; //raw block bytes
+    const uint8_t *src; //block data in a mapped input, NULL when it is in bytes
+    size_t len; //number of bytes used in bytes, or available at src
+} block_t;
+
+typedef struct {
+    bool (*read)(void *arg, block_t *block); //fills the next block, false at end of input
+    void (*work)(void *arg, block_t *blocks, size_t count); //runs on worker threads
+    void (*write)(void *arg, block_t *block); //called once per block in input order
+    void *arg; //passed to every stage
+    size_t block_bytes; //size of each block's byte buffer
+} pipeline_t;
+
+void pipeline_run(pipeline_t *pipe, uint64_t threads);
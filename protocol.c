@@ -0,0 +1,68 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <gmp.h>
+
+#include "protocol.h"
+
+static void put_be(uint8_t *out, uint64_t value, size_t bytes) { //store big endian
+    for (size_t i = 0; i < bytes; i += 1) {
+        out[i] = value >> (8 * (bytes - 1 - i));
+    }
+    return;
+}
+
+static uint64_t get_be(const uint8_t *in, size_t bytes) { //load big endian
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i += 1) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+void proto_put_header(uint8_t *out, const proto_header_t *header) {
+    put_be(&out[0], header->len, 4);
+    out[4] = header->code;
+    out[5] = header->key;
+    out[6] = 0;
+    out[7] = 0;
+    put_be(&out[8], header->id, 8);
+    return;
+}
+
+void proto_get_header(const uint8_t *in, proto_header_t *header) {
+    header->len = get_be(&in[0], 4);
+    header->code = in[4];
+    header->key = in[5];
+    header->id = get_be(&in[8], 8);
+    return;
+}
+
+size_t proto_mpz_size(mpz_t x) { //length prefix and magnitude, zero has no bytes
+    return 4 + ((mpz_sgn(x) == 0) ? 0 : mpz_sizeinbase(x, 256));
+}
+
+size_t proto_put_mpz(uint8_t *out, mpz_t x) {
+    size_t bytes = 0;
+
+    if (mpz_sgn(x) != 0) {
+        mpz_export(&out[4], &bytes, 1, sizeof(uint8_t), 1, 0, x);
+    }
+    put_be(out, bytes, 4);
+    return 4 + bytes;
+}
+
+bool proto_get_mpz(mpz_t x, const uint8_t *in, size_t len, size_t *used) {
+    if (len < 4) {
+        return false;
+    }
+    size_t bytes = get_be(in, 4);
+    if (bytes > len - 4) {
+        return false;
+    }
+
+    mpz_import(x, bytes, 1, sizeof(uint8_t), 1, 0, &in[4]);
+    *used = 4 + bytes;
+    return true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <gmp.h>
+
+#define PROTO_HEADER 16 //payload length, op or status, key index, 2 reserved, request id
+#define PROTO_MAX_PAYLOAD (64 * 1024) //larger frames close the connection
+#define PROTO_SOCKET "rsa.sock" //default socket path for rsad and rsac
+
+typedef enum {
+    OP_ENCRYPT = 1, //payload m, response c
+    OP_DECRYPT, //payload c, response m
+    OP_SIGN, //payload m, response s
+    OP_VERIFY, //payload m and s, the status tells the result
+} proto_op_t;
+
+typedef enum {
+    STATUS_OK = 0,
+    STATUS_INVALID, //verify ran and the signature does not match
+    STATUS_BAD_REQUEST, //malformed payload or a value not below n
+    STATUS_NO_KEY, //no such key, or it lacks the half the op needs
+} proto_status_t;
+
+//every frame is a header followed by len bytes of payload, integers are big endian
+typedef struct {
+    uint32_t len; //payload bytes after the header
+    uint8_t code; //op in a request, status in a response
+    uint8_t key; //index of the key on the server, in the order the keys were loaded
+    uint64_t id; //chosen by the client and echoed in the response
+} proto_header_t;
+
+void proto_put_header(uint8_t *out, const proto_header_t *header);
+
+void proto_get_header(const uint8_t *in, proto_header_t *header);
+
+size_t proto_mpz_size(mpz_t x);
+
+size_t proto_put_mpz(uint8_t *out, mpz_t x);
+
+bool proto_get_mpz(mpz_t x, const uint8_t *in, size_t len, size_t *used);
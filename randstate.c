@@ -1,6 +1,10 @@
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <gmp.h>
 
+#include "randstate.h"
+
 gmp_randstate_t state; 
 
 void randstate_init(uint64_t seed) {
@@ -10,6 +14,68 @@ void randstate_init(uint64_t seed) {
     return;
 }
 
+#define ENTROPY_BYTES 32 //seed size, as large as the session keys drawn from it
+
+bool randstate_init_entropy(void) { //seeds from /dev/urandom instead of a guessable number
+    gmp_randinit_mt(state);
+    return randstate_seed_entropy(state);
+}
+
+//same for an initialized state of the caller, false leaves st unseeded when /dev/urandom fails
+bool randstate_seed_entropy(gmp_randstate_t st) {
+    uint8_t bytes[ENTROPY_BYTES];
+    FILE *urandom = fopen("/dev/urandom", "r");
+    if (urandom == NULL) {
+        return false;
+    }
+    bool ok = fread(bytes, sizeof(uint8_t), ENTROPY_BYTES, urandom) == ENTROPY_BYTES;
+    fclose(urandom);
+    if (!ok) {
+        return false;
+    }
+
+    mpz_t seed;
+    mpz_init(seed);
+    mpz_import(seed, ENTROPY_BYTES, 1, sizeof(uint8_t), 1, 0, bytes);
+    gmp_randseed(st, seed);
+    mpz_clear(seed);
+    return true;
+}
+
+static uint64_t splitmix64(uint64_t *x) { //spreads nearby seeds over the whole state
+    uint64_t z = (*x += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133CE1EB);
+    return z ^ (z >> 31);
+}
+
+//reseeds an initialized st with stream number stream of seed, the same pair always gives the
+//same numbers and different streams are unrelated, so parallel work stays reproducible
+void randstate_seed_stream(gmp_randstate_t st, uint64_t seed, uint64_t stream) {
+    uint64_t x = seed;
+    x = splitmix64(&x) ^ stream;
+
+    mpz_t value;
+    mpz_init(value);
+    mpz_set_ui(value, splitmix64(&x));
+    mpz_mul_2exp(value, value, 64);
+    mpz_add_ui(value, value, splitmix64(&x));
+    gmp_randseed(st, value);
+    mpz_clear(value);
+    return;
+}
+
+//reseeds an initialized st from src, with a seed wide enough that the states split off for
+//primes can neither be enumerated nor collide across keys
+void randstate_seed_from(gmp_randstate_t st, gmp_randstate_t src) {
+    mpz_t seed;
+    mpz_init(seed);
+    mpz_urandomb(seed, src, RANDSTATE_SPLIT_BITS);
+    gmp_randseed(st, seed);
+    mpz_clear(seed);
+    return;
+}
+
 void randstate_clear(void) { //destructor
     gmp_randclear(state);
     return;
@@ -1,10 +1,21 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <gmp.h>
 
+#define RANDSTATE_SPLIT_BITS 256 //seed of a state split off another one
+
 extern gmp_randstate_t state;
 
 void randstate_init(uint64_t seed);
 
+bool randstate_init_entropy(void);
+
+bool randstate_seed_entropy(gmp_randstate_t st);
+
+void randstate_seed_stream(gmp_randstate_t st, uint64_t seed, uint64_t stream);
+
+void randstate_seed_from(gmp_randstate_t st, gmp_randstate_t src);
+
 void randstate_clear(void);
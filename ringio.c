@@ -0,0 +1,417 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+#include "ringio.h"
+
+//runs the rest of a request with plain syscalls from byte done on, reads stop early only at
+//EOF, io_uring and the helper thread both finish short transfers here
+static void transfer(ringio_t *io, ringio_buf_t *b, size_t done) {
+    while (done < b->len) {
+        ssize_t n;
+        if (io->writing) {
+            n = (b->offset >= 0) ? pwrite(io->fd, b->data + done, b->len - done, b->offset + done)
+                                 : write(io->fd, b->data + done, b->len - done);
+        } else {
+            n = (b->offset >= 0) ? pread(io->fd, b->data + done, b->len - done, b->offset + done)
+                                 : read(io->fd, b->data + done, b->len - done);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 || (n == 0 && io->writing)) {
+            perror("Error");
+            b->failed = true;
+            break;
+        }
+        if (n == 0) { //end of the input
+            break;
+        }
+        done += n;
+    }
+    b->len = done;
+    return;
+}
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int ring, unsigned submit, unsigned wait, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, ring, submit, wait, flags, NULL, 0);
+}
+
+//maps the rings of a new io_uring, false when the kernel has none or refuses it
+static bool uring_init(ringio_t *io) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    io->ring = uring_setup(io->depth, &p);
+    if (io->ring < 0) {
+        return false;
+    }
+
+    io->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    io->sqe_map_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP; //both rings in one mapping
+    if (single) {
+        io->sq_map_size = (io->cq_map_size > io->sq_map_size) ? io->cq_map_size : io->sq_map_size;
+    }
+
+    io->sq_map = mmap(NULL, io->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        io->ring, IORING_OFF_SQ_RING);
+    io->cq_map = single ? io->sq_map
+                        : mmap(NULL, io->cq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_CQ_RING);
+    io->sqe_map = mmap(NULL, io->sqe_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        io->ring, IORING_OFF_SQES);
+    if (io->sq_map == MAP_FAILED || io->cq_map == MAP_FAILED || io->sqe_map == MAP_FAILED) {
+        if (io->sq_map != MAP_FAILED) {
+            munmap(io->sq_map, io->sq_map_size);
+        }
+        if (!single && io->cq_map != MAP_FAILED) {
+            munmap(io->cq_map, io->cq_map_size);
+        }
+        if (io->sqe_map != MAP_FAILED) {
+            munmap(io->sqe_map, io->sqe_map_size);
+        }
+        close(io->ring);
+        io->ring = -1;
+        return false;
+    }
+
+    uint8_t *sq = io->sq_map, *cq = io->cq_map;
+    io->sq_head = (unsigned *) (sq + p.sq_off.head);
+    io->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    io->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    io->sq_array = (unsigned *) (sq + p.sq_off.array);
+    io->cq_head = (unsigned *) (cq + p.cq_off.head);
+    io->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    io->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    io->sqes = io->sqe_map;
+    io->cqes = cq + p.cq_off.cqes;
+    return true;
+}
+
+static void uring_clear(ringio_t *io) {
+    munmap(io->sqe_map, io->sqe_map_size);
+    if (io->cq_map != io->sq_map) {
+        munmap(io->cq_map, io->cq_map_size);
+    }
+    munmap(io->sq_map, io->sq_map_size);
+    close(io->ring);
+    io->ring = -1;
+    return;
+}
+
+static void uring_submit(ringio_t *io, size_t i) {
+    ringio_buf_t *b = &io->bufs[i];
+    unsigned tail = *io->sq_tail; //only this thread submits
+    unsigned index = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *) io->sqes + index;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = io->writing ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = io->fd;
+    sqe->addr = (uintptr_t) b->data;
+    sqe->len = b->len;
+    sqe->off = b->offset;
+    sqe->user_data = i;
+    io->sq_array[index] = index;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int n;
+    do {
+        n = uring_enter(io->ring, 1, 0, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != 1) { //the ring did not take it, take the entry back and run it here
+        __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+        transfer(io, b, 0);
+        b->busy = false;
+    }
+    return;
+}
+
+static void uring_reap(ringio_t *io) { //waits for one completion
+    unsigned head = *io->cq_head;
+
+    while (head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (uring_enter(io->ring, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            perror("Error");
+            for (size_t i = 0; i < io->depth; i += 1) { //nothing will complete, give up on all
+                io->bufs[i].failed |= io->bufs[i].busy;
+                io->bufs[i].busy = false;
+            }
+            return;
+        }
+    }
+
+    struct io_uring_cqe *cqe = (struct io_uring_cqe *) io->cqes + (head & *io->cq_mask);
+    ringio_buf_t *b = &io->bufs[cqe->user_data];
+    int res = cqe->res;
+    __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    //errors and kernels without IORING_OP_READ/WRITE go through plain syscalls, which either
+    //work or report the real error, a short transfer is finished the same way
+    transfer(io, b, (res > 0) ? (size_t) res : 0);
+    b->busy = false;
+    return;
+}
+
+static void *helper_thread(void *arg) {
+    ringio_t *io = arg;
+
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        while (io->queued == 0 && !io->stop) {
+            pthread_cond_wait(&io->work_cond, &io->lock);
+        }
+        if (io->queued == 0) { //closing and nothing left
+            break;
+        }
+        ringio_buf_t *b = &io->bufs[io->queue[io->head]];
+        io->head = (io->head + 1) % io->depth;
+        io->queued -= 1;
+        pthread_mutex_unlock(&io->lock);
+
+        transfer(io, b, 0);
+
+        pthread_mutex_lock(&io->lock);
+        b->busy = false;
+        pthread_cond_broadcast(&io->done_cond);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+static void submit(ringio_t *io, size_t i, size_t len) {
+    ringio_buf_t *b = &io->bufs[i];
+    b->len = len;
+    b->offset = io->seekable ? io->next : -1;
+    b->busy = true;
+    io->next += len;
+
+    if (io->ring >= 0) {
+        uring_submit(io, i);
+        return;
+    }
+    pthread_mutex_lock(&io->lock);
+    io->queue[(io->head + io->queued) % io->depth] = i;
+    io->queued += 1;
+    pthread_cond_signal(&io->work_cond);
+    pthread_mutex_unlock(&io->lock);
+    return;
+}
+
+static void wait_buf(ringio_t *io, size_t i) { //until buffer i is back with the caller
+    ringio_buf_t *b = &io->bufs[i];
+
+    if (io->ring >= 0) {
+        while (b->busy) {
+            uring_reap(io);
+        }
+    } else {
+        pthread_mutex_lock(&io->lock);
+        while (b->busy) {
+            pthread_cond_wait(&io->done_cond, &io->lock);
+        }
+        pthread_mutex_unlock(&io->lock);
+    }
+    if (b->failed) {
+        io->failed = true;
+    }
+    return;
+}
+
+//io_uring for files with offsets unless threaded, the helper thread otherwise
+static bool ringio_init(ringio_t *io, int fd, size_t depth, size_t size, bool threaded) {
+    io->fd = fd;
+    io->depth = (depth < RINGIO_MAX_DEPTH) ? depth : RINGIO_MAX_DEPTH;
+    io->size = (size < RINGIO_MAX_SIZE) ? size : RINGIO_MAX_SIZE;
+    io->failed = false;
+    io->cur = 0;
+    io->pos = 0;
+    io->ring = -1;
+    io->bufs = calloc(io->depth, sizeof(ringio_buf_t));
+
+    for (size_t i = 0; i < io->depth; i += 1) {
+        if (posix_memalign((void **) &io->bufs[i].data, RINGIO_ALIGN, io->size) != 0) {
+            for (size_t j = 0; j < i; j += 1) {
+                free(io->bufs[j].data);
+            }
+            free(io->bufs);
+            return false;
+        }
+    }
+
+    //requests without offsets run at the file position, only a single thread keeps their order
+    if (threaded || !io->seekable || !uring_init(io)) {
+        io->queue = malloc(io->depth * sizeof(size_t));
+        io->head = 0;
+        io->queued = 0;
+        io->stop = false;
+        pthread_mutex_init(&io->lock, NULL);
+        pthread_cond_init(&io->work_cond, NULL);
+        pthread_cond_init(&io->done_cond, NULL);
+        pthread_create(&io->thread, NULL, helper_thread, io);
+    }
+    return true;
+}
+
+//starts reading a regular file ahead from its stdio position, false for anything else, which
+//is streamed through stdio instead
+bool ringio_open_read(ringio_t *io, FILE *file, size_t depth, size_t size, bool threaded) {
+    struct stat st;
+    int fd = fileno(file);
+    off_t offset = ftello(file); //stdio may already have read past a header
+
+    if (depth == 0 || size == 0 || fd < 0 || offset < 0 || fstat(fd, &st) != 0
+        || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    io->writing = false;
+    io->seekable = true;
+    io->next = offset;
+    if (!ringio_init(io, fd, depth, size, threaded)) {
+        return false;
+    }
+    for (size_t i = 0; i < io->depth; i += 1) {
+        submit(io, i, io->size);
+    }
+    return true;
+}
+
+//writes behind from the current position, pipes and appending files keep their order through
+//the helper thread
+bool ringio_open_write(ringio_t *io, FILE *file, size_t depth, size_t size, bool threaded) {
+    struct stat st;
+    fflush(file); //anything already written through stdio goes first
+    int fd = fileno(file);
+
+    if (depth == 0 || size == 0 || fd < 0 || fstat(fd, &st) != 0) {
+        return false;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    io->writing = true;
+    io->next = lseek(fd, 0, SEEK_CUR);
+    io->seekable = S_ISREG(st.st_mode) && flags >= 0 && !(flags & O_APPEND) && io->next >= 0;
+    io->next = io->seekable ? io->next : 0;
+    return ringio_init(io, fd, depth, size, threaded);
+}
+
+//bytes available at the read position without copying, waits for the buffer, 0 at the end or
+//after a failure, io->failed tells them apart and ringio_close reports it
+size_t ringio_span(ringio_t *io, const uint8_t **data) {
+    for (;;) {
+        ringio_buf_t *b = &io->bufs[io->cur];
+        wait_buf(io, io->cur);
+        if (io->failed) {
+            return 0;
+        }
+        if (io->pos < b->len) {
+            *data = b->data + io->pos;
+            return b->len - io->pos;
+        }
+        if (b->len < io->size) { //short read, the file ends in this buffer
+            return 0;
+        }
+        submit(io, io->cur, io->size); //used up, it reads the next stretch after the others
+        io->cur = (io->cur + 1) % io->depth;
+        io->pos = 0;
+    }
+}
+
+void ringio_skip(ringio_t *io, size_t len) { //len is at most what ringio_span returned
+    io->pos += len;
+    return;
+}
+
+size_t ringio_read(ringio_t *io, void *data, size_t len) { //short only at the end
+    uint8_t *bytes = data;
+    size_t done = 0;
+
+    while (done < len) {
+        const uint8_t *src;
+        size_t n = ringio_span(io, &src);
+        if (n == 0) {
+            break;
+        }
+        n = (len - done < n) ? len - done : n;
+        memcpy(bytes + done, src, n);
+        io->pos += n;
+        done += n;
+    }
+    return done;
+}
+
+void ringio_write(ringio_t *io, const void *data, size_t len) {
+    const uint8_t *bytes = data;
+
+    while (len > 0 && !io->failed) {
+        ringio_buf_t *b = &io->bufs[io->cur];
+        if (io->pos == 0) { //the previous write from this buffer has to be done
+            wait_buf(io, io->cur);
+        }
+        size_t room = io->size - io->pos;
+        size_t n = (len < room) ? len : room;
+
+        memcpy(b->data + io->pos, bytes, n);
+        io->pos += n;
+        bytes += n;
+        len -= n;
+
+        if (io->pos == io->size) {
+            submit(io, io->cur, io->size);
+            io->cur = (io->cur + 1) % io->depth;
+            io->pos = 0;
+        }
+    }
+    return;
+}
+
+//flushes what is left, waits for every request and puts the file position after the data,
+//false when some read or write failed
+bool ringio_close(ringio_t *io) {
+    if (io->writing && io->pos > 0 && !io->failed) {
+        submit(io, io->cur, io->pos);
+    }
+    for (size_t i = 0; i < io->depth; i += 1) {
+        wait_buf(io, i);
+    }
+    if (io->writing && io->seekable) { //later stdio writes and patches go after the data
+        lseek(io->fd, io->next, SEEK_SET);
+    }
+
+    if (io->ring >= 0) {
+        uring_clear(io);
+    } else {
+        pthread_mutex_lock(&io->lock);
+        io->stop = true;
+        pthread_cond_signal(&io->work_cond);
+        pthread_mutex_unlock(&io->lock);
+        pthread_join(io->thread, NULL);
+        pthread_mutex_destroy(&io->lock);
+        pthread_cond_destroy(&io->work_cond);
+        pthread_cond_destroy(&io->done_cond);
+        free(io->queue);
+    }
+
+    for (size_t i = 0; i < io->depth; i += 1) {
+        free(io->bufs[i].data);
+    }
+    free(io->bufs);
+    return !io->failed;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define RINGIO_DEPTH 4 //buffers in flight when the tools are given no depth
+#define RINGIO_SIZE (1 << 20) //bytes per buffer when the tools are given no size
+#define RINGIO_MAX_DEPTH 256 //larger depths are cut to this
+#define RINGIO_MAX_SIZE (1 << 30) //and larger buffers, an io_uring request holds 32 bit lengths
+#define RINGIO_ALIGN 4096 //page aligned so the kernel can copy whole pages
+
+typedef struct {
+    uint8_t *data;
+    size_t len; //bytes requested, then bytes transferred
+    off_t offset; //file offset of the request, -1 runs it at the file position
+    bool busy; //submitted and not reaped yet
+    bool failed; //the read or write returned an error
+} ringio_buf_t;
+
+//a file read ahead or written behind through a ring of buffers, while the caller works on one
+//buffer the others are in the kernel (io_uring) or queued for a helper thread that runs them
+//in order with plain syscalls
+typedef struct {
+    int fd;
+    bool writing;
+    bool seekable; //requests carry offsets, so io_uring may run them in any order
+    bool failed; //some request failed, later data is dropped
+    size_t depth; //buffers in the ring
+    size_t size; //bytes per buffer
+    ringio_buf_t *bufs;
+    size_t cur; //buffer being filled or consumed
+    size_t pos; //bytes of it used so far
+    off_t next; //offset of the next request
+
+    int ring; //io_uring descriptor, -1 when the helper thread runs the requests
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array; //submission ring shared with the kernel
+    unsigned *cq_head, *cq_tail, *cq_mask; //completion ring
+    void *sqes, *cqes;
+    void *sq_map, *cq_map, *sqe_map;
+    size_t sq_map_size, cq_map_size, sqe_map_size;
+
+    pthread_t thread; //helper thread, only when ring is -1
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond; //a request was queued, or the ring is closing
+    pthread_cond_t done_cond; //a request finished
+    size_t *queue; //buffer indices in submission order
+    size_t head, queued;
+    bool stop;
+} ringio_t;
+
+bool ringio_open_read(ringio_t *io, FILE *file, size_t depth, size_t size, bool threaded);
+
+bool ringio_open_write(ringio_t *io, FILE *file, size_t depth, size_t size, bool threaded);
+
+size_t ringio_span(ringio_t *io, const uint8_t **data);
+
+void ringio_skip(ringio_t *io, size_t len);
+
+size_t ringio_read(ringio_t *io, void *data, size_t len);
+
+void ringio_write(ringio_t *io, const void *data, size_t len);
+
+bool ringio_close(ringio_t *io);
@@ -2,37 +2,567 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include <gmp.h>
 
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "pipeline.h"
+#include "mapio.h"
+#include "ringio.h"
+#include "rsactx.h"
+#include "stats.h"
+#include "arena.h"
+#include "aead.h"
+#include "mbx.h"
+
+#define BIN_MAGIC "RSAB" //first bytes of a binary container, never valid hex
+#define BIN_VERSION 1
+#define BIN_HEADER 24 //magic, version, 3 reserved, width, 4 reserved, block count
+#define BIN_COUNT_OFFSET 16 //offset of the block count in the header
+
+#define IDX_MAGIC "RSAI" //block index written next to a ciphertext by encrypt -x
+#define IDX_VERSION 1
+#define IDX_HEADER 24 //same layout as the container, plaintext bytes per block instead of width
+#define IDX_ENTRY 8 //big endian ciphertext offset of each block
+
+#define HYB_MAGIC "RSAH" //hybrid stream, same header layout as the binary container
+#define HYB_VERSION 1
+#define HYB_KEYS_OFFSET 12 //number of RSA blocks wrapping the session key
+#define HYB_CHUNK_OFFSET 16 //plaintext bytes per record
+#define HYB_CHUNK (64 * 1024) //records written by encrypt
+#define HYB_CHUNK_MAX (16 * 1024 * 1024) //largest record decrypt accepts
+#define HYB_RECORD 5 //final flag and length ahead of each record, authenticated as aad
+
+typedef struct {
+    FILE *infile;
+    FILE *outfile;
+    size_t k; //block size in bytes
+    size_t width; //bytes needed to hold n, the size of a binary ciphertext block
+    bool binary; //blocks use the fixed width binary container
+    bool hybrid; //RSA wrapped session key followed by AEAD records
+    uint64_t keyblocks; //RSA blocks holding the session key in a hybrid stream
+    size_t chunk; //plaintext bytes per hybrid record
+    uint64_t blocks; //blocks read or written so far
+    uint64_t count; //blocks in a binary input, 0 when unknown
+    mpz_ptr n, e; //public key when encrypting
+    rsa_priv_t *key; //private key when decrypting
+    rsa_ctx_t *ctx; //runs the blocks through a context instead, only when single threaded
+    FILE *index; //block index being written, NULL when there is none
+    uint64_t offset; //output bytes so far, what the index records for each block
+    bool mapped; //input is read from in instead of infile
+    map_input_t in;
+    bool buffered; //output goes through out instead of stdio
+    out_buffer_t out;
+    bool ring_in; //input is read ahead through rin instead of infile
+    ringio_t rin;
+    bool ring_out; //output is written behind through rout
+    ringio_t rout;
+    char *hex; //formats hex lines for out or rout, or collects a hex block read through rin
+} rsa_stream_t;
+
+static void stream_write(rsa_stream_t *stream, const void *data, size_t len) {
+    uint64_t start = stats_start();
+    if (stream->ring_out) {
+        ringio_write(&stream->rout, data, len);
+    } else if (stream->buffered) {
+        outbuf_write(&stream->out, data, len);
+    } else {
+        fwrite(data, sizeof(uint8_t), len, stream->outfile);
+    }
+    stream->offset += len;
+    stats_add(STAT_BYTES_WRITTEN, len);
+    stats_stop(TIMER_WRITE, start);
+    return;
+}
+
+static size_t stream_read(rsa_stream_t *stream, void *data, size_t len) { //short at EOF or on a failure
+    uint64_t start = stats_start();
+    if (stream->mapped) {
+        size_t left = stream->in.len - stream->in.pos;
+        len = (left < len) ? left : len;
+        memcpy(data, stream->in.data + stream->in.pos, len);
+        stream->in.pos += len;
+    } else if (stream->ring_in) {
+        len = ringio_read(&stream->rin, data, len);
+    } else {
+        len = fread(data, sizeof(uint8_t), len, stream->infile);
+    }
+    stats_add(STAT_BYTES_READ, len);
+    stats_stop(TIMER_READ, start);
+    return len;
+}
+
+static void stream_open(rsa_stream_t *stream, const rsa_opts_t *opts) {
+    arena_size_for(8 * stream->width); //no effect unless the arenas are installed
+    if (opts->io_depth > 0) { //either side falls back to stdio when its file does not qualify
+        size_t size = (opts->io_size > 0) ? opts->io_size : RINGIO_SIZE;
+        stream->ring_in = ringio_open_read(&stream->rin, stream->infile, opts->io_depth, size,
+            opts->io_thread);
+        stream->ring_out = ringio_open_write(&stream->rout, stream->outfile, opts->io_depth, size,
+            opts->io_thread);
+        stream->hex = malloc(2 * stream->width + 2);
+        return;
+    }
+    if (opts->mmap) { //streams pipes and stdin when the input cannot be mapped
+        stream->mapped = mapio_open(&stream->in, stream->infile);
+        outbuf_init(&stream->out, stream->outfile);
+        stream->buffered = true;
+        stream->hex = malloc(2 * stream->width + 2);
+    }
+    return;
+}
+
+//false when a read or a write failed, reads stop there as if at EOF so this is where it shows
+static bool stream_close(rsa_stream_t *stream) {
+    bool ok = true;
+    if (stream->buffered) {
+        outbuf_close(&stream->out);
+        ok = !stream->out.failed;
+    }
+    if (stream->ring_out) { //a failed write was reported when it happened
+        ok = ringio_close(&stream->rout) && ok;
+    } else if (!stream->buffered && (fflush(stream->outfile) != 0 || ferror(stream->outfile))) {
+        perror("Error");
+        ok = false;
+    }
+    if (stream->ring_in) {
+        ok = ringio_close(&stream->rin) && ok;
+    } else if (!stream->mapped && ferror(stream->infile)) {
+        fprintf(stderr, "Error: could not read the input.\n");
+        ok = false;
+    }
+    if (stream->mapped) {
+        mapio_close(&stream->in);
+    }
+    free(stream->hex);
+    return ok;
+}
+
+static void hex_import(mpz_t value, const uint8_t *hex, size_t len, uint8_t *bytes, size_t width) {
+    if (len > 2 * width) { //too wide for n, decrypts to garbage and is skipped
+        mpz_set_ui(value, 0);
+        return;
+    }
+
+    size_t nbytes = (len + 1) / 2;
+    for (size_t i = 0; i < nbytes; i += 1) { //an odd digit count leaves one nibble in front
+        bytes[i] = 0;
+    }
+    for (size_t i = 0; i < len; i += 1) {
+        uint8_t c = hex[len - 1 - i];
+        uint8_t nibble = (c <= '9') ? c - '0' : (c | 0x20) - 'a' + 10;
+        bytes[nbytes - 1 - i / 2] |= nibble << (4 * (i % 2));
+    }
+    mpz_import(value, nbytes, 1, sizeof(uint8_t), 1, 0, bytes);
+    return;
+}
+
+static void put_be(uint8_t *out, uint64_t value, size_t bytes) { //store big endian
+    for (size_t i = bytes; i > 0; i -= 1) {
+        out[i - 1] = value & 0xFF;
+        value >>= 8;
+    }
+    return;
+}
+
+static uint64_t get_be(const uint8_t *in, size_t bytes) { //load big endian
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i += 1) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static void bin_write_header(FILE *outfile, size_t width, uint64_t count) {
+    uint8_t header[BIN_HEADER] = { 0 };
+
+    memcpy(header, BIN_MAGIC, 4);
+    header[4] = BIN_VERSION;
+    put_be(&header[8], width, 4);
+    put_be(&header[BIN_COUNT_OFFSET], count, 8);
+    fwrite(header, sizeof(uint8_t), BIN_HEADER, outfile);
+    return;
+}
+
+static void idx_write_header(FILE *index, size_t piece, uint64_t count) {
+    uint8_t header[IDX_HEADER] = { 0 };
+
+    memcpy(header, IDX_MAGIC, 4);
+    header[4] = IDX_VERSION;
+    put_be(&header[8], piece, 4);
+    put_be(&header[BIN_COUNT_OFFSET], count, 8);
+    fwrite(header, sizeof(uint8_t), IDX_HEADER, index);
+    return;
+}
+
+static bool idx_read_header(FILE *index, size_t piece, uint64_t *count) { //index made for this key
+    uint8_t header[IDX_HEADER];
+
+    if (fseeko(index, 0, SEEK_SET) != 0
+        || fread(header, sizeof(uint8_t), IDX_HEADER, index) != IDX_HEADER) {
+        return false;
+    }
+    *count = get_be(&header[BIN_COUNT_OFFSET], 8);
+    return memcmp(header, IDX_MAGIC, 4) == 0 && header[4] == IDX_VERSION
+           && get_be(&header[8], 4) == piece;
+}
+
+static bool patch_count(FILE *file, off_t start, uint64_t blocks) { //pwrite leaves the position at the end
+    uint8_t count[8];
+    put_be(count, blocks, 8);
+
+    fflush(file);
+    if (pwrite(fileno(file), count, 8, start + BIN_COUNT_OFFSET) != 8) {
+        perror("Error");
+        return false;
+    }
+    return true;
+}
+
+static bool bin_parse_header(rsa_stream_t *stream, const uint8_t *header, size_t *width) {
+    *width = get_be(&header[8], 4);
+    if (memcmp(header, HYB_MAGIC, 4) == 0 && header[4] == HYB_VERSION) {
+        stream->hybrid = true;
+        stream->keyblocks = get_be(&header[HYB_KEYS_OFFSET], 4);
+        stream->chunk = get_be(&header[HYB_CHUNK_OFFSET], 8);
+        return stream->keyblocks > 0 && stream->chunk > 0 && stream->chunk <= HYB_CHUNK_MAX;
+    }
+    stream->count = get_be(&header[BIN_COUNT_OFFSET], 8);
+    return memcmp(header, BIN_MAGIC, 4) == 0 && header[4] == BIN_VERSION;
+}
+
+//checks for a container magic, hex input is left untouched for gmp_fscanf
+static bool bin_detect(rsa_stream_t *stream, size_t *width, bool *valid) {
+    FILE *infile = stream->infile;
+    uint8_t header[BIN_HEADER];
+    int c = fgetc(infile);
+
+    *valid = true;
+    if (c == EOF) {
+        return false;
+    }
+    if (c != BIN_MAGIC[0]) {
+        ungetc(c, infile);
+        return false;
+    }
+
+    header[0] = c;
+    *valid = fread(&header[1], sizeof(uint8_t), BIN_HEADER - 1, infile) == BIN_HEADER - 1
+             && bin_parse_header(stream, header, width);
+    return true;
+}
+
+static bool bin_detect_mapped(rsa_stream_t *stream, size_t *width, bool *valid) {
+    map_input_t *in = &stream->in;
+    *valid = true;
+    if (in->len == 0 || in->data[0] != BIN_MAGIC[0]) {
+        return false;
+    }
+
+    *valid = in->len >= BIN_HEADER && bin_parse_header(stream, in->data, width);
+    in->pos = BIN_HEADER;
+    return true;
+}
+
+static bool bin_detect_ring(rsa_stream_t *stream, size_t *width, bool *valid) {
+    uint8_t header[BIN_HEADER];
+    const uint8_t *data;
+    *valid = true;
+    if (ringio_span(&stream->rin, &data) == 0 || data[0] != BIN_MAGIC[0]) {
+        return false;
+    }
+
+    *valid = ringio_read(&stream->rin, header, BIN_HEADER) == BIN_HEADER
+             && bin_parse_header(stream, header, width);
+    return true;
+}
+
+static void hybrid_encrypt(rsa_stream_t *stream) {
+    uint8_t key[AEAD_KEY] = { 0 };
+    uint8_t header[BIN_HEADER] = { 0 };
+    uint8_t record[HYB_RECORD];
+    uint8_t nonce[AEAD_NONCE] = { 0 }; //the key is new for every stream, so the record index is enough
+    uint8_t tag[AEAD_TAG];
+    size_t piece = stream->k - 1; //session key bytes per RSA block, after the 0xFF prefix
+    uint8_t *bytes = malloc(stream->width);
+    uint8_t *chunk = malloc(HYB_CHUNK);
+    mpz_t value;
+    mpz_init(value);
+
+    mpz_urandomb(value, state, 8 * AEAD_KEY); //session key
+    mpz_export(&key[AEAD_KEY - mpz_sizeinbase(value, 256)], NULL, 1, sizeof(uint8_t), 1, 0, value);
+
+    memcpy(header, HYB_MAGIC, 4);
+    header[4] = HYB_VERSION;
+    put_be(&header[8], stream->width, 4);
+    put_be(&header[HYB_KEYS_OFFSET], (AEAD_KEY + piece - 1) / piece, 4);
+    put_be(&header[HYB_CHUNK_OFFSET], HYB_CHUNK, 8);
+    stream_write(stream, header, BIN_HEADER);
+
+    for (size_t off = 0; off < AEAD_KEY; off += piece) { //small moduli take several blocks
+        size_t len = (AEAD_KEY - off < piece) ? AEAD_KEY - off : piece;
+        bytes[0] = 0xFF;
+        memcpy(&bytes[1], &key[off], len);
+        mpz_import(value, len + 1, 1, sizeof(uint8_t), 1, 0, bytes);
+        if (stream->ctx != NULL) {
+            rsa_ctx_encrypt(stream->ctx, value, value);
+        } else {
+            rsa_encrypt(value, value, stream->e, stream->n);
+        }
+        size_t size = mpz_sizeinbase(value, 256);
+        memset(bytes, 0, stream->width);
+        mpz_export(&bytes[stream->width - size], NULL, 1, sizeof(uint8_t), 1, 0, value);
+        stream_write(stream, bytes, stream->width);
+    }
+
+    for (uint64_t index = 0;; index += 1) { //a full record is always followed by another one
+        size_t len = stream_read(stream, chunk, HYB_CHUNK);
+        record[0] = len < HYB_CHUNK; //final record, a stream cut short has none
+        put_be(&record[1], len, 4);
+        put_be(&nonce[4], index, 8);
+        aead_encrypt(key, nonce, record, HYB_RECORD, chunk, len, tag);
+        stream_write(stream, record, HYB_RECORD);
+        stream_write(stream, chunk, len);
+        stream_write(stream, tag, AEAD_TAG);
+        if (record[0]) {
+            break;
+        }
+    }
+
+    explicit_bzero(key, AEAD_KEY);
+    mpz_clear(value);
+    free(bytes);
+    free(chunk);
+    return;
+}
+
+//each record is written once its tag checks out, false when the key, a record or the end of the
+//stream is missing or does not authenticate
+static bool hybrid_decrypt(rsa_stream_t *stream) {
+    uint8_t key[AEAD_KEY] = { 0 };
+    uint8_t record[HYB_RECORD];
+    uint8_t nonce[AEAD_NONCE] = { 0 };
+    size_t piece = stream->k - 1;
+    uint8_t *bytes = malloc(stream->width);
+    mpz_t value;
+    mpz_init(value);
+
+    bool valid = stream->keyblocks == (AEAD_KEY + piece - 1) / piece;
+    for (size_t off = 0; valid && off < AEAD_KEY; off += piece) {
+        size_t len = (AEAD_KEY - off < piece) ? AEAD_KEY - off : piece;
+        if (stream_read(stream, bytes, stream->width) != stream->width) {
+            valid = false;
+            break;
+        }
+        mpz_import(value, stream->width, 1, sizeof(uint8_t), 1, 0, bytes);
+        if (stream->ctx != NULL) {
+            rsa_ctx_decrypt(stream->ctx, value, value);
+        } else {
+            rsa_decrypt_crt(value, value, stream->key);
+        }
+        //the block has to be the 0xFF prefix followed by exactly len key bytes
+        valid = mpz_sizeinbase(value, 256) == len + 1;
+        if (valid) {
+            mpz_export(bytes, NULL, 1, sizeof(uint8_t), 1, 0, value);
+            valid = bytes[0] == 0xFF;
+            memcpy(&key[off], &bytes[1], len);
+        }
+    }
+
+    if (!valid) {
+        fprintf(stderr, "Error: invalid session key.\n");
+    }
+
+    bool done = false; //the final record authenticated
+    uint8_t *chunk = valid ? malloc(stream->chunk + AEAD_TAG) : NULL;
+    for (uint64_t index = 0; valid; index += 1) {
+        if (stream_read(stream, record, HYB_RECORD) != HYB_RECORD) {
+            fprintf(stderr, "Error: truncated ciphertext.\n");
+            break;
+        }
+        size_t len = get_be(&record[1], 4);
+        if (len > stream->chunk || stream_read(stream, chunk, len + AEAD_TAG) != len + AEAD_TAG) {
+            fprintf(stderr, "Error: truncated ciphertext.\n");
+            break;
+        }
+        put_be(&nonce[4], index, 8); //records that were dropped or reordered fail here
+        if (!aead_decrypt(key, nonce, record, HYB_RECORD, chunk, len, &chunk[len])) {
+            fprintf(stderr, "Error: ciphertext failed authentication.\n");
+            break;
+        }
+        stream_write(stream, chunk, len);
+        if (record[0]) {
+            done = true;
+            break;
+        }
+    }
+
+    explicit_bzero(key, AEAD_KEY);
+    mpz_clear(value);
+    free(bytes);
+    free(chunk);
+    return done;
+}
+
+typedef struct {
+    mpz_ptr p; //prime being generated
+    uint64_t bits, iters, threads;
+    gmp_randstate_t st; //state for this prime only, so p and q can run at the same time
+} prime_job_t;
+
+static void *prime_job(void *arg) {
+    prime_job_t *job = arg;
+
+    make_prime_r(job->p, job->bits, job->iters, job->threads, job->st);
+    pow_mod_cache_clear();
+    return NULL;
+}
 
 void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
+    rsa_make_pub_r(p, q, n, e, nbits, iters, 0, 1, state);
+    return;
+}
+
+void rsa_make_pub_r(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+    uint64_t exponent, uint64_t threads, gmp_randstate_t st) {
 
     mpz_t totn, gcdcompute, pminone, qminone;
     mpz_inits(totn, gcdcompute, pminone, qminone, NULL);
-    uint64_t bit_p = ((random() % (nbits / 2)) + (nbits / 4)); //get pbits with a random range
+    uint64_t bit_p = (gmp_urandomm_ui(st, nbits / 2) + (nbits / 4)); //get pbits with a random range
     uint64_t bit_q = (nbits - bit_p); //take difference of pbits and nbits to get qbits
 
-    make_prime(p, bit_p, iters); //calculate pbits with make prime
-    make_prime(q, bit_q, iters); //calcualte qbits with make prime
-    mpz_sub_ui(pminone, p, 1);
-    mpz_sub_ui(qminone, q, 1);
+    do {
+        //p and q get their own states seeded from st, so the key only depends on st and not threads
+        prime_job_t jobs[2] = { { .p = p, .bits = bit_p, .iters = iters },
+            { .p = q, .bits = bit_q, .iters = iters } };
+        for (int i = 0; i < 2; i += 1) {
+            gmp_randinit_mt(jobs[i].st);
+            randstate_seed_from(jobs[i].st, st);
+        }
+
+        if (threads >= 2) { //search for p and q concurrently, splitting the threads between them
+            jobs[0].threads = threads / 2;
+            jobs[1].threads = threads - threads / 2;
+
+            pthread_t tid;
+            pthread_create(&tid, NULL, prime_job, &jobs[0]);
+            make_prime_r(q, bit_q, iters, jobs[1].threads, jobs[1].st);
+            pthread_join(tid, NULL);
+        } else {
+            make_prime_r(p, bit_p, iters, 1, jobs[0].st); //calculate pbits with make prime
+            make_prime_r(q, bit_q, iters, 1, jobs[1].st); //calcualte qbits with make prime
+        }
+
+        gmp_randclear(jobs[0].st);
+        gmp_randclear(jobs[1].st);
+
+        mpz_sub_ui(pminone, p, 1);
+        mpz_sub_ui(qminone, q, 1);
+
+        if (exponent != 0) { //fixed e, the primes are redrawn until e is invertible mod lambda(n)
+            gcd(gcdcompute, pminone, qminone);
+            mpz_mul(totn, pminone, qminone);
+            mpz_divexact(totn, totn, gcdcompute); //lambda(n) = lcm(p - 1, q - 1)
+
+            mpz_set_ui(e, exponent);
+            gcd(gcdcompute, e, totn);
+        }
+    } while (exponent != 0 && mpz_cmp_ui(gcdcompute, 1) != 0);
 
     mpz_mul(n, p, q); //n = p * q
 
-    mpz_mul(totn, pminone, qminone); //totent(n)= (p-1)*(q-1)
+    if (exponent == 0) {
+        mpz_mul(totn, pminone, qminone); //totent(n)= (p-1)*(q-1)
 
-    do {
-        mpz_urandomb(e, state, nbits); //urandmob and calculate gcd
-        gcd(gcdcompute, e, totn);
-    } while (mpz_cmp_ui(gcdcompute, 1) != 0); //gcd value != 1
+        do {
+            mpz_urandomb(e, st, nbits); //urandmob and calculate gcd
+            gcd(gcdcompute, e, totn);
+        } while (mpz_cmp_ui(gcdcompute, 1) != 0); //gcd value != 1
+    }
 
     mpz_clears(totn, gcdcompute, pminone, qminone, NULL);
     return;
 }
 
+//n = primes[0] * ... * primes[count - 1] with the bits split evenly, 2 <= count <= RSA_MAX_PRIMES,
+//two primes give the same key rsa_make_pub_r does
+void rsa_make_pub_multi(mpz_ptr *primes, uint64_t count, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, uint64_t exponent, uint64_t threads, gmp_randstate_t st) {
+    if (count <= 2) {
+        rsa_make_pub_r(primes[0], primes[1], n, e, nbits, iters, exponent, threads, st);
+        return;
+    }
+
+    mpz_t totn, gcdcompute, minone;
+    mpz_inits(totn, gcdcompute, minone, NULL);
+    prime_job_t jobs[RSA_MAX_PRIMES];
+    pthread_t tids[RSA_MAX_PRIMES];
+    bool valid;
+
+    do {
+        for (uint64_t i = 0; i < count; i += 1) { //own states again, the key does not depend on threads
+            jobs[i] = (prime_job_t) { .p = primes[i], .bits = (nbits + i) / count, .iters = iters,
+                .threads = (threads / count > 0) ? threads / count : 1 };
+            gmp_randinit_mt(jobs[i].st);
+            randstate_seed_from(jobs[i].st, st);
+        }
+
+        if (threads >= 2) { //every prime at once, the calling thread takes the first
+            for (uint64_t i = 1; i < count; i += 1) {
+                pthread_create(&tids[i], NULL, prime_job, &jobs[i]);
+            }
+            make_prime_r(primes[0], jobs[0].bits, iters, jobs[0].threads, jobs[0].st);
+            for (uint64_t i = 1; i < count; i += 1) {
+                pthread_join(tids[i], NULL);
+            }
+        } else {
+            for (uint64_t i = 0; i < count; i += 1) {
+                make_prime_r(primes[i], jobs[i].bits, iters, 1, jobs[i].st);
+            }
+        }
+
+        valid = true;
+        mpz_set_ui(totn, 1);
+        for (uint64_t i = 0; i < count; i += 1) {
+            gmp_randclear(jobs[i].st);
+            for (uint64_t j = 0; j < i; j += 1) { //equal primes would make n a square
+                valid = valid && mpz_cmp(primes[i], primes[j]) != 0;
+            }
+            mpz_sub_ui(minone, primes[i], 1);
+            mpz_mul(totn, totn, minone); //totient(n) = (r1 - 1)(r2 - 1)...
+        }
+
+        if (valid && exponent != 0) { //fixed e, redrawn until e is invertible mod totient(n)
+            mpz_set_ui(e, exponent);
+            gcd(gcdcompute, e, totn);
+            valid = mpz_cmp_ui(gcdcompute, 1) == 0;
+        }
+    } while (!valid);
+
+    mpz_set(n, primes[0]);
+    for (uint64_t i = 1; i < count; i += 1) {
+        mpz_mul(n, n, primes[i]);
+    }
+
+    if (exponent == 0) {
+        do {
+            mpz_urandomb(e, st, nbits);
+            gcd(gcdcompute, e, totn);
+        } while (mpz_cmp_ui(gcdcompute, 1) != 0);
+    }
+
+    mpz_clears(totn, gcdcompute, minone, NULL);
+    return;
+}
+
 void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
     gmp_fprintf(pbfile, "%Zx\n", n);
     gmp_fprintf(pbfile, "%Zx\n", e);
@@ -65,6 +595,21 @@ void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q) {
     return;
 }
 
+void rsa_make_priv_multi(mpz_t d, mpz_t e, mpz_ptr *primes, uint64_t count) {
+    mpz_t totn, minone;
+    mpz_inits(totn, minone, NULL);
+
+    mpz_set_ui(totn, 1);
+    for (uint64_t i = 0; i < count; i += 1) {
+        mpz_sub_ui(minone, primes[i], 1);
+        mpz_mul(totn, totn, minone);
+    }
+    mod_inverse(d, e, totn);
+
+    mpz_clears(totn, minone, NULL);
+    return;
+}
+
 void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile) {
     gmp_fprintf(pvfile, "%Zx\n", n);
     gmp_fprintf(pvfile, "%Zx\n", d);
@@ -79,70 +624,1041 @@ void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile) {
     return;
 }
 
+void rsa_priv_init(rsa_priv_t *key) {
+    mpz_inits(key->n, key->d, key->p, key->q, key->dp, key->dq, key->qinv, key->e, NULL);
+    for (int i = 0; i < RSA_MAX_PRIMES - 2; i += 1) {
+        mpz_inits(key->r[i], key->dr[i], key->tr[i], NULL);
+    }
+    for (int i = 0; i < RSA_MAX_PRIMES; i += 1) {
+        mpz_init(key->ce[i]);
+    }
+    key->extra = 0;
+    key->crt = false;
+    key->fast = false;
+    return;
+}
+
+void rsa_priv_clear(rsa_priv_t *key) {
+    mpz_clears(key->n, key->d, key->p, key->q, key->dp, key->dq, key->qinv, key->e, NULL);
+    for (int i = 0; i < RSA_MAX_PRIMES - 2; i += 1) {
+        mpz_clears(key->r[i], key->dr[i], key->tr[i], NULL);
+    }
+    for (int i = 0; i < RSA_MAX_PRIMES; i += 1) {
+        mpz_clear(key->ce[i]);
+    }
+    key->extra = 0;
+    key->crt = false;
+    return;
+}
+
+void rsa_priv_copy(rsa_priv_t *dst, rsa_priv_t *src) {
+    mpz_set(dst->n, src->n);
+    mpz_set(dst->d, src->d);
+    mpz_set(dst->e, src->e);
+    dst->crt = src->crt;
+    dst->fast = src->fast;
+    dst->extra = src->crt ? src->extra : 0;
+    if (src->crt) {
+        mpz_set(dst->p, src->p);
+        mpz_set(dst->q, src->q);
+        mpz_set(dst->dp, src->dp);
+        mpz_set(dst->dq, src->dq);
+        mpz_set(dst->qinv, src->qinv);
+    }
+    for (uint64_t i = 0; i < dst->extra; i += 1) {
+        mpz_set(dst->r[i], src->r[i]);
+        mpz_set(dst->dr[i], src->dr[i]);
+        mpz_set(dst->tr[i], src->tr[i]);
+    }
+    for (uint64_t i = 0; i < dst->extra + 2; i += 1) {
+        mpz_set(dst->ce[i], src->ce[i]);
+    }
+    return;
+}
+
+void rsa_make_crt(rsa_priv_t *key, mpz_t n, mpz_t d, mpz_t p, mpz_t q) {
+    mpz_t pminone, qminone;
+    mpz_inits(pminone, qminone, NULL);
+
+    mpz_set(key->n, n);
+    mpz_set(key->d, d);
+    mpz_set(key->p, p);
+    mpz_set(key->q, q);
+
+    mpz_sub_ui(pminone, p, 1); //p - 1
+    mpz_sub_ui(qminone, q, 1); //q - 1
+
+    mpz_mod(key->dp, d, pminone); //dp = d mod (p - 1)
+    mpz_mod(key->dq, d, qminone); //dq = d mod (q - 1)
+    mod_inverse(key->qinv, q, p); //qinv = q^-1 mod p
+
+    key->extra = 0;
+    key->crt = true;
+    rsa_priv_find_e(key);
+
+    mpz_clears(pminone, qminone, NULL);
+    return;
+}
+
+//p and q are the first two primes as before, the rest get d mod (r - 1) and the inverse of the
+//product of the primes ahead of them
+void rsa_make_crt_multi(rsa_priv_t *key, mpz_t n, mpz_t d, mpz_ptr *primes, uint64_t count) {
+    rsa_make_crt(key, n, d, primes[0], primes[1]);
+    if (count <= 2) {
+        return;
+    }
+
+    mpz_t prod, minone;
+    mpz_inits(prod, minone, NULL);
+    mpz_mul(prod, primes[0], primes[1]);
+
+    key->extra = count - 2;
+    for (uint64_t i = 0; i < key->extra; i += 1) {
+        mpz_set(key->r[i], primes[i + 2]);
+        mpz_sub_ui(minone, key->r[i], 1);
+        mpz_mod(key->dr[i], d, minone); //dr = d mod (r - 1)
+        mod_inverse(key->tr[i], prod, key->r[i]); //tr = (p q ...)^-1 mod r
+        mpz_mul(prod, prod, key->r[i]);
+    }
+    rsa_priv_find_e(key); //lambda(n) covers the extra primes now
+
+    mpz_clears(prod, minone, NULL);
+    return;
+}
+
+//e = d^-1 mod lcm(p - 1, q - 1, ...), the same exponent mod lambda(n) whichever totient made d, so
+//private key files need no extra line for blinding
+void rsa_priv_find_e(rsa_priv_t *key) {
+    mpz_set_ui(key->e, 0);
+    if (!key->crt) { //n and d alone do not give e, those keys run unblinded
+        return;
+    }
+
+    mpz_t pminone, qminone, lambda;
+    mpz_inits(pminone, qminone, lambda, NULL);
+
+    mpz_sub_ui(pminone, key->p, 1);
+    mpz_sub_ui(qminone, key->q, 1);
+    mpz_lcm(lambda, pminone, qminone);
+    for (uint64_t i = 0; i < key->extra; i += 1) {
+        mpz_sub_ui(pminone, key->r[i], 1);
+        mpz_lcm(lambda, lambda, pminone);
+    }
+    if (mpz_cmp_ui(lambda, 1) <= 0 || mpz_invert(key->e, key->d, lambda) == 0) { //not a valid key
+        mpz_set_ui(key->e, 0);
+    }
+
+    mpz_ptr primes[RSA_MAX_PRIMES] = { key->p, key->q, key->r[0], key->r[1] };
+    for (uint64_t i = 0; i < key->extra + 2 && mpz_sgn(key->e) != 0; i += 1) {
+        mpz_sub_ui(pminone, primes[i], 1);
+        mpz_mod(key->ce[i], key->e, pminone); //never 0, e is prime to lambda
+    }
+
+    mpz_clears(pminone, qminone, lambda, NULL);
+    return;
+}
+
+void rsa_blind_init(rsa_blind_t *blind) {
+    mpz_inits(blind->n, blind->a, blind->b, NULL);
+    gmp_randinit_mt(blind->st);
+    blind->uses = 0;
+    blind->ready = false;
+    blind->seeded = false;
+    return;
+}
+
+void rsa_blind_clear(rsa_blind_t *blind) {
+    mpz_clears(blind->n, blind->a, blind->b, NULL);
+    gmp_randclear(blind->st);
+    blind->ready = false;
+    return;
+}
+
+static void blind_refresh(rsa_blind_t *blind, rsa_priv_t *key) { //draws r until it is invertible
+    if (!blind->seeded) { //a guessable r would unblind every operation, so never go on without one
+        if (!randstate_seed_entropy(blind->st)) {
+            fprintf(stderr, "Error: no entropy for the blinding factor.\n");
+            abort();
+        }
+        blind->seeded = true;
+    }
+    if (mpz_cmp(blind->n, key->n) != 0) { //sized for the squares in rsa_unblind, so they never grow
+        mpz_realloc2(blind->a, 2 * mpz_sizeinbase(key->n, 2) + GMP_NUMB_BITS);
+        mpz_realloc2(blind->b, 2 * mpz_sizeinbase(key->n, 2) + GMP_NUMB_BITS);
+    }
+
+    do {
+        mpz_urandomm(blind->a, blind->st, key->n);
+    } while (mpz_cmp_ui(blind->a, 1) <= 0 || mpz_invert(blind->b, blind->a, key->n) == 0);
+    pow_mod_sec(blind->a, blind->a, key->e, key->n); //r stays secret even though e is public
+
+    mpz_set(blind->n, key->n);
+    blind->uses = 0;
+    blind->ready = true;
+    return;
+}
+
+//out = c * r^e mod n, false when the key has no public exponent to blind with
+bool rsa_blind(rsa_blind_t *blind, mpz_t out, mpz_t c, rsa_priv_t *key) {
+    if (mpz_sgn(key->e) == 0) {
+        return false;
+    }
+    if (!blind->ready || blind->uses >= RSA_BLIND_UPDATES || mpz_cmp(blind->n, key->n) != 0) {
+        blind_refresh(blind, key);
+    }
+
+    mpz_mul(out, c, blind->a);
+    mpz_mod(out, out, key->n);
+    return true;
+}
+
+//m = m * r^-1 mod n, then squares the pair so the next operation uses r^2
+void rsa_unblind(rsa_blind_t *blind, mpz_t m, rsa_priv_t *key) {
+    mpz_mul(m, m, blind->b);
+    mpz_mod(m, m, key->n);
+
+    sqr_mod(blind->a, blind->a, key->n);
+    sqr_mod(blind->b, blind->b, key->n);
+    blind->uses += 1;
+    return;
+}
+
+static pthread_key_t blind_key;
+static pthread_once_t blind_once = PTHREAD_ONCE_INIT;
+
+static void blind_free(void *arg) { //runs when a thread that decrypted exits
+    rsa_blind_clear(arg);
+    free(arg);
+    return;
+}
+
+static void blind_key_init(void) {
+    pthread_key_create(&blind_key, blind_free);
+    return;
+}
+
+static rsa_blind_t *blind_local(void) { //pair of this thread for the functions without a context
+    pthread_once(&blind_once, blind_key_init);
+
+    rsa_blind_t *blind = pthread_getspecific(blind_key);
+    if (blind == NULL) {
+        blind = malloc(sizeof(rsa_blind_t));
+        rsa_blind_init(blind);
+        pthread_setspecific(blind_key, blind);
+    }
+    return blind;
+}
+
+//private exponentiation, constant time unless the key was marked fast
+static void priv_pow(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus, rsa_priv_t *key) {
+    if (key->fast) {
+        pow_mod(out, base, exponent, modulus);
+    } else {
+        pow_mod_sec(out, base, exponent, modulus);
+    }
+    return;
+}
+
+void rsa_write_priv_crt(rsa_priv_t *key, FILE *pvfile) {
+    rsa_write_priv(key->n, key->d, pvfile); //first two lines match the old format
+
+    if (key->crt) {
+        if (key->extra > 0) { //not hex, so older readers stop at it and use n and d alone
+            fprintf(pvfile, "primes %" PRIu64 "\n", key->extra + 2);
+        }
+        gmp_fprintf(pvfile, "%Zx\n", key->p);
+        gmp_fprintf(pvfile, "%Zx\n", key->q);
+        gmp_fprintf(pvfile, "%Zx\n", key->dp);
+        gmp_fprintf(pvfile, "%Zx\n", key->dq);
+        gmp_fprintf(pvfile, "%Zx\n", key->qinv);
+        for (uint64_t i = 0; i < key->extra; i += 1) { //r, dr and tr of each extra prime
+            gmp_fprintf(pvfile, "%Zx\n", key->r[i]);
+            gmp_fprintf(pvfile, "%Zx\n", key->dr[i]);
+            gmp_fprintf(pvfile, "%Zx\n", key->tr[i]);
+        }
+    }
+    return;
+}
+
+bool rsa_read_priv_crt(rsa_priv_t *key, FILE *pvfile) {
+    rsa_read_priv(key->n, key->d, pvfile);
+
+    //multi-prime keys put a "primes" line ahead of the CRT values, tools that predate it fail to
+    //parse it as hex and take the key as n and d alone instead of CRT over p and q only
+    uint64_t primes = 2;
+    if (fscanf(pvfile, "primes %" SCNu64 "\n", &primes) == 1
+        && (primes < 3 || primes > RSA_MAX_PRIMES)) { //more primes than this build keeps, use d
+        key->crt = false;
+        key->extra = 0;
+        mpz_set_ui(key->e, 0);
+        return false;
+    }
+
+    //old two line files stop here, so only use CRT when every value was read
+    int results = gmp_fscanf(pvfile, "%Zx\n", key->p);
+    results += gmp_fscanf(pvfile, "%Zx\n", key->q);
+    results += gmp_fscanf(pvfile, "%Zx\n", key->dp);
+    results += gmp_fscanf(pvfile, "%Zx\n", key->dq);
+    results += gmp_fscanf(pvfile, "%Zx\n", key->qinv);
+
+    key->extra = 0;
+    for (uint64_t i = 0; i < primes - 2; i += 1) { //r, dr and tr of each extra prime
+        results += gmp_fscanf(pvfile, "%Zx\n", key->r[i]);
+        results += gmp_fscanf(pvfile, "%Zx\n", key->dr[i]);
+        results += gmp_fscanf(pvfile, "%Zx\n", key->tr[i]);
+    }
+
+    key->crt = (results == (int) (3 * primes - 1));
+    key->extra = key->crt ? primes - 2 : 0;
+    rsa_priv_find_e(key);
+    return key->crt;
+}
+
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n) {
+    if (mpz_fits_ulong_p(e)) { //small public exponents such as 65537 skip the window table
+        pow_mod_ui(c, m, mpz_get_ui(e), n);
+        return;
+    }
     pow_mod(c, m, e, n);
     return;
 }
 
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
-    mpz_t c, m;
-    mpz_inits(c, m, NULL);
+//c[i] = m[i]^e mod n, c and m may be the same array
+void rsa_encrypt_batch(mpz_ptr *c, mpz_ptr *m, size_t count, mpz_t e, mpz_t n) {
+    pow_mod_batch(c, m, count, e, n);
+    return;
+}
 
-    //calculate (log base 2 of n - 1)/8
-    size_t k = (mpz_sizeinbase(n, 2) - 1) / 8; 
+static bool encrypt_read(void *arg, block_t *block) {
+    rsa_stream_t *stream = arg;
 
-    uint8_t *array = malloc(k); 
+    if (stream->mapped) { //point the block at the mapping, the worker imports from there
+        size_t left = stream->in.len - stream->in.pos;
+        block->src = stream->in.data + stream->in.pos;
+        block->len = (left < stream->k - 1) ? left : stream->k - 1;
+        stream->in.pos += block->len;
+        stats_add(STAT_BYTES_READ, block->len);
+        return block->len > 0;
+    }
 
-    array[0] = 0xFF; 
+    block->bytes[0] = 0xFF; //prefix byte keeps leading zero bytes of the input
+    size_t j = stream_read(stream, &block->bytes[1], stream->k - 1);
+    block->len = j + 1;
+    return j > 0;
+}
 
-    size_t j = 0;
+static void encrypt_work(void *arg, block_t *blocks, size_t count) {
+    rsa_stream_t *stream = arg;
+    mpz_ptr values[PIPELINE_BATCH]; //the batch is exponentiated together after the imports
 
-    while ((j = fread(&array[1], sizeof(uint8_t), (k - 1), infile)), j > 0) { 
-        mpz_import(m, j + 1, 1, sizeof(uint8_t), 1, 0, array);
-        rsa_encrypt(c, m, e, n);
-        gmp_fprintf(outfile, "%Zx\n", c);
+    for (size_t i = 0; i < count; i += 1) {
+        uint64_t start = stats_start();
+        if (blocks[i].src != NULL) { //mapped input has no room for the prefix, set its bits instead
+            mpz_import(blocks[i].value, blocks[i].len, 1, sizeof(uint8_t), 1, 0, blocks[i].src);
+            for (size_t b = 0; b < 8; b += 1) {
+                mpz_setbit(blocks[i].value, 8 * blocks[i].len + b);
+            }
+        } else {
+            mpz_import(blocks[i].value, blocks[i].len, 1, sizeof(uint8_t), 1, 0, blocks[i].bytes);
+        }
+        stats_add(STAT_BLOCKS_IMPORTED, 1);
+        stats_stop(TIMER_IMPORT, start);
+        values[i] = blocks[i].value;
     }
 
-    //clear and free array
-    mpz_clears(c, m, NULL);
-    free(array);
+    if (stream->ctx != NULL) {
+        rsa_ctx_encrypt_batch(stream->ctx, values, values, count);
+    } else {
+        rsa_encrypt_batch(values, values, count, stream->e, stream->n);
+    }
     return;
 }
 
-void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
-    pow_mod(m, c, d, n);
+static void encrypt_write(void *arg, block_t *block) {
+    rsa_stream_t *stream = arg;
+    uint64_t start = stats_start();
+    stats_add(STAT_BLOCKS_EXPORTED, 1);
+
+    if (stream->index != NULL) { //blocks reach the writer in input order
+        uint8_t entry[IDX_ENTRY];
+        put_be(entry, stream->offset, IDX_ENTRY);
+        fwrite(entry, sizeof(uint8_t), IDX_ENTRY, stream->index);
+    }
+    stream->blocks += 1;
+
+    if (!stream->binary && (stream->buffered || stream->ring_out)) {
+        mpz_get_str(stream->hex, 16, block->value);
+        size_t len = strlen(stream->hex);
+        stream->hex[len] = '\n';
+        stats_stop(TIMER_EXPORT, start);
+        stream_write(stream, stream->hex, len + 1);
+        return;
+    }
+    if (!stream->binary) { //formatting and writing happen together, count it all as write time
+        int len = gmp_fprintf(stream->outfile, "%Zx\n", block->value);
+        stream->offset += (len > 0) ? len : 0;
+        stats_add(STAT_BYTES_WRITTEN, (len > 0) ? len : 0);
+        stats_stop(TIMER_WRITE, start);
+        return;
+    }
+
+    //fixed width big endian, the plaintext bytes are no longer needed so reuse the buffer
+    size_t size = mpz_sizeinbase(block->value, 256);
+    memset(block->bytes, 0, stream->width);
+    mpz_export(&block->bytes[stream->width - size], NULL, 1, sizeof(uint8_t), 1, 0, block->value);
+    stats_stop(TIMER_EXPORT, start);
+    stream_write(stream, block->bytes, stream->width);
     return;
 }
 
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
-    mpz_t c, m;
-    mpz_inits(c, m, NULL);
+bool rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
+    rsa_opts_t opts = { .threads = 1 };
+    return rsa_encrypt_file_ex(infile, outfile, n, e, &opts);
+}
+
+//false when reading the input or writing the output failed
+bool rsa_encrypt_file_ex(FILE *infile, FILE *outfile, mpz_t n, mpz_t e, const rsa_opts_t *opts) {
+    rsa_stream_t stream = { .infile = infile, .outfile = outfile, .n = n, .e = e };
 
     //calculate (log base 2 of n - 1)/8
-    size_t k = (mpz_sizeinbase(n, 2) - 1) / 8; 
+    stream.k = (mpz_sizeinbase(n, 2) - 1) / 8; 
+    stream.width = mpz_sizeinbase(n, 256);
+    stream.binary = opts->binary;
+    stream.ctx = (opts->threads <= 1) ? opts->ctx : NULL; //a context is not shared between workers
+
+    if (opts->hybrid) { //one RSA operation for the session key, the data goes through the AEAD
+        stream.ctx = opts->ctx;
+        stream_open(&stream, opts);
+        hybrid_encrypt(&stream);
+        return stream_close(&stream);
+    }
+
+    off_t start = -1;
+    if (stream.binary) { //count is patched in below when the output is seekable
+        start = ftello(outfile);
+        bin_write_header(outfile, stream.width, 0);
+        stream.offset = BIN_HEADER; //index offsets count from the start of the output
+    }
+
+    off_t index_start = -1;
+    if (opts->index != NULL) {
+        stream.index = opts->index;
+        index_start = ftello(opts->index);
+        idx_write_header(opts->index, stream.k - 1, 0);
+    }
+
+    stream_open(&stream, opts);
+
+    pipeline_t pipe = { .read = encrypt_read,
+        .work = encrypt_work,
+        .write = encrypt_write,
+        .arg = &stream,
+        .block_bytes = stream.width };
+    pipeline_run(&pipe, opts->threads);
+
+    bool ok = stream_close(&stream);
+
+    if (stream.binary && start >= 0) {
+        ok = patch_count(outfile, start, stream.blocks) && ok;
+    }
+    if (index_start >= 0) { //every block has an entry, binary ones too
+        ok = patch_count(opts->index, index_start, stream.blocks) && ok;
+    }
+    return ok;
+}
+
+void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
+    pow_mod_sec(m, c, d, n); //no key to blind with, but the exponent does not leak
+    return;
+}
+
+bool rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
+    rsa_priv_t key;
+    rsa_priv_init(&key);
+
+    mpz_set(key.n, n);
+    mpz_set(key.d, d); //no CRT values, rsa_decrypt_crt uses the full exponent
+
+    bool ok = rsa_decrypt_file_crt(infile, outfile, &key);
+
+    rsa_priv_clear(&key);
+    return ok;
+}
 
-    uint8_t *block = malloc(k); 
+typedef struct {
+    mpz_ptr out, base, exponent, modulus;
+    rsa_priv_t *key;
+} crt_job_t;
 
-    size_t j = 0;
+static void *crt_job(void *arg) {
+    crt_job_t *job = arg;
 
-    while (!feof(infile)) { 
-        int results = gmp_fscanf(infile, "%Zx", c); 
-        if (results > 0) { 
-            rsa_decrypt(m, c, d, n); //decrypt the contents
-            mpz_export(block, &j, 1, sizeof(uint8_t), 1, 0, m); //convert back to bytes
-            fwrite(&block[1], sizeof(uint8_t), j - 1, outfile); //write to outfile
+    mpz_mod(job->out, job->base, job->modulus);
+    priv_pow(job->out, job->out, job->exponent, job->modulus, job->key);
+    pow_mod_cache_clear();
+    return NULL;
+}
+
+//mr[i] = x^d mod the i-th prime of a multi-prime key, p and q first, large moduli give every
+//prime its own thread and the calling thread takes p
+static void crt_residues(mpz_ptr *mr, mpz_t x, rsa_priv_t *key) {
+    uint64_t count = key->extra + 2;
+    crt_job_t jobs[RSA_MAX_PRIMES] = { { mr[0], x, key->dp, key->p, key },
+        { mr[1], x, key->dq, key->q, key } };
+    pthread_t tids[RSA_MAX_PRIMES];
+
+    for (uint64_t i = 2; i < count; i += 1) {
+        jobs[i] = (crt_job_t) { mr[i], x, key->dr[i - 2], key->r[i - 2], key };
+    }
+
+    if (mpz_sizeinbase(key->n, 2) < RSA_SPLIT_BITS) {
+        for (uint64_t i = 0; i < count; i += 1) {
+            mpz_mod(mr[i], x, jobs[i].modulus);
+            priv_pow(mr[i], mr[i], jobs[i].exponent, jobs[i].modulus, key);
+        }
+        return;
+    }
+
+    for (uint64_t i = 1; i < count; i += 1) {
+        pthread_create(&tids[i], NULL, crt_job, &jobs[i]);
+    }
+    mpz_mod(mr[0], x, key->p);
+    priv_pow(mr[0], mr[0], key->dp, key->p, key);
+    for (uint64_t i = 1; i < count; i += 1) {
+        pthread_join(tids[i], NULL);
+    }
+    return;
+}
+
+void rsa_decrypt_crt(mpz_t m, mpz_t c, rsa_priv_t *key) {
+    mpz_t x, mp, mq, h, t, r, extra[RSA_MAX_PRIMES - 2];
+    mpz_inits(x, mp, mq, h, t, r, NULL); //m is only written at the end, so m and c may alias
+
+    rsa_blind_t *blind = key->fast ? NULL : blind_local();
+    bool blinded = blind != NULL && rsa_blind(blind, x, c, key); //x = c * r^e
+    if (!blinded) {
+        mpz_set(x, c);
+    }
+
+    if (!key->crt) {
+        priv_pow(r, x, key->d, key->n, key);
+    } else if (key->extra > 0) {
+        mpz_ptr mr[RSA_MAX_PRIMES] = { mp, mq };
+        for (uint64_t i = 0; i < key->extra; i += 1) {
+            mpz_init(extra[i]);
+            mr[i + 2] = extra[i];
+        }
+
+        crt_residues(mr, x, key);
+        rsa_crt_combine_multi(r, mr, key, h, t);
+        if (!rsa_crt_check(r, x, key, h)) { //bad CRT values or a fault, use the full exponent
+            priv_pow(r, x, key->d, key->n, key);
+        }
+
+        for (uint64_t i = 0; i < key->extra; i += 1) {
+            mpz_clear(extra[i]);
+        }
+    } else {
+        mpz_mod(mp, x, key->p);
+        priv_pow(mp, mp, key->dp, key->p, key); //mp = x^dp mod p
+        mpz_mod(mq, x, key->q);
+        priv_pow(mq, mq, key->dq, key->q, key); //mq = x^dq mod q
+
+        rsa_crt_combine(r, mp, mq, key, h);
+        if (!rsa_crt_check(r, x, key, h)) { //bad CRT values or a fault, use the full exponent
+            priv_pow(r, x, key->d, key->n, key);
         }
     }
 
-    //clear and free
-    mpz_clears(c, m, NULL);
-    free(block);
+    if (blinded) {
+        rsa_unblind(blind, r, key);
+    }
+    mpz_set(m, r);
+
+    mpz_clears(x, mp, mq, h, t, r, NULL);
+    return;
+}
+
+//r = mq + q * (qinv * (mp - mq) mod p), h is scratch
+void rsa_crt_combine(mpz_t r, mpz_t mp, mpz_t mq, rsa_priv_t *key, mpz_t h) {
+    mpz_sub(h, mp, mq);
+    mpz_mul(h, h, key->qinv);
+    mpz_mod(h, h, key->p); //h = qinv * (mp - mq) mod p
+
+    mpz_mul(r, h, key->q);
+    mpz_add(r, r, mq); //r = mq + h * q
+    return;
+}
+
+//garner's recombination of mr[0] = r mod p, mr[1] = r mod q and mr[i + 2] = r mod r[i], h and
+//t are scratch, r may be mr[0]
+void rsa_crt_combine_multi(mpz_t r, mpz_ptr *mr, rsa_priv_t *key, mpz_t h, mpz_t t) {
+    rsa_crt_combine(r, mr[0], mr[1], key, h); //r mod p q
+    if (key->extra == 0) {
+        return;
+    }
 
+    mpz_mul(t, key->p, key->q);
+    for (uint64_t i = 0; i < key->extra; i += 1) {
+        mpz_sub(h, mr[i + 2], r);
+        mpz_mul(h, h, key->tr[i]);
+        mpz_mod(h, h, key->r[i]); //h = tr * (mr - r) mod r[i]
+        mpz_addmul(r, h, t); //r += h * p q r[0] ... r[i - 1]
+        mpz_mul(t, t, key->r[i]);
+    }
     return;
 }
 
+//fault check, true when r^e = x mod n, a fault in one CRT half gives an r that is only right
+//modulo the other primes and would hand out a factor of n, the check runs modulo each prime with
+//e mod (prime - 1), with keygen's default e that is a few products, a random e as wide as n
+//makes it as costly as the CRT exponentiations and halves their gain, h is scratch, false when
+//the key has no public exponent to check with
+bool rsa_crt_check(mpz_t r, mpz_t x, rsa_priv_t *key, mpz_t h) {
+    mpz_ptr primes[RSA_MAX_PRIMES] = { key->p, key->q, key->r[0], key->r[1] };
+
+    if (mpz_sgn(key->e) == 0) {
+        return false;
+    }
+    for (uint64_t k = 0; k < key->extra + 2; k += 1) {
+        mpz_mod(h, r, primes[k]);
+        if (mpz_cmp(key->ce[k], key->e) == 0) { //e below prime - 1 is public, skip constant time
+            pow_mod(h, h, key->ce[k], primes[k]);
+        } else {
+            priv_pow(h, h, key->ce[k], primes[k], key);
+        }
+        if (!mpz_congruent_p(h, x, primes[k])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//m[i] = c[i]^d mod n through the CRT halves, m and c may be the same array
+void rsa_decrypt_crt_batch(mpz_ptr *m, mpz_ptr *c, size_t count, rsa_priv_t *key) {
+    if (!key->fast) { //the vector kernels use variable time windows, keep them to fast keys
+        for (size_t i = 0; i < count; i += 1) {
+            rsa_decrypt_crt(m[i], c[i], key);
+        }
+        return;
+    }
+    if (!key->crt) {
+        pow_mod_batch(m, c, count, key->d, key->n);
+        return;
+    }
+
+    //res[k][j] is lane j modulo prime k, p and q first and then the extra primes, out[j] is the
+    //recombined lane j
+    uint64_t primes = key->extra + 2;
+    mpz_ptr moduli[RSA_MAX_PRIMES] = { key->p, key->q };
+    mpz_ptr exponents[RSA_MAX_PRIMES] = { key->dp, key->dq };
+    mpz_t res[RSA_MAX_PRIMES][MBX_LANES], out[MBX_LANES], h, t;
+    mpz_ptr rp[RSA_MAX_PRIMES][MBX_LANES], mr[RSA_MAX_PRIMES];
+    bool ok[MBX_LANES];
+    mpz_inits(h, t, NULL);
+    for (uint64_t k = 0; k < primes; k += 1) {
+        if (k >= 2) {
+            moduli[k] = key->r[k - 2];
+            exponents[k] = key->dr[k - 2];
+        }
+        for (size_t j = 0; j < MBX_LANES; j += 1) {
+            mpz_init(res[k][j]);
+            rp[k][j] = res[k][j];
+        }
+    }
+    for (size_t j = 0; j < MBX_LANES; j += 1) {
+        mpz_init(out[j]);
+    }
+
+    for (size_t i = 0; i < count; i += MBX_LANES) {
+        size_t group = (count - i < MBX_LANES) ? count - i : MBX_LANES;
+        for (uint64_t k = 0; k < primes; k += 1) { //res = c^dk mod prime k
+            for (size_t j = 0; j < group; j += 1) {
+                mpz_mod(res[k][j], c[i + j], moduli[k]);
+            }
+            pow_mod_batch(rp[k], rp[k], group, exponents[k], moduli[k]);
+        }
+
+        for (size_t j = 0; j < group; j += 1) {
+            for (uint64_t k = 0; k < primes; k += 1) {
+                mr[k] = res[k][j];
+            }
+            rsa_crt_combine_multi(out[j], mr, key, h, t);
+            ok[j] = (mpz_sgn(key->e) != 0);
+        }
+
+        //the fault check of rsa_crt_check, with the lanes through the vector kernels as well
+        for (uint64_t k = 0; k < primes && mpz_sgn(key->e) != 0; k += 1) {
+            for (size_t j = 0; j < group; j += 1) {
+                mpz_mod(res[k][j], out[j], moduli[k]);
+            }
+            pow_mod_batch(rp[k], rp[k], group, key->ce[k], moduli[k]);
+            for (size_t j = 0; j < group; j += 1) {
+                ok[j] = ok[j] && mpz_congruent_p(res[k][j], c[i + j], moduli[k]);
+            }
+        }
+
+        for (size_t j = 0; j < group; j += 1) {
+            if (ok[j]) {
+                mpz_set(m[i + j], out[j]);
+            } else { //bad CRT values or a fault, use the full exponent
+                pow_mod(m[i + j], c[i + j], key->d, key->n);
+            }
+        }
+    }
+
+    for (uint64_t k = 0; k < primes; k += 1) {
+        for (size_t j = 0; j < MBX_LANES; j += 1) {
+            mpz_clear(res[k][j]);
+        }
+    }
+    for (size_t j = 0; j < MBX_LANES; j += 1) {
+        mpz_clear(out[j]);
+    }
+    mpz_clears(h, t, NULL);
+    return;
+}
+
+static bool decrypt_read_mapped(rsa_stream_t *stream, block_t *block) {
+    map_input_t *in = &stream->in;
+
+    if (stream->binary) {
+        if ((stream->count != 0 && stream->blocks == stream->count)
+            || in->len - in->pos < stream->width) {
+            return false;
+        }
+        block->src = in->data + in->pos;
+        block->len = stream->width;
+        in->pos += stream->width;
+        stream->blocks += 1;
+        stats_add(STAT_BYTES_READ, stream->width);
+        return true;
+    }
+
+    //only find the next hex token here, the worker parses it
+    while (in->pos < in->len && isspace(in->data[in->pos])) {
+        in->pos += 1;
+    }
+    size_t start = in->pos;
+    while (in->pos < in->len && isxdigit(in->data[in->pos])) {
+        in->pos += 1;
+    }
+    block->src = in->data + start;
+    block->len = in->pos - start;
+    stats_add(STAT_BYTES_READ, in->pos - start);
+    return block->len > 0; //stops at EOF or bad input
+}
+
+//hex tokens may straddle the read ahead buffers, so they are collected in hex and parsed here
+static bool decrypt_read_ring(rsa_stream_t *stream, block_t *block) {
+    uint64_t start = stats_start();
+    size_t cap = 2 * stream->width + 1; //one digit more than n has marks the block as too wide
+    size_t len = 0, avail;
+    const uint8_t *data;
+
+    while ((avail = ringio_span(&stream->rin, &data)) > 0) {
+        size_t i = 0;
+        while (i < avail && isspace(data[i])) {
+            i += 1;
+        }
+        ringio_skip(&stream->rin, i);
+        if (i < avail) {
+            break;
+        }
+    }
+    while ((avail = ringio_span(&stream->rin, &data)) > 0) {
+        size_t i = 0;
+        while (i < avail && isxdigit(data[i])) {
+            if (len < cap) {
+                stream->hex[len] = data[i];
+                len += 1;
+            }
+            i += 1;
+        }
+        ringio_skip(&stream->rin, i);
+        stats_add(STAT_BYTES_READ, i);
+        if (i < avail) {
+            break;
+        }
+    }
+    stats_stop(TIMER_READ, start);
+    if (len == 0) { //stops at EOF or bad input
+        return false;
+    }
+
+    start = stats_start();
+    hex_import(block->value, (const uint8_t *) stream->hex, len, block->bytes, stream->width);
+    stats_add(STAT_BLOCKS_IMPORTED, 1);
+    stats_stop(TIMER_IMPORT, start);
+    return true;
+}
+
+static bool decrypt_read(void *arg, block_t *block) {
+    rsa_stream_t *stream = arg;
+
+    if (stream->mapped) {
+        return decrypt_read_mapped(stream, block);
+    }
+    if (stream->ring_in && !stream->binary) {
+        return decrypt_read_ring(stream, block);
+    }
+
+    if (!stream->binary) { //parsing and reading happen together, count it all as read time
+        uint64_t start = stats_start();
+        bool read = gmp_fscanf(stream->infile, "%Zx", block->value) > 0; //stops at EOF or bad input
+        stats_add(STAT_BLOCKS_IMPORTED, read);
+        stats_stop(TIMER_READ, start);
+        return read;
+    }
+
+    if (stream->count != 0 && stream->blocks == stream->count) { //ignore anything after the last block
+        return false;
+    }
+    if (stream_read(stream, block->bytes, stream->width) != stream->width) {
+        return false;
+    }
+
+    uint64_t start = stats_start();
+    mpz_import(block->value, stream->width, 1, sizeof(uint8_t), 1, 0, block->bytes);
+    stream->blocks += 1;
+    stats_add(STAT_BLOCKS_IMPORTED, 1);
+    stats_stop(TIMER_IMPORT, start);
+    return true;
+}
+
+static void decrypt_work(void *arg, block_t *blocks, size_t count) {
+    rsa_stream_t *stream = arg;
+    mpz_ptr values[PIPELINE_BATCH];
+
+    for (size_t i = 0; i < count; i += 1) {
+        uint64_t start = stats_start();
+        if (blocks[i].src != NULL && stream->binary) {
+            mpz_import(blocks[i].value, blocks[i].len, 1, sizeof(uint8_t), 1, 0, blocks[i].src);
+        } else if (blocks[i].src != NULL) {
+            hex_import(blocks[i].value, blocks[i].src, blocks[i].len, blocks[i].bytes, stream->width);
+        }
+        if (blocks[i].src != NULL) { //blocks read from stdio were imported by the reader
+            stats_add(STAT_BLOCKS_IMPORTED, 1);
+            stats_stop(TIMER_IMPORT, start);
+        }
+        values[i] = blocks[i].value;
+    }
+
+    if (stream->ctx != NULL) { //decrypt the contents
+        rsa_ctx_decrypt_batch(stream->ctx, values, values, count);
+    } else {
+        rsa_decrypt_crt_batch(values, values, count, stream->key);
+    }
+
+    for (size_t i = 0; i < count; i += 1) {
+        uint64_t start = stats_start();
+        blocks[i].len = 0;
+        if (mpz_sizeinbase(blocks[i].value, 256) <= stream->width) { //skip blocks that overflow
+            mpz_export(blocks[i].bytes, &blocks[i].len, 1, sizeof(uint8_t), 1, 0,
+                blocks[i].value); //convert back to bytes
+        }
+        stats_add(STAT_BLOCKS_EXPORTED, 1);
+        stats_stop(TIMER_EXPORT, start);
+    }
+    return;
+}
+
+static void decrypt_write(void *arg, block_t *block) {
+    rsa_stream_t *stream = arg;
+
+    if (block->len > 1) { //drop the 0xFF prefix byte
+        stream_write(stream, &block->bytes[1], block->len - 1);
+    }
+    return;
+}
+
+bool rsa_decrypt_file_crt(FILE *infile, FILE *outfile, rsa_priv_t *key) {
+    rsa_opts_t opts = { .threads = 1 };
+    return rsa_decrypt_file_ex(infile, outfile, key, &opts);
+}
+
+//cuts outfile back to base once a hybrid stream failed, so none of its plaintext is left behind,
+//pipes and terminals keep what was already written and only the status tells
+static void discard_output(FILE *outfile, off_t base) {
+    struct stat st;
+
+    fflush(outfile);
+    if (base < 0 || fstat(fileno(outfile), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    if (ftruncate(fileno(outfile), base) != 0 || fseeko(outfile, base, SEEK_SET) != 0) {
+        perror("Error");
+    }
+    return;
+}
+
+//false on a bad header, a container that ends before its block count, or a hybrid stream that
+//fails authentication, in which case a regular output file is truncated to where it started
+bool rsa_decrypt_file_ex(FILE *infile, FILE *outfile, rsa_priv_t *key, const rsa_opts_t *opts) {
+    rsa_stream_t stream = { .infile = infile, .outfile = outfile, .key = key };
+    off_t base = ftello(outfile); //-1 for pipes
+
+    //calculate (log base 2 of n - 1)/8
+    stream.k = (mpz_sizeinbase(key->n, 2) - 1) / 8; 
+    stream.width = mpz_sizeinbase(key->n, 256);
+    stream.ctx = (opts->threads <= 1) ? opts->ctx : NULL; //a context is not shared between workers
+
+    stream_open(&stream, opts);
+
+    size_t width = 0;
+    bool valid = true;
+    if (stream.mapped) { //hex, binary or hybrid input
+        stream.binary = bin_detect_mapped(&stream, &width, &valid);
+    } else if (stream.ring_in) {
+        stream.binary = bin_detect_ring(&stream, &width, &valid);
+    } else {
+        stream.binary = bin_detect(&stream, &width, &valid);
+    }
+
+    bool ok = false;
+    if (!valid || (stream.binary && width != stream.width)) {
+        fprintf(stderr, "Error: invalid ciphertext header.\n");
+    } else if (stream.hybrid) { //records are not split across workers
+        stream.ctx = opts->ctx;
+        ok = hybrid_decrypt(&stream);
+    } else {
+        pipeline_t pipe = { .read = decrypt_read,
+            .work = decrypt_work,
+            .write = decrypt_write,
+            .arg = &stream,
+            .block_bytes = stream.width };
+        pipeline_run(&pipe, opts->threads);
+
+        ok = !stream.binary || stream.count == 0 || stream.blocks == stream.count;
+        if (!ok) {
+            fprintf(stderr, "Error: truncated ciphertext.\n");
+        }
+    }
+
+    ok = stream_close(&stream) && ok; //a read failure ends the input early, so this comes last
+    if (!ok && stream.hybrid) {
+        discard_output(outfile, base);
+    }
+    return ok;
+}
+
+//reads ciphertext block i of a stream that starts at base, false past the end or on bad input
+static bool range_read_block(rsa_stream_t *stream, off_t base, uint64_t i, mpz_t value,
+    uint8_t *bytes) {
+    if (stream->binary) { //fixed width, the offset is arithmetic
+        if (fseeko(stream->infile, base + BIN_HEADER + (off_t) (i * stream->width), SEEK_SET) != 0
+            || stream_read(stream, bytes, stream->width) != stream->width) {
+            return false;
+        }
+        mpz_import(value, stream->width, 1, sizeof(uint8_t), 1, 0, bytes);
+        return true;
+    }
+
+    uint8_t entry[IDX_ENTRY]; //hex lines vary in length, the index has where each one starts
+    if (fseeko(stream->index, IDX_HEADER + (off_t) (i * IDX_ENTRY), SEEK_SET) != 0
+        || fread(entry, sizeof(uint8_t), IDX_ENTRY, stream->index) != IDX_ENTRY
+        || fseeko(stream->infile, base + (off_t) get_be(entry, IDX_ENTRY), SEEK_SET) != 0) {
+        return false;
+    }
+    return gmp_fscanf(stream->infile, "%Zx", value) == 1;
+}
+
+//writes plaintext bytes [start, start + len) and only decrypts the blocks holding them, the
+//input has to be seekable and hex input needs the index encrypt wrote for it
+bool rsa_decrypt_range(FILE *infile, FILE *outfile, rsa_priv_t *key, uint64_t start, uint64_t len,
+    const rsa_opts_t *opts) {
+    rsa_stream_t stream = { .infile = infile, .outfile = outfile, .key = key, .ctx = opts->ctx };
+
+    stream.k = (mpz_sizeinbase(key->n, 2) - 1) / 8;
+    stream.width = mpz_sizeinbase(key->n, 256);
+    size_t piece = stream.k - 1; //plaintext bytes per block, after the 0xFF prefix
+
+    off_t base = ftello(infile);
+    if (base < 0) {
+        fprintf(stderr, "Error: range decryption needs a seekable input.\n");
+        return false;
+    }
+
+    size_t width = 0;
+    bool valid = true;
+    stream.binary = bin_detect(&stream, &width, &valid);
+    uint64_t blocks = (stream.count != 0) ? stream.count : UINT64_MAX; //unknown count, read to EOF
+    if (!valid || stream.hybrid || (stream.binary && width != stream.width)) {
+        fprintf(stderr, "Error: invalid ciphertext header.\n");
+        return false;
+    }
+    if (!stream.binary) {
+        stream.index = opts->index;
+        if (stream.index == NULL || !idx_read_header(stream.index, piece, &blocks)) {
+            fprintf(stderr, "Error: hex input needs the block index written by encrypt -x.\n");
+            return false;
+        }
+    }
+
+    mpz_t values[PIPELINE_BATCH];
+    mpz_ptr ptrs[PIPELINE_BATCH];
+    for (size_t j = 0; j < PIPELINE_BATCH; j += 1) {
+        mpz_init(values[j]);
+        ptrs[j] = values[j];
+    }
+    uint8_t *bytes = malloc(stream.width); //one block
+
+    uint64_t first = start / piece; //blocks [first, end) cover the range
+    uint64_t end = (len == 0) ? first : (start + len - 1) / piece + 1;
+    end = (end < blocks) ? end : blocks;
+    uint64_t skip = start - first * piece; //bytes of the first block before the range
+    uint64_t left = len;
+
+    for (uint64_t i = first; i < end && left > 0;) {
+        size_t group = 0;
+        while (group < PIPELINE_BATCH && i + group < end
+               && range_read_block(&stream, base, i + group, values[group], bytes)) {
+            group += 1;
+        }
+        if (group == 0) {
+            break;
+        }
+
+        if (stream.ctx != NULL) {
+            rsa_ctx_decrypt_batch(stream.ctx, ptrs, ptrs, group);
+        } else {
+            rsa_decrypt_crt_batch(ptrs, ptrs, group, key);
+        }
+
+        for (size_t j = 0; j < group && left > 0; j += 1) {
+            size_t size = 0;
+            if (mpz_sizeinbase(values[j], 256) <= stream.width) { //skip blocks that overflow
+                mpz_export(bytes, &size, 1, sizeof(uint8_t), 1, 0, values[j]);
+            }
+            size = (size > 1) ? size - 1 : 0; //drop the 0xFF prefix byte
+            if (size > skip) {
+                size_t out = (size - skip < left) ? size - skip : left;
+                stream_write(&stream, &bytes[1 + skip], out);
+                left -= out;
+            }
+            skip = 0;
+        }
+
+        if (group < PIPELINE_BATCH && i + group < end) { //ran into the end of the input
+            break;
+        }
+        i += group;
+    }
+
+    for (size_t j = 0; j < PIPELINE_BATCH; j += 1) {
+        mpz_clear(values[j]);
+    }
+    free(bytes);
+    return stream_close(&stream); //a read failure looked like the end of the input above
+}
+
 void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n) {
-    pow_mod(s, m, d, n);
+    pow_mod_sec(s, m, d, n);
+    return;
+}
+
+void rsa_sign_crt(mpz_t s, mpz_t m, rsa_priv_t *key) {
+    rsa_decrypt_crt(s, m, key); //signing is the same private key operation
     return;
 }
 
@@ -150,7 +1666,7 @@ bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n) {
     mpz_t t;
     mpz_init(t);
 
-    pow_mod(t, s, e, n);
+    rsa_encrypt(t, s, e, n); //verifying is the public key operation
 
     if (mpz_cmp(t, m) == 0) { //t == m
         mpz_clear(t);
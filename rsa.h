@@ -5,26 +5,126 @@
 #include <stdio.h>
 #include <gmp.h>
 
+#define RSA_BLIND_UPDATES 32 //uses of a blinding pair before a fresh r is drawn
+#define RSA_MAX_PRIMES 4 //factors of a multi-prime modulus, p and q then up to two more
+#define RSA_SPLIT_BITS 2048 //multi-prime moduli from this size run each prime on its own thread
+#define RSA_DEFAULT_E 65537 //keygen's public exponent, small so the CRT fault check is nearly free
+
+typedef struct {
+    mpz_t n, d; //public modulus and private exponent
+    mpz_t p, q; //prime factors of n
+    mpz_t dp, dq, qinv; //d mod (p - 1), d mod (q - 1) and q^-1 mod p
+    uint64_t extra; //primes after p and q, 0 for two prime keys
+    mpz_t r[RSA_MAX_PRIMES - 2]; //extra primes, n = p q r[0] r[1] ...
+    mpz_t dr[RSA_MAX_PRIMES - 2]; //d mod (r[i] - 1)
+    mpz_t tr[RSA_MAX_PRIMES - 2]; //(p q r[0] ... r[i - 1])^-1 mod r[i], as in RFC 8017
+    mpz_t e; //public exponent for blinding, found from d when p and q are known, 0 otherwise
+    mpz_t ce[RSA_MAX_PRIMES]; //e mod (prime - 1), p and q first, for the CRT fault check
+    bool crt; //set when p, q, dp, dq and qinv are valid
+    bool fast; //variable time private key operations, leaks d through timing, trusted hosts only
+} rsa_priv_t;
+
+//blinding pair for one modulus, private key operations run on c * r^e and the result is
+//multiplied by r^-1, so their timing says nothing about c, the pair is squared after every use
+//and redrawn every RSA_BLIND_UPDATES uses
+typedef struct {
+    mpz_t n; //modulus of the pair
+    mpz_t a, b; //r^e and r^-1 mod n
+    uint64_t uses; //operations since r was drawn
+    bool ready; //a and b hold a pair for n
+    bool seeded; //st is seeded by the first pair, so contexts that never decrypt skip it
+    gmp_randstate_t st; //seeded from /dev/urandom, r must not be predictable
+} rsa_blind_t;
+
+typedef struct rsa_ctx rsa_ctx_t; //defined in rsactx.h
+
+typedef struct {
+    uint64_t threads; //pipeline worker threads, 0 or 1 runs serially
+    bool binary; //encrypt to the fixed width binary container instead of hex lines
+    bool mmap; //map regular input files and write output through a large aligned buffer
+    bool hybrid; //wrap a session key drawn from the global randstate, stream data with an AEAD
+    rsa_ctx_t *ctx; //context for single threaded runs, workers use their own pow_mod cache
+    FILE *index; //encrypt writes a block index here, range decryption of hex input reads it
+    uint64_t io_depth; //buffers in flight per file for read ahead and write behind, 0 for none
+    size_t io_size; //bytes per read ahead or write behind buffer, 0 picks RINGIO_SIZE
+    bool io_thread; //run read ahead and write behind on a helper thread even where io_uring works
+} rsa_opts_t;
+
 void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters);
 
+void rsa_make_pub_r(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+    uint64_t exponent, uint64_t threads, gmp_randstate_t st);
+
+void rsa_make_pub_multi(mpz_ptr *primes, uint64_t count, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, uint64_t exponent, uint64_t threads, gmp_randstate_t st);
+
 void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
 void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
 void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q);
 
+void rsa_make_priv_multi(mpz_t d, mpz_t e, mpz_ptr *primes, uint64_t count);
+
 void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile);
 
 void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile);
 
+void rsa_priv_init(rsa_priv_t *key);
+
+void rsa_priv_clear(rsa_priv_t *key);
+
+void rsa_make_crt(rsa_priv_t *key, mpz_t n, mpz_t d, mpz_t p, mpz_t q);
+
+void rsa_make_crt_multi(rsa_priv_t *key, mpz_t n, mpz_t d, mpz_ptr *primes, uint64_t count);
+
+void rsa_priv_copy(rsa_priv_t *dst, rsa_priv_t *src);
+
+void rsa_priv_find_e(rsa_priv_t *key);
+
+void rsa_blind_init(rsa_blind_t *blind);
+
+void rsa_blind_clear(rsa_blind_t *blind);
+
+bool rsa_blind(rsa_blind_t *blind, mpz_t out, mpz_t c, rsa_priv_t *key);
+
+void rsa_unblind(rsa_blind_t *blind, mpz_t m, rsa_priv_t *key);
+
+void rsa_write_priv_crt(rsa_priv_t *key, FILE *pvfile);
+
+bool rsa_read_priv_crt(rsa_priv_t *key, FILE *pvfile);
+
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n);
 
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
+void rsa_encrypt_batch(mpz_ptr *c, mpz_ptr *m, size_t count, mpz_t e, mpz_t n);
+
+bool rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
+
+bool rsa_encrypt_file_ex(FILE *infile, FILE *outfile, mpz_t n, mpz_t e, const rsa_opts_t *opts);
 
 void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n);
 
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
+bool rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
+
+void rsa_decrypt_crt(mpz_t m, mpz_t c, rsa_priv_t *key);
+
+void rsa_decrypt_crt_batch(mpz_ptr *m, mpz_ptr *c, size_t count, rsa_priv_t *key);
+
+void rsa_crt_combine(mpz_t r, mpz_t mp, mpz_t mq, rsa_priv_t *key, mpz_t h);
+
+void rsa_crt_combine_multi(mpz_t r, mpz_ptr *mr, rsa_priv_t *key, mpz_t h, mpz_t t);
+
+bool rsa_crt_check(mpz_t r, mpz_t x, rsa_priv_t *key, mpz_t h);
+
+bool rsa_decrypt_file_crt(FILE *infile, FILE *outfile, rsa_priv_t *key);
+
+bool rsa_decrypt_file_ex(FILE *infile, FILE *outfile, rsa_priv_t *key, const rsa_opts_t *opts);
+
+bool rsa_decrypt_range(FILE *infile, FILE *outfile, rsa_priv_t *key, uint64_t start, uint64_t len,
+    const rsa_opts_t *opts);
 
 void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n);
 
+void rsa_sign_crt(mpz_t s, mpz_t m, rsa_priv_t *key);
+
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n);
@@ -0,0 +1,264 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <gmp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.h"
+
+#define OPTIONS "hvs:k:c:w:i:o:"
+
+void program_usage(void) { //prints help message
+    fprintf(stderr, "SYNOPSIS\n");
+    fprintf(stderr, "   Sends RSA requests to a running rsad.\n");
+    fprintf(stderr, "   Input is hex integers, one per request, verify takes a message and a\n");
+    fprintf(stderr, "   signature per request. Output is one hex result or valid/invalid per line.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "USAGE\n");
+    fprintf(stderr, "   ./rsac [-hv] [-s socket] [-k key] [-w window] [-i infile] [-o outfile] -c op\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "   -h              Display program help and usage.\n");
+    fprintf(stderr, "   -v              Display verbose program output.\n");
+    fprintf(stderr, "   -s socket       Unix socket path (default: %s).\n", PROTO_SOCKET);
+    fprintf(stderr, "   -k key          Index of the key on the server (default: 0).\n");
+    fprintf(stderr, "   -c op           encrypt, decrypt, sign or verify (default: encrypt).\n");
+    fprintf(stderr, "   -w window       Requests per window, answers are read while it goes out (default: 64).\n");
+    fprintf(stderr, "   -i infile       Input file of hex integers (default: stdin).\n");
+    fprintf(stderr, "   -o outfile      Output file for the results (default: stdout).\n");
+}
+
+static bool read_all(int fd, uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, data, len, 0);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+//reads one answer into its slot of the window that starts at request id total
+static bool read_answer(int fd, uint8_t *frame, uint64_t total, uint64_t count, mpz_t *values,
+    uint8_t *status) {
+    proto_header_t header;
+    if (!read_all(fd, frame, PROTO_HEADER)) {
+        return false;
+    }
+    proto_get_header(frame, &header);
+    if (header.len > PROTO_MAX_PAYLOAD || header.id < total || header.id >= total + count
+        || !read_all(fd, frame, header.len)) {
+        return false;
+    }
+    size_t used = 0;
+    uint64_t slot = header.id - total;
+    status[slot] = header.code;
+    if (header.code == STATUS_OK && header.len > 0) {
+        proto_get_mpz(values[slot], frame, header.len, &used);
+    }
+    return true;
+}
+
+//sends a window of frames and collects its count answers, answers are read as soon as they
+//arrive because rsad stops reading a connection whose unsent answers pile up, so a window larger
+//than that would otherwise leave both sides waiting to write
+static bool exchange(int fd, const uint8_t *out, size_t out_len, uint8_t *frame, uint64_t total,
+    uint64_t count, mpz_t *values, uint8_t *status) {
+    size_t sent = 0;
+    uint64_t got = 0;
+
+    while (got < count) {
+        struct pollfd p = { .fd = fd, .events = POLLIN | (sent < out_len ? POLLOUT : 0) };
+        if (poll(&p, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (p.revents & POLLIN) { //answers first, they are what lets the server read again
+            if (!read_answer(fd, frame, total, count, values, status)) {
+                return false;
+            }
+            got += 1;
+        } else if (p.revents & POLLOUT) {
+            ssize_t n = send(fd, out + sent, out_len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return false;
+            }
+            sent += (n > 0) ? (size_t) n : 0;
+        } else if (p.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            return false;
+        }
+    }
+    return sent == out_len;
+}
+
+static int parse_op(const char *name) {
+    const char *names[] = { "encrypt", "decrypt", "sign", "verify" };
+
+    for (int i = 0; i < 4; i += 1) {
+        if (strcmp(name, names[i]) == 0) {
+            return OP_ENCRYPT + i;
+        }
+    }
+    return 0;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char **argv) {
+
+    int opt = 0;
+    bool test_v = false;
+    char *path = PROTO_SOCKET;
+    uint8_t key = 0;
+    int op = OP_ENCRYPT;
+    uint64_t window = 64;
+    FILE *infile = stdin;
+    FILE *outfile = stdout;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': program_usage(); exit(0);
+        case 'v': test_v = true; break;
+        case 's': path = optarg; break; //socket path
+        case 'k': key = strtoul(optarg, NULL, 10); break; //key index on the server
+        case 'c':
+            op = parse_op(optarg);
+            if (op == 0) {
+                program_usage();
+                exit(1);
+            }
+            break;
+        case 'w': window = strtoull(optarg, NULL, 10); break; //requests in flight
+        case 'i': infile = fopen(optarg, "r"); break;
+        case 'o': outfile = fopen(optarg, "w"); break;
+        default: program_usage(); exit(1);
+        }
+    }
+
+    //print error message and quits the program
+    if (!infile || !outfile) {
+        perror("Error");
+        return 1;
+    }
+    window = (window > 0) ? window : 1;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        perror("Error");
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
+
+    mpz_t *values = malloc(window * sizeof(mpz_t)); //requests of one window, then their results
+    mpz_t *sigs = malloc(window * sizeof(mpz_t));
+    uint8_t *status = malloc(window);
+    for (uint64_t i = 0; i < window; i += 1) {
+        mpz_inits(values[i], sigs[i], NULL);
+    }
+    size_t cap = PROTO_HEADER + PROTO_MAX_PAYLOAD;
+    uint8_t *frame = malloc(cap);
+    uint8_t *out = NULL;
+    size_t out_cap = 0;
+
+    int exit_code = 0;
+    uint64_t total = 0;
+    double start = now_ms();
+    bool more = true;
+
+    while (more) {
+        uint64_t count = 0; //read a window of requests and send them in one write
+        size_t out_len = 0;
+        while (count < window) {
+            if (gmp_fscanf(infile, "%Zx", values[count]) != 1
+                || (op == OP_VERIFY && gmp_fscanf(infile, "%Zx", sigs[count]) != 1)) {
+                more = false;
+                break;
+            }
+            size_t len = proto_mpz_size(values[count]);
+            len += (op == OP_VERIFY) ? proto_mpz_size(sigs[count]) : 0;
+            if (out_len + PROTO_HEADER + len > out_cap) {
+                out_cap = 2 * (out_len + PROTO_HEADER + len);
+                out = realloc(out, out_cap);
+            }
+            proto_header_t header = { .len = len, .code = op, .key = key, .id = total + count };
+            proto_put_header(&out[out_len], &header);
+            size_t used = proto_put_mpz(&out[out_len + PROTO_HEADER], values[count]);
+            if (op == OP_VERIFY) {
+                proto_put_mpz(&out[out_len + PROTO_HEADER + used], sigs[count]);
+            }
+            out_len += PROTO_HEADER + len;
+            count += 1;
+        }
+
+        //answers come back in any order, the id puts each one in its slot
+        if (count > 0 && !exchange(fd, out, out_len, frame, total, count, values, status)) {
+            fprintf(stderr, "Error: lost the connection to the server.\n");
+            exit_code = 1;
+            break;
+        }
+
+        for (uint64_t i = 0; i < count; i += 1) {
+            switch (status[i]) {
+            case STATUS_OK:
+                if (op == OP_VERIFY) {
+                    fprintf(outfile, "valid\n");
+                } else {
+                    gmp_fprintf(outfile, "%Zx\n", values[i]);
+                }
+                break;
+            case STATUS_INVALID:
+                fprintf(outfile, "invalid\n");
+                exit_code = 1;
+                break;
+            case STATUS_NO_KEY:
+                fprintf(stderr, "Error: key %u cannot serve this request.\n", key);
+                exit_code = 1;
+                break;
+            default:
+                fprintf(stderr, "Error: bad request %lu.\n", (unsigned long) (total + i));
+                exit_code = 1;
+                break;
+            }
+        }
+        total += count;
+    }
+
+    if (test_v) { //average round trip including the server's work
+        double elapsed = now_ms() - start;
+        fprintf(stderr, "%lu requests in %.3f ms, %.3f ms per request\n", (unsigned long) total,
+            elapsed, total > 0 ? elapsed / total : 0.0);
+    }
+
+    for (uint64_t i = 0; i < window; i += 1) {
+        mpz_clears(values[i], sigs[i], NULL);
+    }
+    free(values);
+    free(sigs);
+    free(status);
+    free(frame);
+    free(out);
+    close(fd);
+    fclose(infile);
+    fclose(outfile);
+
+    return exit_code;
+}
@@ -0,0 +1,488 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <gmp.h>
+
+#include "numtheory.h"
+#include "montgomery.h"
+#include "rsa.h"
+#include "rsactx.h"
+
+void rsa_ctx_init(rsa_ctx_t *ctx, uint64_t seed) {
+    mpz_inits(ctx->n, ctx->e, NULL);
+    rsa_priv_init(&ctx->priv);
+    rsa_blind_init(&ctx->blind);
+    for (int i = 0; i < RSA_CTX_SCRATCH; i += 1) {
+        mpz_init(ctx->scratch[i]);
+    }
+    for (int i = 0; i < RSA_MAX_PRIMES * MBX_LANES; i += 1) {
+        mpz_init(ctx->halves[i]);
+    }
+    ctx->has_pub = false;
+    ctx->has_priv = false;
+    ctx->mont_n.size = 0; //montgomery contexts are built when a key is set
+    ctx->mont_p.size = 0;
+    ctx->mont_q.size = 0;
+    ctx->mbx_n.lanes = 0;
+    ctx->mbx_p.lanes = 0;
+    ctx->mbx_q.lanes = 0;
+    for (int i = 0; i < RSA_MAX_PRIMES - 2; i += 1) {
+        ctx->mont_r[i].size = 0;
+        ctx->mbx_r[i].lanes = 0;
+    }
+
+    gmp_randinit_mt(ctx->st); //own Mersenne Twister, the global state is never used
+    gmp_randseed_ui(ctx->st, seed);
+    return;
+}
+
+static void ctx_drop_key(rsa_ctx_t *ctx) {
+    mont_t *monts[3 + RSA_MAX_PRIMES - 2] = { &ctx->mont_n, &ctx->mont_p, &ctx->mont_q,
+        &ctx->mont_r[0], &ctx->mont_r[1] };
+
+    for (int i = 0; i < 3 + RSA_MAX_PRIMES - 2; i += 1) {
+        if (monts[i]->size > 0) {
+            mont_clear(monts[i]);
+        }
+    }
+    mbx_clear(&ctx->mbx_n);
+    mbx_clear(&ctx->mbx_p);
+    mbx_clear(&ctx->mbx_q);
+    for (int i = 0; i < RSA_MAX_PRIMES - 2; i += 1) {
+        mbx_clear(&ctx->mbx_r[i]);
+    }
+    ctx->has_pub = false;
+    ctx->has_priv = false;
+    return;
+}
+
+void rsa_ctx_clear(rsa_ctx_t *ctx) {
+    ctx_drop_key(ctx);
+    mpz_clears(ctx->n, ctx->e, NULL);
+    rsa_priv_clear(&ctx->priv);
+    rsa_blind_clear(&ctx->blind);
+    for (int i = 0; i < RSA_CTX_SCRATCH; i += 1) {
+        mpz_clear(ctx->scratch[i]);
+    }
+    for (int i = 0; i < RSA_MAX_PRIMES * MBX_LANES; i += 1) {
+        mpz_clear(ctx->halves[i]);
+    }
+    gmp_randclear(ctx->st);
+    return;
+}
+
+static void ctx_set_modulus(rsa_ctx_t *ctx, mpz_t n) { //precomputes everything that depends on n
+    ctx_drop_key(ctx);
+    mpz_set(ctx->n, n);
+    mont_init(&ctx->mont_n, n);
+
+    for (int i = 0; i < RSA_CTX_SCRATCH; i += 1) { //products of two residues never need more
+        mpz_realloc2(ctx->scratch[i], 2 * mpz_sizeinbase(n, 2) + GMP_NUMB_BITS);
+    }
+    return;
+}
+
+void rsa_ctx_set_pub(rsa_ctx_t *ctx, mpz_t n, mpz_t e) {
+    ctx_set_modulus(ctx, n);
+    mpz_set(ctx->e, e);
+    ctx->has_pub = true;
+    return;
+}
+
+void rsa_ctx_set_priv(rsa_ctx_t *ctx, rsa_priv_t *key) {
+    ctx_set_modulus(ctx, key->n);
+
+    rsa_priv_copy(&ctx->priv, key);
+    if (key->crt) {
+        mont_init(&ctx->mont_p, key->p);
+        mont_init(&ctx->mont_q, key->q);
+        for (uint64_t i = 0; i < key->extra; i += 1) {
+            mont_init(&ctx->mont_r[i], key->r[i]);
+        }
+    }
+    ctx->has_priv = true;
+    return;
+}
+
+void rsa_ctx_generate(rsa_ctx_t *ctx, uint64_t nbits, uint64_t iters, uint64_t exponent) {
+    mpz_t p, q, n, e, d;
+    mpz_inits(p, q, n, e, d, NULL);
+
+    rsa_make_pub_r(p, q, n, e, nbits, iters, exponent, 1, ctx->st);
+    rsa_make_priv(d, e, p, q);
+
+    rsa_priv_t key;
+    rsa_priv_init(&key);
+    rsa_make_crt(&key, n, d, p, q);
+
+    rsa_ctx_set_priv(ctx, &key);
+    mpz_set(ctx->e, e);
+    ctx->has_pub = true;
+
+    rsa_priv_clear(&key);
+    mpz_clears(p, q, n, e, d, NULL);
+    return;
+}
+
+void rsa_ctx_encrypt(rsa_ctx_t *ctx, mpz_t c, mpz_t m) {
+    if (mpz_fits_ulong_p(ctx->e)) { //small public exponents skip the window table
+        mont_powm_ui(&ctx->mont_n, c, m, mpz_get_ui(ctx->e));
+    } else {
+        mont_powm(&ctx->mont_n, c, m, ctx->e);
+    }
+    return;
+}
+
+//primes of the private key, p and q first, with their montgomery contexts and CRT exponents,
+//returns how many there are
+static uint64_t ctx_primes(rsa_ctx_t *ctx, mpz_ptr *primes, mont_t **monts, mpz_ptr *exponents) {
+    rsa_priv_t *key = &ctx->priv;
+    primes[0] = key->p;
+    primes[1] = key->q;
+    monts[0] = &ctx->mont_p;
+    monts[1] = &ctx->mont_q;
+    exponents[0] = key->dp;
+    exponents[1] = key->dq;
+    for (uint64_t i = 0; i < key->extra; i += 1) {
+        primes[i + 2] = key->r[i];
+        monts[i + 2] = &ctx->mont_r[i];
+        exponents[i + 2] = key->dr[i];
+    }
+    return key->extra + 2;
+}
+
+typedef struct {
+    mpz_ptr out, base, exponent, modulus;
+    mont_t *mont;
+    bool fast;
+} ctx_job_t;
+
+static void *ctx_job(void *arg) { //out = base^exponent mod one prime
+    ctx_job_t *job = arg;
+
+    if (job->fast) {
+        mont_powm(job->mont, job->out, job->base, job->exponent); //mont_powm reduces base itself
+    } else {
+        mpz_mod(job->out, job->base, job->modulus);
+        pow_mod_sec(job->out, job->out, job->exponent, job->modulus);
+    }
+    return NULL;
+}
+
+//mr[k] = x^d mod prime k, constant time unless the key is fast, large multi-prime moduli give
+//every prime its own thread like rsa_decrypt_crt does
+static void ctx_residues(rsa_ctx_t *ctx, mpz_ptr *mr, mpz_t x) {
+    mpz_ptr primes[RSA_MAX_PRIMES], exponents[RSA_MAX_PRIMES];
+    mont_t *monts[RSA_MAX_PRIMES];
+    uint64_t count = ctx_primes(ctx, primes, monts, exponents);
+    ctx_job_t jobs[RSA_MAX_PRIMES];
+    pthread_t tids[RSA_MAX_PRIMES];
+
+    for (uint64_t k = 0; k < count; k += 1) {
+        jobs[k] = (ctx_job_t) { mr[k], x, exponents[k], primes[k], monts[k], ctx->priv.fast };
+    }
+
+    if (count == 2 || mpz_sizeinbase(ctx->n, 2) < RSA_SPLIT_BITS) {
+        for (uint64_t k = 0; k < count; k += 1) {
+            ctx_job(&jobs[k]);
+        }
+        return;
+    }
+
+    for (uint64_t k = 1; k < count; k += 1) {
+        pthread_create(&tids[k], NULL, ctx_job, &jobs[k]);
+    }
+    ctx_job(&jobs[0]);
+    for (uint64_t k = 1; k < count; k += 1) {
+        pthread_join(tids[k], NULL);
+    }
+    return;
+}
+
+//rsa_crt_check through the montgomery forms of the primes, h is scratch
+static bool ctx_check(rsa_ctx_t *ctx, mpz_t r, mpz_t x, mpz_t h) {
+    rsa_priv_t *key = &ctx->priv;
+    mpz_ptr primes[RSA_MAX_PRIMES], exponents[RSA_MAX_PRIMES];
+    mont_t *monts[RSA_MAX_PRIMES];
+    uint64_t count = ctx_primes(ctx, primes, monts, exponents);
+
+    if (mpz_sgn(key->e) == 0) {
+        return false;
+    }
+    for (uint64_t k = 0; k < count; k += 1) {
+        if (key->fast || mpz_cmp(key->ce[k], key->e) == 0) { //mont_powm reduces r itself
+            mont_powm(monts[k], h, r, key->ce[k]);
+        } else {
+            mpz_mod(h, r, primes[k]);
+            pow_mod_sec(h, h, key->ce[k], primes[k]);
+        }
+        if (!mpz_congruent_p(h, x, primes[k])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//see rsa_decrypt_crt, blinded and constant time unless the key is fast, every temporary is
+//context scratch: scratch[4] holds the blinded input and the residues of extra primes sit in
+//halves, one batch lane apart
+static void ctx_decrypt_crt(rsa_ctx_t *ctx, mpz_t m, mpz_t c) {
+    rsa_priv_t *key = &ctx->priv;
+    mpz_ptr h = ctx->scratch[2], r = ctx->scratch[3], x = ctx->scratch[4], t = ctx->scratch[5];
+    mpz_ptr mr[RSA_MAX_PRIMES] = { ctx->scratch[0], ctx->scratch[1], ctx->halves[2 * MBX_LANES],
+        ctx->halves[3 * MBX_LANES] };
+
+    bool blinded = !key->fast && rsa_blind(&ctx->blind, x, c, key); //x = c * r^e
+    if (!blinded) {
+        mpz_set(x, c);
+    }
+
+    ctx_residues(ctx, mr, x);
+    rsa_crt_combine_multi(r, mr, key, h, t);
+    if (!ctx_check(ctx, r, x, h)) { //bad CRT values or a fault, use the full exponent instead
+        if (key->fast) {
+            mont_powm(&ctx->mont_n, r, x, key->d);
+        } else {
+            pow_mod_sec(r, x, key->d, key->n);
+        }
+    }
+
+    if (blinded) {
+        rsa_unblind(&ctx->blind, r, key);
+    }
+    mpz_set(m, r);
+    return;
+}
+
+void rsa_ctx_decrypt(rsa_ctx_t *ctx, mpz_t m, mpz_t c) {
+    rsa_priv_t *key = &ctx->priv;
+
+    if (key->crt) {
+        ctx_decrypt_crt(ctx, m, c);
+    } else if (key->fast) {
+        mont_powm(&ctx->mont_n, m, c, key->d);
+    } else { //blinded, see rsa_decrypt_crt, scratch[4] holds the blinded input
+        mpz_ptr r = ctx->scratch[3], x = ctx->scratch[4];
+        bool blinded = rsa_blind(&ctx->blind, x, c, key); //x = c * r^e
+        if (!blinded) {
+            mpz_set(x, c);
+        }
+        pow_mod_sec(r, x, key->d, key->n);
+        if (blinded) {
+            rsa_unblind(&ctx->blind, r, key);
+        }
+        mpz_set(m, r);
+    }
+    return;
+}
+
+static bool ctx_mbx(mbx_t *mbx, mpz_t n) { //false when the cpu has no vector kernel
+    return mbx->lanes > 0 || mbx_init(mbx, n);
+}
+
+//c[i] = m[i]^e mod n, c and m may be the same array
+void rsa_ctx_encrypt_batch(rsa_ctx_t *ctx, mpz_ptr *c, mpz_ptr *m, size_t count) {
+    size_t done = 0;
+
+    if (count >= MBX_MIN && ctx_mbx(&ctx->mbx_n, ctx->n)) {
+        done = mbx_powm_many(&ctx->mbx_n, c, m, count, ctx->e);
+    }
+    for (size_t i = done; i < count; i += 1) {
+        rsa_ctx_encrypt(ctx, c[i], m[i]);
+    }
+    return;
+}
+
+//the CRT batch through the vector contexts of every prime, fast keys only, returns how many
+//values were done
+static size_t ctx_decrypt_crt_batch(rsa_ctx_t *ctx, mpz_ptr *m, mpz_ptr *c, size_t count) {
+    rsa_priv_t *key = &ctx->priv;
+    mpz_ptr primes[RSA_MAX_PRIMES], exponents[RSA_MAX_PRIMES];
+    mont_t *monts[RSA_MAX_PRIMES];
+    uint64_t primes_count = ctx_primes(ctx, primes, monts, exponents);
+    mbx_t *mbx[RSA_MAX_PRIMES] = { &ctx->mbx_p, &ctx->mbx_q, &ctx->mbx_r[0], &ctx->mbx_r[1] };
+    size_t done = 0;
+
+    for (uint64_t k = 0; k < primes_count; k += 1) {
+        if (!ctx_mbx(mbx[k], primes[k])) {
+            return 0;
+        }
+    }
+
+    //res[k][j] is lane j modulo prime k, res[0][j] takes the recombined lane and res[1] is
+    //free again for the check after that
+    mpz_ptr res[RSA_MAX_PRIMES][MBX_LANES], mr[RSA_MAX_PRIMES];
+    for (uint64_t k = 0; k < primes_count; k += 1) {
+        for (size_t j = 0; j < MBX_LANES; j += 1) {
+            res[k][j] = ctx->halves[k * MBX_LANES + j];
+        }
+    }
+
+    while (count - done >= MBX_MIN) {
+        size_t group = (count - done < MBX_LANES) ? count - done : MBX_LANES;
+        bool ok[MBX_LANES];
+        for (uint64_t k = 0; k < primes_count; k += 1) { //mbx_powm reduces c itself
+            mbx_powm(mbx[k], res[k], c + done, group, exponents[k]);
+        }
+
+        for (size_t j = 0; j < group; j += 1) {
+            for (uint64_t k = 0; k < primes_count; k += 1) {
+                mr[k] = res[k][j];
+            }
+            rsa_crt_combine_multi(res[0][j], mr, key, ctx->scratch[2], ctx->scratch[5]);
+            ok[j] = (mpz_sgn(key->e) != 0);
+        }
+
+        //ctx_check on all lanes at once, fast keys only get here so ce may run variable time
+        for (uint64_t k = 0; k < primes_count && mpz_sgn(key->e) != 0; k += 1) {
+            mbx_powm(mbx[k], res[1], res[0], group, key->ce[k]);
+            for (size_t j = 0; j < group; j += 1) {
+                ok[j] = ok[j] && mpz_congruent_p(res[1][j], c[done + j], primes[k]);
+            }
+        }
+
+        for (size_t j = 0; j < group; j += 1) {
+            if (ok[j]) {
+                mpz_set(m[done + j], res[0][j]);
+            } else { //bad CRT values or a fault, use the full exponent instead
+                mont_powm(&ctx->mont_n, m[done + j], c[done + j], key->d);
+            }
+        }
+        done += group;
+    }
+    return done;
+}
+
+//m[i] = c[i]^d mod n, m and c may be the same array
+void rsa_ctx_decrypt_batch(rsa_ctx_t *ctx, mpz_ptr *m, mpz_ptr *c, size_t count) {
+    rsa_priv_t *key = &ctx->priv;
+    size_t done = 0;
+
+    if (!key->fast || count < MBX_MIN) { //the vector kernels use variable time windows
+        done = 0;
+    } else if (!key->crt) {
+        if (ctx_mbx(&ctx->mbx_n, ctx->n)) {
+            done = mbx_powm_many(&ctx->mbx_n, m, c, count, key->d);
+        }
+    } else {
+        done = ctx_decrypt_crt_batch(ctx, m, c, count);
+    }
+
+    for (size_t i = done; i < count; i += 1) {
+        rsa_ctx_decrypt(ctx, m[i], c[i]);
+    }
+    return;
+}
+
+void rsa_ctx_sign(rsa_ctx_t *ctx, mpz_t s, mpz_t m) {
+    rsa_ctx_decrypt(ctx, s, m);
+    return;
+}
+
+bool rsa_ctx_verify(rsa_ctx_t *ctx, mpz_t m, mpz_t s) {
+    rsa_ctx_encrypt(ctx, ctx->scratch[0], s);
+    return mpz_cmp(ctx->scratch[0], m) == 0;
+}
+
+bool rsa_ctx_encrypt_file(rsa_ctx_t *ctx, FILE *infile, FILE *outfile, const rsa_opts_t *opts) {
+    rsa_opts_t ctx_opts = *opts;
+    ctx_opts.ctx = ctx; //a single threaded pipeline runs its blocks through this context
+
+    return rsa_encrypt_file_ex(infile, outfile, ctx->n, ctx->e, &ctx_opts);
+}
+
+bool rsa_ctx_decrypt_file(rsa_ctx_t *ctx, FILE *infile, FILE *outfile, const rsa_opts_t *opts) {
+    rsa_opts_t ctx_opts = *opts;
+    ctx_opts.ctx = ctx;
+
+    return rsa_decrypt_file_ex(infile, outfile, &ctx->priv, &ctx_opts);
+}
+
+bool rsa_ctx_decrypt_range(rsa_ctx_t *ctx, FILE *infile, FILE *outfile, uint64_t start,
+    uint64_t len, const rsa_opts_t *opts) {
+    rsa_opts_t ctx_opts = *opts;
+    ctx_opts.ctx = ctx;
+
+    return rsa_decrypt_range(infile, outfile, &ctx->priv, start, len, &ctx_opts);
+}
+
+typedef struct {
+    mpz_t *msgs, *sigs;
+    size_t start, end; //items handled by this thread, start is a multiple of 8
+    mpz_ptr e, n;
+    uint8_t *bitmap; //each thread owns the bytes of its range, so no lock is needed
+} verify_job_t;
+
+static void *verify_job(void *arg) {
+    verify_job_t *job = arg;
+    rsa_ctx_t ctx; //one context per thread, the montgomery data is built once for the batch
+    mpz_t vals[MBX_LANES];
+    mpz_ptr out[MBX_LANES], in[MBX_LANES];
+
+    rsa_ctx_init(&ctx, 0);
+    rsa_ctx_set_pub(&ctx, job->n, job->e);
+    for (size_t j = 0; j < MBX_LANES; j += 1) {
+        mpz_init(vals[j]);
+        out[j] = vals[j];
+    }
+
+    for (size_t i = job->start; i < job->end; i += MBX_LANES) { //s^e through the vector lanes
+        size_t group = (job->end - i < MBX_LANES) ? job->end - i : MBX_LANES;
+        for (size_t j = 0; j < group; j += 1) {
+            in[j] = job->sigs[i + j];
+        }
+        rsa_ctx_encrypt_batch(&ctx, out, in, group);
+
+        for (size_t j = 0; j < group; j += 1) {
+            if (mpz_cmp(out[j], job->msgs[i + j]) == 0) {
+                job->bitmap[(i + j) / 8] |= 1 << ((i + j) % 8);
+            }
+        }
+    }
+
+    for (size_t j = 0; j < MBX_LANES; j += 1) {
+        mpz_clear(vals[j]);
+    }
+    rsa_ctx_clear(&ctx);
+    return NULL;
+}
+
+//sets bit i of bitmap when sigs[i] is a valid signature of msgs[i] under (n, e)
+void rsa_verify_batch(mpz_t *msgs, mpz_t *sigs, size_t count, mpz_t e, mpz_t n, uint64_t threads,
+    uint8_t *bitmap) {
+    size_t bytes = (count + 7) / 8;
+    memset(bitmap, 0, bytes);
+
+    threads = (threads > 0) ? threads : 1;
+    if (threads > bytes) { //ranges are whole bitmap bytes
+        threads = (bytes > 0) ? bytes : 1;
+    }
+
+    verify_job_t *jobs = malloc(threads * sizeof(verify_job_t));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    for (uint64_t t = 0; t < threads; t += 1) { //contiguous byte ranges of nearly equal size
+        size_t start = 8 * (bytes * t / threads), end = 8 * (bytes * (t + 1) / threads);
+        jobs[t] = (verify_job_t) { .msgs = msgs,
+            .sigs = sigs,
+            .start = (start < count) ? start : count,
+            .end = (end < count) ? end : count,
+            .e = e,
+            .n = n,
+            .bitmap = bitmap };
+    }
+
+    for (uint64_t t = 1; t < threads; t += 1) {
+        pthread_create(&tids[t], NULL, verify_job, &jobs[t]);
+    }
+    verify_job(&jobs[0]); //the calling thread takes the first range
+    for (uint64_t t = 1; t < threads; t += 1) {
+        pthread_join(tids[t], NULL);
+    }
+
+    free(jobs);
+    free(tids);
+    return;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+#include "montgomery.h"
+#include "mbx.h"
+#include "rsa.h"
+
+#define RSA_CTX_SCRATCH 6 //preallocated temporaries
+
+//owns a key with its montgomery data, scratch integers and random state, so one context per
+//thread never touches the global state, once the first operation has sized everything a decrypt
+//makes no gmp allocations, except that redrawing the blinding pair every RSA_BLIND_UPDATES
+//operations takes gmp's temporary space from the heap for moduli of about 4000 bits and up
+struct rsa_ctx {
+    mpz_t n, e; //public key
+    rsa_priv_t priv; //private key, priv.n matches n
+    bool has_pub, has_priv;
+    mont_t mont_n, mont_p, mont_q; //montgomery contexts for n and the CRT primes
+    mont_t mont_r[RSA_MAX_PRIMES - 2]; //and for the extra primes of a multi-prime key
+    mbx_t mbx_n, mbx_p, mbx_q; //vector contexts, built by the first batch call that can use them
+    mbx_t mbx_r[RSA_MAX_PRIMES - 2];
+    mpz_t halves[RSA_MAX_PRIMES * MBX_LANES]; //CRT residues of a batch, MBX_LANES per prime
+    mpz_t scratch[RSA_CTX_SCRATCH]; //sized for twice the modulus so they never grow
+    rsa_blind_t blind; //blinding pair for priv.n
+    gmp_randstate_t st;
+};
+
+void rsa_ctx_init(rsa_ctx_t *ctx, uint64_t seed);
+
+void rsa_ctx_clear(rsa_ctx_t *ctx);
+
+void rsa_ctx_set_pub(rsa_ctx_t *ctx, mpz_t n, mpz_t e);
+
+void rsa_ctx_set_priv(rsa_ctx_t *ctx, rsa_priv_t *key);
+
+void rsa_ctx_generate(rsa_ctx_t *ctx, uint64_t nbits, uint64_t iters, uint64_t exponent);
+
+void rsa_ctx_encrypt(rsa_ctx_t *ctx, mpz_t c, mpz_t m);
+
+void rsa_ctx_decrypt(rsa_ctx_t *ctx, mpz_t m, mpz_t c);
+
+void rsa_ctx_encrypt_batch(rsa_ctx_t *ctx, mpz_ptr *c, mpz_ptr *m, size_t count);
+
+void rsa_ctx_decrypt_batch(rsa_ctx_t *ctx, mpz_ptr *m, mpz_ptr *c, size_t count);
+
+void rsa_ctx_sign(rsa_ctx_t *ctx, mpz_t s, mpz_t m);
+
+bool rsa_ctx_verify(rsa_ctx_t *ctx, mpz_t m, mpz_t s);
+
+bool rsa_ctx_encrypt_file(rsa_ctx_t *ctx, FILE *infile, FILE *outfile, const rsa_opts_t *opts);
+
+bool rsa_ctx_decrypt_file(rsa_ctx_t *ctx, FILE *infile, FILE *outfile, const rsa_opts_t *opts);
+
+bool rsa_ctx_decrypt_range(rsa_ctx_t *ctx, FILE *infile, FILE *outfile, uint64_t start,
+    uint64_t len, const rsa_opts_t *opts);
+
+void rsa_verify_batch(mpz_t *msgs, mpz_t *sigs, size_t count, mpz_t e, mpz_t n, uint64_t threads,
+    uint8_t *bitmap);
@@ -0,0 +1,821 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <gmp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#include "rsa.h"
+#include "rsactx.h"
+#include "keyfile.h"
+#include "protocol.h"
+
+#define OPTIONS "hvfs:k:t:b:q:"
+
+#define MAX_KEYS 256 //the key index in a frame is one byte
+#define MAX_EVENTS 64
+#define READ_CHUNK (64 * 1024) //room made in a connection's input buffer before each read
+#define OUT_LIMIT (1 << 20) //unsent response bytes before a connection stops being read
+
+typedef struct conn {
+    int fd;
+    uint8_t *in; //bytes received but not parsed into requests yet
+    size_t in_len, in_cap;
+    uint8_t *out; //responses waiting for the socket
+    size_t out_pos, out_len, out_cap;
+    uint64_t inflight; //requests with the workers
+    uint32_t events; //epoll interest currently registered
+    bool closed; //socket is gone, freed once the workers hand back its last request and the
+                 //current round of events is over, so no event can point at freed memory
+    bool dirty; //on the list of connections to flush after a round of completions
+    struct conn *prev, *next; //every open or draining connection
+    struct conn *dirty_next;
+} conn_t;
+
+typedef struct job {
+    conn_t *conn;
+    proto_header_t header; //request header, code turns into the status
+    uint8_t op;
+    mpz_t a, b; //operands, a holds the result
+    bool queued; //checked and waiting for the rest of its group
+    struct job *next;
+} job_t;
+
+typedef struct {
+    job_t *head, *tail;
+    uint64_t len;
+} job_list_t;
+
+typedef struct {
+    int epfd, listenfd, eventfd, signalfd;
+    rsa_ctx_t keys[MAX_KEYS]; //loaded once, every worker copies them into its own contexts
+    size_t nkeys;
+    uint64_t batch; //requests a worker takes at once
+    uint64_t depth; //requests in flight per connection before it stops being read
+    job_list_t todo; //parsed requests for the workers
+    pthread_mutex_t todo_lock;
+    pthread_cond_t todo_ready;
+    bool stop;
+    job_list_t done; //answered requests for the event loop
+    pthread_mutex_t done_lock;
+    job_t *spare; //recycled jobs, only touched by the event loop
+    conn_t *conns;
+    uint64_t closing; //closed connections not freed yet
+    uint64_t served;
+} server_t;
+
+typedef struct {
+    server_t *server;
+    rsa_ctx_t *ctx; //one context per key, contexts are never shared between threads
+    job_t **group; //jobs of one group and their operands, room for a whole batch
+    mpz_ptr *a, *b;
+} worker_t;
+
+static int listen_mark, event_mark, signal_mark; //epoll data for the fds that are not connections
+
+void program_usage(void) { //prints help message
+    fprintf(stderr, "SYNOPSIS\n");
+    fprintf(stderr, "   Serves RSA encrypt, decrypt, sign and verify requests over a Unix socket.\n");
+    fprintf(stderr, "   Keys are loaded once, rsac is the matching client.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "USAGE\n");
+    fprintf(stderr, "   ./rsad [-hvf] [-s socket] [-t threads] [-b batch] [-q depth] -k pbfile:pvfile ...\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "   -h              Display program help and usage.\n");
+    fprintf(stderr, "   -v              Display verbose program output.\n");
+    fprintf(stderr, "   -f              Fast variable time private key operations, their timing\n");
+    fprintf(stderr, "                   leaks the private key, only for hosts nobody else shares.\n");
+    fprintf(stderr, "   -s socket       Unix socket path (default: %s).\n", PROTO_SOCKET);
+    fprintf(stderr, "   -k keys         Public and private key files, either may be left out as in\n");
+    fprintf(stderr, "                   rsa.pub or :rsa.priv. Repeat for more keys, numbered from 0.\n");
+    fprintf(stderr, "   -t threads      Worker threads (default: 1).\n");
+    fprintf(stderr, "   -b batch        Requests a worker takes at once (default: 16).\n");
+    fprintf(stderr, "   -q depth        Requests in flight per connection before reading pauses\n");
+    fprintf(stderr, "                   (default: 64).\n");
+}
+
+static void list_push(job_list_t *list, job_t *job) {
+    job->next = NULL;
+    if (list->tail != NULL) {
+        list->tail->next = job;
+    } else {
+        list->head = job;
+    }
+    list->tail = job;
+    list->len += 1;
+    return;
+}
+
+static void list_append(job_list_t *list, job_list_t *more) { //moves every job of more to list
+    if (more->head == NULL) {
+        return;
+    }
+    if (list->tail != NULL) {
+        list->tail->next = more->head;
+    } else {
+        list->head = more->head;
+    }
+    list->tail = more->tail;
+    list->len += more->len;
+    *more = (job_list_t) { 0 };
+    return;
+}
+
+static job_list_t list_take(job_list_t *list, uint64_t count) { //up to count jobs from the front
+    job_list_t taken = { .head = list->head };
+
+    job_t *last = NULL;
+    for (job_t *job = list->head; job != NULL && taken.len < count; job = job->next) {
+        last = job;
+        taken.len += 1;
+    }
+    if (last != NULL) {
+        list->head = last->next;
+        last->next = NULL;
+        taken.tail = last;
+        list->len -= taken.len;
+        if (list->head == NULL) {
+            list->tail = NULL;
+        }
+    }
+    return taken;
+}
+
+//false when the job is answered without running, with the status already in its header
+static bool check_job(worker_t *worker, job_t *job) {
+    server_t *server = worker->server;
+    proto_header_t *header = &job->header;
+
+    if (header->key >= server->nkeys) {
+        header->code = STATUS_NO_KEY;
+        return false;
+    }
+
+    rsa_ctx_t *ctx = &worker->ctx[header->key];
+    bool public = job->op == OP_ENCRYPT || job->op == OP_VERIFY;
+    if ((public && !ctx->has_pub) || (!public && !ctx->has_priv)) {
+        header->code = STATUS_NO_KEY;
+        return false;
+    }
+    if (mpz_cmp(job->a, ctx->n) >= 0 || mpz_cmp(job->b, ctx->n) >= 0) { //values have to be residues
+        header->code = STATUS_BAD_REQUEST;
+        return false;
+    }
+
+    header->code = STATUS_OK;
+    return true;
+}
+
+//runs count jobs that share a key and an operation through the batch kernels, so requests from
+//any connection fill the vector lanes together
+static void run_group(worker_t *worker, size_t count) {
+    job_t **group = worker->group;
+    rsa_ctx_t *ctx = &worker->ctx[group[0]->header.key];
+    mpz_ptr *a = worker->a, *b = worker->b;
+
+    switch (group[0]->op) {
+    case OP_ENCRYPT: rsa_ctx_encrypt_batch(ctx, a, a, count); break;
+    case OP_DECRYPT:
+    case OP_SIGN: rsa_ctx_decrypt_batch(ctx, a, a, count); break; //the same private key operation
+    case OP_VERIFY:
+        rsa_ctx_encrypt_batch(ctx, b, b, count); //b = s^e, the signature is not sent back
+        for (size_t i = 0; i < count; i += 1) {
+            if (mpz_cmp(a[i], b[i]) != 0) {
+                group[i]->header.code = STATUS_INVALID;
+            }
+        }
+        break;
+    }
+    return;
+}
+
+//checks every job of a batch, then runs the jobs that passed in groups of the same key and
+//operation, in the order their first job arrived
+static void run_batch(worker_t *worker, job_list_t *batch) {
+    for (job_t *job = batch->head; job != NULL; job = job->next) {
+        job->queued = check_job(worker, job);
+    }
+
+    for (job_t *first = batch->head; first != NULL; first = first->next) {
+        if (!first->queued) {
+            continue;
+        }
+        size_t count = 0;
+        for (job_t *job = first; job != NULL; job = job->next) {
+            if (job->queued && job->op == first->op && job->header.key == first->header.key) {
+                worker->group[count] = job;
+                worker->a[count] = job->a;
+                worker->b[count] = job->b;
+                job->queued = false;
+                count += 1;
+            }
+        }
+        run_group(worker, count);
+    }
+    return;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *worker = arg;
+    server_t *server = worker->server;
+
+    for (;;) {
+        pthread_mutex_lock(&server->todo_lock);
+        while (server->todo.head == NULL && !server->stop) {
+            pthread_cond_wait(&server->todo_ready, &server->todo_lock);
+        }
+        if (server->todo.head == NULL) { //stopping and nothing left to answer
+            pthread_mutex_unlock(&server->todo_lock);
+            break;
+        }
+        job_list_t batch = list_take(&server->todo, server->batch);
+        pthread_mutex_unlock(&server->todo_lock);
+
+        run_batch(worker, &batch);
+
+        pthread_mutex_lock(&server->done_lock); //one hand off and one wake up per batch
+        list_append(&server->done, &batch);
+        pthread_mutex_unlock(&server->done_lock);
+
+        uint64_t one = 1;
+        if (write(server->eventfd, &one, sizeof(one)) != sizeof(one)) {
+            perror("Error");
+        }
+    }
+    return NULL;
+}
+
+static job_t *job_get(server_t *server) {
+    job_t *job = server->spare;
+
+    if (job != NULL) {
+        server->spare = job->next;
+        return job;
+    }
+    job = malloc(sizeof(job_t));
+    mpz_inits(job->a, job->b, NULL);
+    return job;
+}
+
+static void job_put(server_t *server, job_t *job) { //keeps the integers and their limbs for reuse
+    job->next = server->spare;
+    server->spare = job;
+    return;
+}
+
+static void conn_free(server_t *server, conn_t *conn) {
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        server->conns = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+    return;
+}
+
+static void conn_close(server_t *server, conn_t *conn) {
+    epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->closed = true;
+    server->closing += 1;
+    return;
+}
+
+static void conn_sweep(server_t *server) { //frees closed connections the workers are done with
+    for (conn_t *conn = server->conns, *next; server->closing > 0 && conn != NULL; conn = next) {
+        next = conn->next;
+        if (conn->closed && conn->inflight == 0) {
+            conn_free(server, conn);
+            server->closing -= 1;
+        }
+    }
+    return;
+}
+
+static void conn_update(server_t *server, conn_t *conn) { //reading pauses while the client is behind
+    uint32_t events = 0;
+
+    if (conn->inflight < server->depth && conn->out_len - conn->out_pos < OUT_LIMIT) {
+        events |= EPOLLIN;
+    }
+    if (conn->out_pos < conn->out_len) {
+        events |= EPOLLOUT;
+    }
+    if (events != conn->events) {
+        struct epoll_event ev = { .events = events, .data.ptr = conn };
+        epoll_ctl(server->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->events = events;
+    }
+    return;
+}
+
+static bool conn_flush(server_t *server, conn_t *conn) { //false when the connection was closed
+    while (conn->out_pos < conn->out_len) {
+        ssize_t n = send(conn->fd, &conn->out[conn->out_pos], conn->out_len - conn->out_pos,
+            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n <= 0) {
+            conn_close(server, conn);
+            return false;
+        }
+        conn->out_pos += n;
+    }
+    conn->out_pos = 0;
+    conn->out_len = 0;
+    return true;
+}
+
+static void respond(conn_t *conn, proto_header_t *header, mpz_t result) { //result may be NULL
+    size_t len = (result != NULL) ? proto_mpz_size(result) : 0;
+
+    if (conn->out_len + PROTO_HEADER + len > conn->out_cap) {
+        conn->out_cap = 2 * (conn->out_len + PROTO_HEADER + len);
+        conn->out = realloc(conn->out, conn->out_cap);
+    }
+    header->len = len;
+    proto_put_header(&conn->out[conn->out_len], header);
+    if (result != NULL) {
+        proto_put_mpz(&conn->out[conn->out_len + PROTO_HEADER], result);
+    }
+    conn->out_len += PROTO_HEADER + len;
+    return;
+}
+
+//turns complete frames into jobs until the connection has depth requests in flight
+static bool conn_parse(server_t *server, conn_t *conn, job_list_t *batch) {
+    size_t pos = 0;
+
+    while (conn->inflight < server->depth && conn->in_len - pos >= PROTO_HEADER) {
+        proto_header_t header;
+        proto_get_header(&conn->in[pos], &header);
+        if (header.len > PROTO_MAX_PAYLOAD || header.code < OP_ENCRYPT || header.code > OP_VERIFY) {
+            conn_close(server, conn); //not speaking the protocol, nothing sensible to answer
+            return false;
+        }
+        if (conn->in_len - pos - PROTO_HEADER < header.len) {
+            break;
+        }
+
+        const uint8_t *payload = &conn->in[pos + PROTO_HEADER];
+        job_t *job = job_get(server);
+        size_t used = 0, more = 0;
+        bool valid = proto_get_mpz(job->a, payload, header.len, &used);
+        mpz_set_ui(job->b, 0);
+        if (valid && header.code == OP_VERIFY) {
+            valid = proto_get_mpz(job->b, &payload[used], header.len - used, &more);
+        }
+        pos += PROTO_HEADER + header.len;
+
+        if (!valid || used + more != header.len) { //answered here, the workers never see it
+            header.code = STATUS_BAD_REQUEST;
+            respond(conn, &header, NULL);
+            job_put(server, job);
+            continue;
+        }
+
+        job->conn = conn;
+        job->header = header;
+        job->op = header.code;
+        conn->inflight += 1;
+        list_push(batch, job);
+    }
+
+    memmove(conn->in, &conn->in[pos], conn->in_len - pos);
+    conn->in_len -= pos;
+    return true;
+}
+
+static void submit(server_t *server, job_list_t *batch) {
+    if (batch->head == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&server->todo_lock);
+    list_append(&server->todo, batch);
+    pthread_cond_broadcast(&server->todo_ready);
+    pthread_mutex_unlock(&server->todo_lock);
+    return;
+}
+
+static void conn_read(server_t *server, conn_t *conn) {
+    job_list_t batch = { 0 };
+
+    for (;;) {
+        if (conn->in_cap - conn->in_len < READ_CHUNK) {
+            conn->in_cap = conn->in_len + 2 * READ_CHUNK;
+            conn->in = realloc(conn->in, conn->in_cap);
+        }
+        ssize_t n = recv(conn->fd, &conn->in[conn->in_len], conn->in_cap - conn->in_len, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) { //the client hung up, answers still with the workers are dropped
+            submit(server, &batch);
+            conn_close(server, conn);
+            return;
+        }
+        conn->in_len += n;
+        if (!conn_parse(server, conn, &batch)) {
+            submit(server, &batch);
+            return;
+        }
+        if (conn->inflight >= server->depth) { //the rest waits in the socket buffer
+            break;
+        }
+    }
+
+    submit(server, &batch);
+    if (conn_flush(server, conn)) { //malformed requests may have been answered already
+        conn_update(server, conn);
+    }
+    return;
+}
+
+static void conn_accept(server_t *server) {
+    for (;;) {
+        int fd = accept(server->listenfd, NULL, NULL);
+        if (fd < 0) {
+            return;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        conn_t *conn = calloc(1, sizeof(conn_t));
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        conn->next = server->conns;
+        if (server->conns != NULL) {
+            server->conns->prev = conn;
+        }
+        server->conns = conn;
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+        epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void complete(server_t *server) { //hands answered requests back to their connections
+    uint64_t count;
+    if (read(server->eventfd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+
+    pthread_mutex_lock(&server->done_lock);
+    job_list_t done = server->done;
+    server->done = (job_list_t) { 0 };
+    pthread_mutex_unlock(&server->done_lock);
+
+    conn_t *dirty = NULL;
+    for (job_t *job = done.head, *next; job != NULL; job = next) {
+        next = job->next;
+        conn_t *conn = job->conn;
+        conn->inflight -= 1;
+        server->served += 1;
+
+        if (!conn->closed) {
+            bool result = job->header.code == STATUS_OK && job->op != OP_VERIFY;
+            respond(conn, &job->header, result ? job->a : NULL);
+            if (!conn->dirty) {
+                conn->dirty = true;
+                conn->dirty_next = dirty;
+                dirty = conn;
+            }
+        }
+        job_put(server, job);
+    }
+
+    job_list_t batch = { 0 };
+    for (conn_t *conn = dirty, *next; conn != NULL; conn = next) {
+        next = conn->dirty_next;
+        conn->dirty = false;
+        if (!conn_flush(server, conn)) {
+            continue;
+        }
+        if (conn_parse(server, conn, &batch)) { //requests held back while the connection was full
+            conn_update(server, conn);
+        }
+    }
+    submit(server, &batch);
+    return;
+}
+
+static bool load_key(rsa_ctx_t *ctx, char *spec) { //spec is pbfile, pbfile:pvfile or :pvfile
+    char *pubname = spec;
+    char *privname = "";
+    char *colon = strchr(spec, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        privname = colon + 1;
+    }
+
+    rsa_ctx_init(ctx, 0);
+
+    if (*privname != '\0') {
+        FILE *pvfile = fopen(privname, "r");
+        if (!pvfile) {
+            perror("Error");
+            return false;
+        }
+        bool ok = true;
+        if (keyfile_detect(pvfile)) {
+            ok = keyfile_read_priv(ctx, pvfile);
+        } else {
+            rsa_priv_t key;
+            rsa_priv_init(&key);
+            rsa_read_priv_crt(&key, pvfile);
+            rsa_ctx_set_priv(ctx, &key);
+            rsa_priv_clear(&key);
+        }
+        fclose(pvfile);
+        if (!ok) {
+            fprintf(stderr, "Error: invalid compiled key %s.\n", privname);
+            return false;
+        }
+    }
+
+    if (*pubname != '\0') {
+        FILE *pbfile = fopen(pubname, "r");
+        if (!pbfile) {
+            perror("Error");
+            return false;
+        }
+
+        mpz_t n, e, s, str;
+        mpz_inits(n, e, s, str, NULL);
+        char username[_POSIX_LOGIN_NAME_MAX];
+        bool verified = false, ok = true;
+
+        if (keyfile_detect(pbfile)) {
+            rsa_ctx_t pub;
+            rsa_ctx_init(&pub, 0);
+            ok = keyfile_read_pub(&pub, pbfile, s, username, sizeof(username), &verified);
+            mpz_set(n, pub.n);
+            mpz_set(e, pub.e);
+            rsa_ctx_clear(&pub);
+        } else {
+            rsa_read_pub(n, e, s, username, pbfile);
+        }
+        fclose(pbfile);
+
+        mpz_set_str(str, username, 62); //the check encrypt runs, once for the life of the server
+        ok = ok && (verified || rsa_verify(str, s, e, n));
+        ok = ok && (!ctx->has_priv || mpz_cmp(n, ctx->n) == 0);
+        if (ok && ctx->has_priv) { //same pattern as rsa_ctx_generate, keep the private half
+            mpz_set(ctx->e, e);
+            ctx->has_pub = true;
+        } else if (ok) {
+            rsa_ctx_set_pub(ctx, n, e);
+        } else {
+            fprintf(stderr, "Error: invalid key %s.\n", pubname);
+        }
+        mpz_clears(n, e, s, str, NULL);
+        return ok;
+    }
+    return ctx->has_priv;
+}
+
+static void copy_key(rsa_ctx_t *dst, rsa_ctx_t *src) { //a worker's own context for a loaded key
+    rsa_ctx_init(dst, 0);
+    if (src->has_priv) {
+        rsa_ctx_set_priv(dst, &src->priv);
+        if (src->has_pub) {
+            mpz_set(dst->e, src->e);
+            dst->has_pub = true;
+        }
+    } else if (src->has_pub) {
+        rsa_ctx_set_pub(dst, src->n, src->e);
+    }
+    return;
+}
+
+static int open_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long.\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct stat st; //only a socket left behind by an earlier run goes, anything else fails bind
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        perror("Error");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+
+    int opt = 0;
+    bool test_v = false;
+    bool fast = false; //private keys blinded and constant time unless -f
+    char *path = PROTO_SOCKET;
+    char *specs[MAX_KEYS];
+    size_t nspecs = 0;
+    uint64_t threads = 1;
+    server_t server = { .batch = 16, .depth = 64 };
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': program_usage(); exit(0);
+        case 'v': test_v = true; break;
+        case 'f': fast = true; break; //variable time private key operations
+        case 's': path = optarg; break; //socket path
+        case 'k':
+            if (nspecs == MAX_KEYS) {
+                fprintf(stderr, "Error: at most %d keys.\n", MAX_KEYS);
+                exit(1);
+            }
+            specs[nspecs] = optarg;
+            nspecs += 1;
+            break;
+        case 't': threads = strtoull(optarg, NULL, 10); break; //worker threads
+        case 'b': server.batch = strtoull(optarg, NULL, 10); break; //requests per worker hand off
+        case 'q': server.depth = strtoull(optarg, NULL, 10); break; //in flight per connection
+        default: program_usage(); exit(1);
+        }
+    }
+
+    threads = (threads > 0) ? threads : 1;
+    server.batch = (server.batch > 0) ? server.batch : 1;
+    server.depth = (server.depth > 0) ? server.depth : 1;
+    if (nspecs == 0) {
+        specs[0] = "rsa.pub:rsa.priv";
+        nspecs = 1;
+    }
+
+    for (; server.nkeys < nspecs; server.nkeys += 1) {
+        if (!load_key(&server.keys[server.nkeys], specs[server.nkeys])) {
+            rsa_ctx_clear(&server.keys[server.nkeys]);
+            for (size_t k = 0; k < server.nkeys; k += 1) {
+                rsa_ctx_clear(&server.keys[k]);
+            }
+            exit(1);
+        }
+        server.keys[server.nkeys].priv.fast = fast; //workers copy it with the key
+    }
+
+    //signals arrive through a descriptor in the event loop, workers inherit the mask
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    server.listenfd = open_socket(path);
+    if (server.listenfd < 0) {
+        exit(1);
+    }
+    server.epfd = epoll_create1(EPOLL_CLOEXEC);
+    server.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server.signalfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_mark };
+    epoll_ctl(server.epfd, EPOLL_CTL_ADD, server.listenfd, &ev);
+    ev.data.ptr = &event_mark;
+    epoll_ctl(server.epfd, EPOLL_CTL_ADD, server.eventfd, &ev);
+    ev.data.ptr = &signal_mark;
+    epoll_ctl(server.epfd, EPOLL_CTL_ADD, server.signalfd, &ev);
+
+    pthread_mutex_init(&server.todo_lock, NULL);
+    pthread_cond_init(&server.todo_ready, NULL);
+    pthread_mutex_init(&server.done_lock, NULL);
+
+    worker_t *workers = malloc(threads * sizeof(worker_t));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    for (uint64_t i = 0; i < threads; i += 1) {
+        workers[i].server = &server;
+        workers[i].ctx = malloc(server.nkeys * sizeof(rsa_ctx_t));
+        workers[i].group = malloc(server.batch * sizeof(job_t *));
+        workers[i].a = malloc(server.batch * sizeof(mpz_ptr));
+        workers[i].b = malloc(server.batch * sizeof(mpz_ptr));
+        for (size_t k = 0; k < server.nkeys; k += 1) {
+            copy_key(&workers[i].ctx[k], &server.keys[k]);
+        }
+        pthread_create(&tids[i], NULL, worker_main, &workers[i]);
+    }
+
+    if (test_v) {
+        fprintf(stderr, "listening on %s with %zu keys and %lu workers\n", path, server.nkeys,
+            (unsigned long) threads);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    bool running = true;
+    while (running) {
+        int count = epoll_wait(server.epfd, events, MAX_EVENTS, -1);
+        if (count < 0 && errno != EINTR) {
+            perror("Error");
+            break;
+        }
+
+        for (int i = 0; i < count; i += 1) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &listen_mark) {
+                conn_accept(&server);
+            } else if (ptr == &event_mark) {
+                complete(&server);
+            } else if (ptr == &signal_mark) {
+                running = false;
+            } else {
+                conn_t *conn = ptr;
+                if (conn->closed) { //closed earlier in this round, waiting for the workers
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    if (!conn_flush(&server, conn)) {
+                        continue;
+                    }
+                    conn_update(&server, conn);
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    conn_read(&server, conn);
+                }
+            }
+        }
+        conn_sweep(&server);
+    }
+
+    //let the workers finish what they hold, then drop every connection
+    pthread_mutex_lock(&server.todo_lock);
+    server.stop = true;
+    pthread_cond_broadcast(&server.todo_ready);
+    pthread_mutex_unlock(&server.todo_lock);
+    for (uint64_t i = 0; i < threads; i += 1) {
+        pthread_join(tids[i], NULL);
+        for (size_t k = 0; k < server.nkeys; k += 1) {
+            rsa_ctx_clear(&workers[i].ctx[k]);
+        }
+        free(workers[i].ctx);
+        free(workers[i].group);
+        free(workers[i].a);
+        free(workers[i].b);
+    }
+
+    job_list_t done = server.done;
+    for (job_t *job = done.head, *next; job != NULL; job = next) {
+        next = job->next;
+        job_put(&server, job);
+    }
+    while (server.conns != NULL) {
+        conn_t *conn = server.conns;
+        if (!conn->closed) {
+            close(conn->fd);
+        }
+        conn_free(&server, conn);
+    }
+    for (job_t *job = server.spare, *next; job != NULL; job = next) {
+        next = job->next;
+        mpz_clears(job->a, job->b, NULL);
+        free(job);
+    }
+
+    if (test_v) {
+        fprintf(stderr, "served %lu requests\n", (unsigned long) server.served);
+    }
+
+    for (size_t k = 0; k < server.nkeys; k += 1) {
+        rsa_ctx_clear(&server.keys[k]);
+    }
+    free(workers);
+    free(tids);
+    close(server.epfd);
+    close(server.eventfd);
+    close(server.signalfd);
+    close(server.listenfd);
+    unlink(path);
+    pthread_mutex_destroy(&server.todo_lock);
+    pthread_cond_destroy(&server.todo_ready);
+    pthread_mutex_destroy(&server.done_lock);
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "stats.h"
+
+bool stats_enabled = false;
+_Atomic uint64_t stats_counters[STAT_COUNTERS];
+_Atomic uint64_t stats_timers[STAT_TIMERS];
+
+static bool stats_json = false; //report format picked by --stats=json
+
+static const char *counter_names[STAT_COUNTERS] = {
+    [STAT_POW_MOD] = "pow_mod_calls",
+    [STAT_IS_PRIME] = "is_prime_calls",
+    [STAT_MR_ROUNDS] = "mr_rounds",
+    [STAT_TRIAL_REJECTED] = "trial_rejected",
+    [STAT_LUCAS_TESTS] = "lucas_tests",
+    [STAT_PRIME_SIEVED] = "make_prime_sieved",
+    [STAT_PRIME_TESTED] = "make_prime_tested",
+    [STAT_PRIME_REJECTED] = "make_prime_rejected",
+    [STAT_BLOCKS_IMPORTED] = "blocks_imported",
+    [STAT_BLOCKS_EXPORTED] = "blocks_exported",
+    [STAT_BYTES_READ] = "bytes_read",
+    [STAT_BYTES_WRITTEN] = "bytes_written",
+    [STAT_ARENA_ALLOCS] = "arena_allocs",
+    [STAT_ARENA_REFILLS] = "arena_refills",
+    [STAT_ARENA_LARGE] = "arena_large",
+    [STAT_ARENA_CHUNK_BYTES] = "arena_chunk_bytes",
+    [STAT_ARENA_PEAK] = "arena_peak_bytes",
+    [STAT_ARENA_BLOCK_PEAK] = "arena_block_peak_bytes",
+};
+
+static const char *timer_names[STAT_TIMERS] = {
+    [TIMER_POW_MOD] = "pow_mod",
+    [TIMER_IS_PRIME] = "is_prime",
+    [TIMER_MAKE_PRIME] = "make_prime",
+    [TIMER_IMPORT] = "import",
+    [TIMER_EXPORT] = "export",
+    [TIMER_READ] = "read",
+    [TIMER_WRITE] = "write",
+};
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool stats_parse(const char *arg) { //NULL or "text" for the table, "json" for one object
+    if (arg == NULL || strcmp(arg, "text") == 0) {
+        stats_json = false;
+    } else if (strcmp(arg, "json") == 0) {
+        stats_json = true;
+    } else {
+        return false;
+    }
+    stats_enabled = true;
+    return true;
+}
+
+void stats_report(FILE *out) {
+    if (!stats_enabled) {
+        return;
+    }
+
+    if (stats_json) {
+        fprintf(out, "{\"counters\": {");
+        for (int i = 0; i < STAT_COUNTERS; i += 1) {
+            fprintf(out, "%s\"%s\": %lu", (i > 0) ? ", " : "", counter_names[i],
+                (unsigned long) atomic_load(&stats_counters[i]));
+        }
+        fprintf(out, "}, \"timers_ms\": {");
+        for (int i = 0; i < STAT_TIMERS; i += 1) {
+            fprintf(out, "%s\"%s\": %.3f", (i > 0) ? ", " : "", timer_names[i],
+                atomic_load(&stats_timers[i]) / 1e6);
+        }
+        fprintf(out, "}}\n");
+        return;
+    }
+
+    fprintf(out, "%-24s %16s\n", "counter", "value");
+    for (int i = 0; i < STAT_COUNTERS; i += 1) {
+        fprintf(out, "%-24s %16lu\n", counter_names[i], (unsigned long) atomic_load(&stats_counters[i]));
+    }
+    //timers nest, is_prime includes its pow_mod calls, and add up over worker threads
+    fprintf(out, "%-24s %16s\n", "timer", "ms");
+    for (int i = 0; i < STAT_TIMERS; i += 1) {
+        fprintf(out, "%-24s %16.3f\n", timer_names[i], atomic_load(&stats_timers[i]) / 1e6);
+    }
+    return;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+typedef enum {
+    STAT_POW_MOD, //modular exponentiations
+    STAT_IS_PRIME, //primality tests
+    STAT_MR_ROUNDS, //Miller-Rabin rounds run
+    STAT_TRIAL_REJECTED, //is_prime candidates with a small factor
+    STAT_LUCAS_TESTS, //strong Lucas tests run
+    STAT_PRIME_SIEVED, //make_prime candidates removed by the sieve
+    STAT_PRIME_TESTED, //make_prime candidates given to is_prime
+    STAT_PRIME_REJECTED, //make_prime candidates is_prime turned down
+    STAT_BLOCKS_IMPORTED, //blocks converted from bytes or hex to integers
+    STAT_BLOCKS_EXPORTED, //blocks converted from integers to bytes or hex
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_ARENA_ALLOCS, //gmp allocations served by the arenas
+    STAT_ARENA_REFILLS, //chunks the arenas took from malloc
+    STAT_ARENA_LARGE, //allocations too large for the arenas
+    STAT_ARENA_CHUNK_BYTES, //bytes of those chunks
+    STAT_ARENA_PEAK, //most bytes one thread held at once, a maximum and not a sum
+    STAT_ARENA_BLOCK_PEAK, //most bytes one block of work added, also a maximum
+    STAT_COUNTERS
+} stat_counter_t;
+
+typedef enum {
+    TIMER_POW_MOD,
+    TIMER_IS_PRIME,
+    TIMER_MAKE_PRIME,
+    TIMER_IMPORT,
+    TIMER_EXPORT,
+    TIMER_READ,
+    TIMER_WRITE,
+    STAT_TIMERS
+} stat_timer_t;
+
+//build with -DNO_STATS to compile every probe out, otherwise a disabled probe is one branch
+#ifdef NO_STATS
+#define STATS_ON false
+#else
+#define STATS_ON stats_enabled
+#endif
+
+extern bool stats_enabled;
+extern _Atomic uint64_t stats_counters[STAT_COUNTERS];
+extern _Atomic uint64_t stats_timers[STAT_TIMERS]; //nanoseconds, summed over threads
+
+uint64_t stats_now(void);
+
+static inline void stats_add(stat_counter_t counter, uint64_t n) {
+    if (STATS_ON) {
+        atomic_fetch_add_explicit(&stats_counters[counter], n, memory_order_relaxed);
+    }
+    return;
+}
+
+static inline void stats_max(stat_counter_t counter, uint64_t n) { //for the peak counters
+    if (STATS_ON) {
+        uint64_t old = atomic_load_explicit(&stats_counters[counter], memory_order_relaxed);
+        while (old < n && !atomic_compare_exchange_weak_explicit(&stats_counters[counter], &old, n,
+                              memory_order_relaxed, memory_order_relaxed)) {
+        }
+    }
+    return;
+}
+
+static inline uint64_t stats_start(void) { //returns 0 while disabled so no clock is read
+    return STATS_ON ? stats_now() : 0;
+}
+
+static inline void stats_stop(stat_timer_t timer, uint64_t start) {
+    if (STATS_ON) {
+        atomic_fetch_add_explicit(&stats_timers[timer], stats_now() - start, memory_order_relaxed);
+    }
+    return;
+}
+
+bool stats_parse(const char *arg);
+
+void stats_report(FILE *out);
@@ -0,0 +1,130 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <gmp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <limits.h>
+
+#include "randstate.h"
+#include "rsa.h"
+#include "numtheory.h"
+#include "rsactx.h"
+
+#define OPTIONS "hvi:o:n:t:"
+
+#define MESSAGE_MAX 1024 //longest message accepted in the list
+
+void program_usage(void) { //prints help message
+    fprintf(stderr, "SYNOPSIS\n");
+    fprintf(stderr, "   Verifies a batch of RSA signatures under one public key.\n");
+    fprintf(stderr, "   Each input line holds a message and its signature in hex, the message\n");
+    fprintf(stderr, "   is read the same way keygen reads the username it signs.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "USAGE\n");
+    fprintf(stderr, "   ./verify [-hv] [-t threads] [-i infile] [-o outfile] -n pubkey\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "   -h              Display program help and usage.\n");
+    fprintf(stderr, "   -v              Display verbose program output.\n");
+    fprintf(stderr, "   -t threads      Threads verifying signatures (default: 1).\n");
+    fprintf(stderr, "   -i infile       List of message and signature pairs (default: stdin).\n");
+    fprintf(stderr, "   -o outfile      Output file for the per item results (default: stdout).\n");
+    fprintf(stderr, "   -n pbfile       Public key file (default: rsa.pub).\n");
+}
+
+int main(int argc, char **argv) {
+
+    int opt = 0;
+    bool test_v = false;
+    bool openpubfile = false;
+    uint64_t threads = 1;
+    FILE *infile = stdin;
+    FILE *outfile = stdout;
+    FILE *pbfile; //public file
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': program_usage(); exit(0);
+        case 'v': test_v = true; break;
+        case 't': threads = strtoull(optarg, NULL, 10); break; //verification threads
+        case 'i': infile = fopen(optarg, "r"); break;
+        case 'o': outfile = fopen(optarg, "w"); break;
+        case 'n':
+            pbfile = fopen(optarg, "r");
+            openpubfile = true;
+            break;
+        default: program_usage(); exit(1);
+        }
+    }
+
+    if (openpubfile == false) {
+        pbfile = fopen("rsa.pub", "r");
+    }
+
+    //print error message and quits the program
+    if (!pbfile || !infile || !outfile) {
+        perror("Error");
+        return 1;
+    }
+
+    mpz_t n, e, s;
+    mpz_inits(n, e, s, NULL);
+    char username[_POSIX_LOGIN_NAME_MAX]; //owner of the key, unused here
+
+    rsa_read_pub(n, e, s, username, pbfile); //reads file and stores variable to mpz values
+
+    size_t cap = 64;
+    size_t count = 0;
+    char (*names)[MESSAGE_MAX] = malloc(cap * MESSAGE_MAX);
+    mpz_t *msgs = malloc(cap * sizeof(mpz_t));
+    mpz_t *sigs = malloc(cap * sizeof(mpz_t));
+
+    for (;;) { //read every pair before verifying so the batch can be split across threads
+        if (count == cap) {
+            cap *= 2;
+            names = realloc(names, cap * MESSAGE_MAX);
+            msgs = realloc(msgs, cap * sizeof(mpz_t));
+            sigs = realloc(sigs, cap * sizeof(mpz_t));
+        }
+        mpz_inits(msgs[count], sigs[count], NULL);
+        if (gmp_fscanf(infile, "%1023s %Zx", names[count], sigs[count]) != 2) {
+            mpz_clears(msgs[count], sigs[count], NULL);
+            break;
+        }
+        mpz_set_str(msgs[count], names[count], 62); //same encoding keygen signs
+        count += 1;
+    }
+
+    uint8_t *bitmap = malloc((count + 7) / 8 + 1);
+    rsa_verify_batch(msgs, sigs, count, e, n, threads, bitmap);
+
+    size_t valid = 0;
+    for (size_t i = 0; i < count; i += 1) {
+        bool ok = (bitmap[i / 8] >> (i % 8)) & 1;
+        fprintf(outfile, "%s %s\n", names[i], ok ? "valid" : "invalid");
+        valid += ok;
+    }
+
+    if (test_v) {
+        fprintf(stderr, "verified %zu of %zu signatures\n", valid, count);
+    }
+
+    //clear, free and close files
+    for (size_t i = 0; i < count; i += 1) {
+        mpz_clears(msgs[i], sigs[i], NULL);
+    }
+    free(names);
+    free(msgs);
+    free(sigs);
+    free(bitmap);
+    mpz_clears(n, e, s, NULL);
+    fclose(pbfile);
+    fclose(infile);
+    fclose(outfile);
+
+    return (valid == count) ? 0 : 1;
+}